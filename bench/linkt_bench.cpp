@@ -0,0 +1,311 @@
+#include "parse.hpp"
+#include "replace.hpp"
+#include "node/wrapper.hpp"
+#include "node/scan.hpp"
+#include "node/animate.hpp"
+#include "tstring.hpp"
+
+#include <benchmark/benchmark.h>
+#include <atomic>
+#include <new>
+#include <random>
+#include <sstream>
+#include <fstream>
+#include <cstdlib>
+#include <unistd.h>
+
+using namespace std;
+
+// Every allocation of the program is counted, so that benchmarks can report their allocations per iteration
+static std::atomic<size_t> allocations{0};
+
+void* operator new(size_t size) {
+  allocations.fetch_add(1, std::memory_order_relaxed);
+  if (auto ptr = malloc(size ? size : 1))
+    return ptr;
+  throw std::bad_alloc();
+}
+void operator delete(void* ptr) noexcept { free(ptr); }
+void operator delete(void* ptr, size_t) noexcept { free(ptr); }
+
+// The memory held by the process, in kilobytes
+size_t rss_kb() {
+  std::ifstream statm("/proc/self/statm");
+  size_t total = 0, resident = 0;
+  statm >> total >> resident;
+  return resident * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+// Reports the allocations made from its construction to its destruction, as allocations per iteration
+// The memory held by the process at the end is reported too
+struct measure {
+  benchmark::State& state;
+  size_t start;
+
+  measure(benchmark::State& state) : state(state), start(allocations.load()) {}
+  ~measure() {
+    state.counters["allocs/op"] = benchmark::Counter(allocations.load() - start, benchmark::Counter::kAvgIterations);
+    state.counters["rss_kb"] = rss_kb();
+  }
+};
+
+// Workloads are generated from a fixed seed, so that every run and every commit measures the same input
+std::mt19937 make_random() {
+  return std::mt19937(4217);
+}
+
+node::wrapper_s parse_text(const string& text) {
+  std::stringstream ss{text};
+  node::errorlist err;
+  auto doc = std::make_shared<node::wrapper>();
+  parse_ini(ss, err, doc);
+  if (!err.empty())
+    throw std::logic_error("Workload doesn't parse: " + err.front().first + ": " + err.front().second);
+  return doc;
+}
+
+node::wrapper_s optimized(node::wrapper_s doc) {
+  node::clone_context context;
+  doc->optimize(context);
+  return doc;
+}
+
+// Keys in sections of 100, where each key reads a plain key of an earlier section
+string wide_text(int count) {
+  std::stringstream ss;
+  auto random = make_random();
+  for (int i = 0; i < count; i += 100) {
+    ss << "[s" << i / 100 << "]\n";
+    for (int j = 0; j < 100; j++) {
+      ss << "p" << j << " = plain " << i + j << "\n";
+      ss << "r" << j << " = ${s" << random() % (i / 100 + 1) << ".p" << random() % 100 << "}\n";
+    }
+  }
+  return ss.str();
+}
+
+// A chain of `depth` keys, where each key reads the one before it
+string deep_text(int depth) {
+  std::stringstream ss;
+  ss << "k0 = bottom\n";
+  for (int i = 1; i < depth; i++)
+    ss << "k" << i << " = ${k" << i - 1 << "}\n";
+  return ss.str();
+}
+
+// Keys that each interpolate three random keys before them, with fallbacks and caches on the way
+string ref_heavy_text(int count) {
+  std::stringstream ss;
+  auto random = make_random();
+  for (int i = 0; i < 10; i++)
+    ss << "v" << i << " = ${var " << i << "}\n";
+  for (int i = 0; i < count; i++) {
+    auto pick = [&] { return "v" + to_string(random() % 10); };
+    ss << "r" << i << " = ${" << pick() << "}-${" << pick() << " ? none}-${cache 1000 ${" << pick() << "}}\n";
+  }
+  return ss.str();
+}
+
+// A single template with `spots` interpolations of settable values
+string template_text(int spots) {
+  std::stringstream ss;
+  for (int i = 0; i < spots; i++)
+    ss << "v" << i << " = ${var value" << i << "}\n";
+  ss << "template = \"";
+  for (int i = 0; i < spots; i++)
+    ss << "<td>${v" << i << "}</td>";
+  ss << "\"\n";
+  return ss.str();
+}
+
+// A single template of `spots` numbers, like a status bar of readings, written as they are or with a format
+string numeric_template_text(int spots, bool formatted) {
+  std::stringstream ss;
+  for (int i = 0; i < spots; i++)
+    ss << "v" << i << " = ${var float 0." << i << "}\n";
+  ss << "template = \"";
+  for (int i = 0; i < spots; i++)
+    ss << "<td>${map 0:1 0:100 ${v" << i << "}" << (formatted ? " :%6.1" : "") << "}%</td><td>${clock 1000 60 0}s</td>";
+  ss << "\"\n";
+  return ss.str();
+}
+
+// Lines of text with a few replacements each, for replace_text
+string replace_input(int lines) {
+  std::stringstream ss;
+  auto random = make_random();
+  for (int i = 0; i < lines; i++)
+    ss << "line " << i << ": ${s" << random() % 10 << ".p" << random() % 100 << "} and ${s"
+       << random() % 10 << ".r" << random() % 100 << ":0:4}, then some more text to copy\n";
+  return ss.str();
+}
+
+void parse_wide(benchmark::State& state) {
+  auto text = wide_text(state.range(0));
+  measure m(state);
+  for (auto _ : state)
+    benchmark::DoNotOptimize(parse_text(text));
+  state.SetItemsProcessed(state.iterations() * state.range(0) * 2);
+}
+BENCHMARK(parse_wide)->Arg(1000)->Arg(10000)->Unit(benchmark::kMicrosecond);
+
+void lookup_wide(benchmark::State& state) {
+  auto doc = parse_text(wide_text(state.range(0)));
+  vector<string> paths;
+  auto random = make_random();
+  for (int i = 0; i < 1000; i++)
+    paths.push_back("s" + to_string(random() % (state.range(0) / 100)) + ".r" + to_string(random() % 100));
+  measure m(state);
+  size_t i = 0;
+  for (auto _ : state)
+    benchmark::DoNotOptimize(doc->get_child_ptr(paths[i++ % paths.size()]));
+}
+BENCHMARK(lookup_wide)->Arg(1000)->Arg(100000);
+
+// Reads the same 50 keys every iteration, like a bar refreshing its fields, one by one or as a prepared query
+void read_keys(benchmark::State& state) {
+  auto doc = optimized(parse_text(wide_text(10000)));
+  vector<string> paths;
+  auto random = make_random();
+  for (int i = 0; i < 50; i++)
+    paths.push_back("s" + to_string(random() % 100) + (random() % 2 ? ".p" : ".r") + to_string(random() % 100));
+  auto query = doc->prepare(paths);
+  vector<string> out(paths.size());
+  measure m(state);
+  for (auto _ : state) {
+    if (state.range(0)) {
+      node::wrapper::get_many(query, out.data());
+    } else {
+      for (size_t i = 0; i < paths.size(); i++)
+        out[i] = doc->get_child(paths[i]);
+    }
+    benchmark::DoNotOptimize(out.data());
+  }
+  state.SetItemsProcessed(state.iterations() * paths.size());
+}
+BENCHMARK(read_keys)->ArgName("prepared")->Arg(0)->Arg(1);
+
+void get_deep(benchmark::State& state) {
+  auto doc = parse_text(deep_text(state.range(0)));
+  if (state.range(1))
+    optimized(doc);
+  auto top = doc->get_child_ptr("k" + to_string(state.range(0) - 1));
+  measure m(state);
+  for (auto _ : state)
+    benchmark::DoNotOptimize(top->get());
+}
+BENCHMARK(get_deep)->ArgNames({"depth", "optimized"})->ArgsProduct({{10, 1000}, {0, 1}});
+
+void get_ref_heavy(benchmark::State& state) {
+  auto doc = parse_text(ref_heavy_text(state.range(0)));
+  if (state.range(1))
+    optimized(doc);
+  vector<node::base_s> keys;
+  for (int i = 0; i < state.range(0); i++)
+    keys.push_back(doc->get_child_ptr("r" + to_string(i)));
+  measure m(state);
+  for (auto _ : state)
+    for (auto& key : keys)
+      benchmark::DoNotOptimize(key->get());
+  state.SetItemsProcessed(state.iterations() * keys.size());
+}
+BENCHMARK(get_ref_heavy)->ArgNames({"keys", "optimized"})->ArgsProduct({{10000}, {0, 1}})
+    ->Unit(benchmark::kMicrosecond);
+
+void interpolate(benchmark::State& state) {
+  auto doc = optimized(parse_text(template_text(state.range(0))));
+  auto tmpl = doc->get_child_ptr("template"_ts);
+  int count = 0;
+  measure m(state);
+  for (auto _ : state) {
+    // Change one of the values every time, like a status bar that refreshes a single field
+    count++;
+    doc->set<string>("v" + to_string(count % state.range(0)), to_string(count));
+    benchmark::DoNotOptimize(tmpl->get());
+  }
+}
+BENCHMARK(interpolate)->Arg(10)->Arg(1000);
+
+void interpolate_numbers(benchmark::State& state) {
+  auto doc = optimized(parse_text(numeric_template_text(state.range(0), state.range(1))));
+  auto tmpl = doc->get_child_ptr("template"_ts);
+  int count = 0;
+  measure m(state);
+  for (auto _ : state) {
+    count++;
+    doc->set<float>("v" + to_string(count % state.range(0)), count % 100 / 100.0f);
+    benchmark::DoNotOptimize(tmpl->get());
+  }
+  state.SetItemsProcessed(state.iterations() * state.range(0) * 2);
+}
+BENCHMARK(interpolate_numbers)->ArgNames({"spots", "formatted"})->ArgsProduct({{10, 1000}, {0, 1}});
+
+void replace_large(benchmark::State& state) {
+  auto doc = parse_text(wide_text(1000));
+  auto input = replace_input(state.range(0));
+  measure m(state);
+  for (auto _ : state) {
+    std::stringstream is{input}, os;
+    replace_text(is, os, doc);
+    benchmark::DoNotOptimize(os.str());
+  }
+  state.SetBytesProcessed(state.iterations() * input.size());
+}
+BENCHMARK(replace_large)->Arg(10000)->Unit(benchmark::kMillisecond);
+
+void clone_tree(benchmark::State& state) {
+  auto doc = parse_text(ref_heavy_text(state.range(0)));
+  measure m(state);
+  for (auto _ : state) {
+    node::clone_context context;
+    context.optimize = state.range(1);
+    benchmark::DoNotOptimize(doc->clone(context));
+  }
+  state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(clone_tree)->ArgNames({"keys", "optimize"})->ArgsProduct({{10000}, {0, 1}})
+    ->Unit(benchmark::kMillisecond);
+
+// Steps `nodes` animations by one frame every iteration, reading them one by one or as a batch
+void animate(benchmark::State& state) {
+  std::stringstream ss;
+  ss << "target = ${var float 0}\n";
+  for (int i = 0; i < state.range(0); i++)
+    ss << "s" << i / 100 << ".a" << i % 100 << " = ${smooth 0.5 0.2 ${target}}\n";
+  auto doc = optimized(parse_text(ss.str()));
+  node::smooth_batch batch(doc);
+  vector<std::shared_ptr<const node::smooth>> nodes;
+  for (int i = 0; i < state.range(0); i++)
+    nodes.push_back(std::dynamic_pointer_cast<const node::smooth>(
+        doc->get_child_ptr("s" + to_string(i / 100) + ".a" + to_string(i % 100))));
+  int frame = 1000;
+  measure m(state);
+  for (auto _ : state) {
+    // Move the target every second, so that the nodes never come to rest
+    if (++frame % 60 == 0)
+      doc->set<float>("target"_ts, frame % 120 ? 100 : 0);
+    auto now = node::steady_time(frame * node::smooth::substep);
+    if (state.range(1)) {
+      benchmark::DoNotOptimize(batch.update(now));
+    } else {
+      for (auto& node : nodes)
+        benchmark::DoNotOptimize(node->advance(node->value->operator float(), now));
+    }
+  }
+  state.SetItemsProcessed(state.iterations() * nodes.size());
+}
+BENCHMARK(animate)->ArgNames({"nodes", "batched"})->ArgsProduct({{100, 10000}, {0, 1}});
+
+int main(int argc, char** argv) {
+  benchmark::Initialize(&argc, argv);
+  if (benchmark::ReportUnrecognizedArguments(argc, argv))
+    return 1;
+#ifdef LINKT_THREAD_SAFE
+  benchmark::AddCustomContext("linkt_thread_safe", "true");
+#else
+  benchmark::AddCustomContext("linkt_thread_safe", "false");
+#endif
+  benchmark::AddCustomContext("linkt_scan", node::scan_implementation());
+  benchmark::RunSpecifiedBenchmarks();
+  benchmark::Shutdown();
+}
@@ -11,6 +11,7 @@ get_filename_component(PUBLIC_HEADERS_DIR    ${CMAKE_CURRENT_LIST_DIR}/include A
 get_filename_component(PRIVATE_HEADERS_DIR   ${CMAKE_CURRENT_LIST_DIR}/private-headers ABSOLUTE)
 get_filename_component(SRC_DIR               ${CMAKE_CURRENT_LIST_DIR}/src ABSOLUTE)
 get_filename_component(TEST_DIR              ${CMAKE_CURRENT_LIST_DIR}/test ABSOLUTE)
+get_filename_component(BENCH_DIR             ${CMAKE_CURRENT_LIST_DIR}/bench ABSOLUTE)
 get_filename_component(LIBRARY_DIR           ${CMAKE_CURRENT_LIST_DIR}/lib ABSOLUTE)
 list(APPEND INCLUDE_DIRS ${PRIVATE_HEADERS_DIR} ${GENERATED_HEADERS_DIR})
 
@@ -25,34 +26,71 @@ set(NODE_HEADERS
   ${PUBLIC_HEADERS_DIR}/node/fallback.hpp
   ${PUBLIC_HEADERS_DIR}/node/reference.hpp
   ${PUBLIC_HEADERS_DIR}/node/strsub.hpp
+  ${PUBLIC_HEADERS_DIR}/node/deferred.hpp
+  ${PUBLIC_HEADERS_DIR}/node/profile.hpp
+  ${PUBLIC_HEADERS_DIR}/node/scan.hpp
+  ${PUBLIC_HEADERS_DIR}/node/shm.hpp
+  ${PUBLIC_HEADERS_DIR}/node/schedule.hpp
+  ${PUBLIC_HEADERS_DIR}/node/animate.hpp
   ${PUBLIC_HEADERS_DIR}/node/reference.hxx
   ${PUBLIC_HEADERS_DIR}/node/parse.hpp
   ${PUBLIC_HEADERS_DIR}/node/parse.hxx
+  ${PUBLIC_HEADERS_DIR}/node/evaluate.hpp
+  ${PUBLIC_HEADERS_DIR}/node/lock.hpp
+  ${PUBLIC_HEADERS_DIR}/node/handle.hpp
   ${STRINGS_PUBLIC_HEADERS_DIR}/tstring.hpp
 )
 set(LINI_HEADERS
   ${PUBLIC_HEADERS_DIR}/parse.hpp
   ${PUBLIC_HEADERS_DIR}/write.hpp
   ${PUBLIC_HEADERS_DIR}/replace.hpp
+  ${PUBLIC_HEADERS_DIR}/snapshot.hpp
+  ${PUBLIC_HEADERS_DIR}/daemon_protocol.hpp
 )
 
 # source files
 set(NODE_SOURCES
   ${SRC_DIR}/node/strsub.cpp
+  ${SRC_DIR}/node/deferred.cpp
+  ${SRC_DIR}/node/profile.cpp
+  ${SRC_DIR}/node/scan.cpp
+  ${SRC_DIR}/node/shm.cpp
+  ${SRC_DIR}/node/schedule.cpp
+  ${SRC_DIR}/node/animate.cpp
   ${SRC_DIR}/node/base.cpp
   ${SRC_DIR}/node/node.cpp
   ${SRC_DIR}/node/structs.cpp
   ${SRC_DIR}/node/wrapper.cpp
+  ${SRC_DIR}/node/evaluate.cpp
+  ${SRC_DIR}/node/handle.cpp
   ${TSTRING_SOURCES}
 )
 set(LINI_SOURCES
   ${SRC_DIR}/parse.cpp
   ${SRC_DIR}/write.cpp
   ${SRC_DIR}/replace.cpp
+  ${SRC_DIR}/snapshot.cpp
+  ${SRC_DIR}/daemon_protocol.cpp
+)
+
+set(REPLACE_SOURCES
+  ${SRC_DIR}/linkt_replace.cpp
+  ${SRC_DIR}/tree_files.cpp
+)
+set(DAEMON_SOURCES
+  ${SRC_DIR}/linkt_daemon.cpp
+  ${SRC_DIR}/tree_files.cpp
+)
+set(CLIENT_SOURCES
+  ${SRC_DIR}/linkt_client.cpp
+)
+
+set(BENCH_SOURCES
+  ${BENCH_DIR}/linkt_bench.cpp
 )
 
 set(INTERNAL_TESTS)
-set(EXTERNAL_TESTS node languages)
+set(EXTERNAL_TESTS node languages concurrency daemon)
 set(COPIED_FILES
   poll.sh
   key_file.txt
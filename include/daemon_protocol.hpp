@@ -0,0 +1,96 @@
+#pragma once
+
+#include "node/wrapper.hpp"
+
+#include <string>
+#include <string_view>
+#include <cstring>
+#include <cstdint>
+#include <unordered_map>
+
+// The protocol of linkt_daemon, over a Unix domain socket
+// Every message is a frame: its size as a 32-bit integer, then that many bytes. Integers are in the byte order of the host, because both ends are on the same machine
+// Responses are sent in the order of their requests, so clients may send many requests without waiting for the responses
+namespace daemon_protocol {
+  using std::string, std::string_view;
+
+  // The first byte of a request
+  // get: the path, then nothing else. Responds with a status, then the value
+  // set: the size of the path, the path, then the value. Responds with a status
+  // get_many: the number of paths, then the size and text of every path. Responds with `status_ok` and the number of values, then the status, size and text of every value
+  enum request_type : uint8_t {
+    request_get = 1,
+    request_set,
+    request_get_many,
+  };
+
+  // The first byte of a response, and of every value in a response to get_many
+  enum status : uint8_t {
+    // The values of node::failure
+    status_ok,
+    status_missing_key,
+    status_unavailable,
+    status_invalid_value,
+    status_error,
+    status_bad_request,
+    // The key of a set request can't be set
+    status_read_only,
+  };
+  static_assert(status_error == uint8_t(node::failure::error), "status must start with the values of node::failure");
+
+  // Frames above this size close the connection
+  constexpr uint32_t max_frame = 1 << 24;
+
+  inline void put_u32(string& out, uint32_t value) {
+    out.append((const char*)&value, sizeof(value));
+  }
+
+  inline void put_sized(string& out, string_view text) {
+    put_u32(out, text.size());
+    out.append(text);
+  }
+
+  // Reserves the size of a frame at the end of `out`, and returns its position for `end_frame`
+  inline size_t begin_frame(string& out) {
+    auto pos = out.size();
+    out.append(sizeof(uint32_t), '\0');
+    return pos;
+  }
+
+  inline void end_frame(string& out, size_t pos) {
+    uint32_t size = out.size() - pos - sizeof(uint32_t);
+    memcpy(&out[pos], &size, sizeof(size));
+  }
+
+  // Takes the first frame out of `data` if it has arrived completely
+  // Returns false if it hasn't, or if it is too large, which is reported with `too_large`
+  bool next_frame(string_view& data, string_view& frame, bool& too_large);
+
+  // Reads the fields of a frame. Reading past its end returns empty fields and marks the frame invalid
+  struct frame_reader {
+    string_view rest;
+    bool valid{true};
+
+    explicit frame_reader(string_view frame) : rest(frame) {}
+
+    string_view bytes(size_t count);
+    uint8_t u8();
+    uint32_t u32();
+    string_view sized();
+  };
+
+  // Answers the requests of the daemon from a tree
+  struct responder {
+    node::wrapper_s tree;
+    // The nodes of the paths requested so far, so that each path is only looked up once
+    std::unordered_map<string, node::base_s> nodes;
+
+    explicit responder(node::wrapper_s tree);
+
+    node::base_s find(string_view path);
+    // Evaluates the key at `path`, and appends its status then its value to `out`
+    void put_value(string& out, string_view path, bool sized);
+    // Appends the response to the request in `frame` to `out`, as a frame
+    void respond(string_view frame, string& out);
+  };
+}
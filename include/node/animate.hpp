@@ -0,0 +1,42 @@
+#pragma once
+
+#include "node.hpp"
+#include "wrapper.hpp"
+
+#include <array>
+#include <vector>
+
+namespace node {
+  // Steps every `smooth` of a tree together once per frame, so that a program animating many of them reads their targets once and runs the simulation over contiguous arrays
+  // Reading the nodes afterwards in the same frame returns their values without stepping them again
+  class smooth_batch {
+  public:
+    explicit smooth_batch(wrapper_s tree);
+
+    // Finds the `smooth` nodes of the tree again, after the tree has been changed
+    void collect();
+
+    // Steps every node up to `now`. Returns the number of nodes that are still moving
+    size_t update(steady_time now = std::chrono::steady_clock::now());
+
+    size_t size() const { return nodes.size(); }
+
+  private:
+    wrapper_s tree;
+    std::vector<std::shared_ptr<const smooth>> nodes;
+    // The distinct targets of the nodes, which are read once per update, and the index of the target of each node
+    std::vector<std::shared_ptr<base<float>>> sources;
+    std::vector<size_t> source_of;
+    std::vector<float> source_values;
+    std::vector<char> source_failed;
+    // The nodes are stepped in blocks, so that their fields stay in the cache between the passes over them
+    static constexpr size_t block_size = 256;
+    // The nodes of a block that are moving, one array for each of their fields
+    std::array<const smooth*, block_size> moving;
+    std::array<smooth::state, block_size> previous;
+    std::array<float, block_size> current, velocity, target, spring, drag;
+    std::array<int, block_size> steps;
+
+    size_t update_block(size_t first, size_t last, steady_time now);
+  };
+}
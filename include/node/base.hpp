@@ -1,11 +1,17 @@
 #pragma once
 
 #include "structs.hpp"
+#include "lock.hpp"
 
 #include <string>
+#include <string_view>
 #include <memory>
 #include <functional>
+#include <chrono>
 #include <cmath>
+#ifdef LINKT_CHECK_VIEWS
+#include <atomic>
+#endif
 
 namespace node {
   struct node_error : std::logic_error { using logic_error::logic_error; };
@@ -13,6 +19,100 @@ namespace node {
   struct clone_error : std::logic_error { using logic_error::logic_error; };
   struct parse_error : std::logic_error { using logic_error::logic_error; };
 
+  using steady_time = std::chrono::time_point<std::chrono::steady_clock>;
+
+  // Why a node couldn't be evaluated, for evaluations that don't throw
+  enum class failure : uint8_t { none, missing_key, unavailable, invalid_value, error };
+
+  // Either the value of a node or the reason it couldn't be evaluated
+  template<class T> struct
+  outcome {
+    T value{};
+    failure error{failure::none};
+    // Why the node failed, as far as it is known, for the exception thrown by the callers that need one
+    string message;
+
+    outcome(T value) : value(std::move(value)) {}
+    outcome(failure error, string message = {}) : error(error), message(std::move(message)) {}
+
+    explicit operator bool() const {
+      return error == failure::none;
+    }
+  };
+
+  // Selects the type that a node is evaluated as
+  template<class T> struct as_type {};
+
+  // A node that hands out views of a buffer it owns, and counts the changes to that buffer
+  // The count is only kept in builds with LINKT_CHECK_VIEWS, where views are checked against it
+  struct view_source {
+#ifdef LINKT_CHECK_VIEWS
+    mutable std::atomic<unsigned> epoch{0};
+
+    view_source() {}
+    // Copies are new buffers, no view of them exists yet
+    view_source(const view_source&) {}
+    view_source& operator=(const view_source&) { changed(); return *this; }
+
+    void changed() const {
+      epoch.fetch_add(1, std::memory_order_relaxed);
+    }
+#else
+    void changed() const {}
+#endif
+  };
+
+#ifdef LINKT_CHECK_VIEWS
+  // A view of the value of a node, which throws when it is read after the node changed its value
+  // Only the members below are checked, the view is no longer checked once converted to a plain `std::string_view`
+  class text_view : public std::string_view {
+    const view_source* source{nullptr};
+    unsigned epoch{0};
+
+    void check() const {
+      if (source && source->epoch.load(std::memory_order_relaxed) != epoch)
+        throw node_error("text_view: The node changed its value after this view was taken");
+    }
+
+  public:
+    text_view() {}
+    text_view(std::string_view text, const view_source* source = nullptr)
+        : std::string_view(text), source(source), epoch(source ? source->epoch.load(std::memory_order_relaxed) : 0) {}
+
+    const char* data() const { check(); return std::string_view::data(); }
+    size_t size() const { check(); return std::string_view::size(); }
+    size_t length() const { return size(); }
+    bool empty() const { return size() == 0; }
+    const_iterator begin() const { check(); return std::string_view::begin(); }
+    const_iterator end() const { check(); return std::string_view::end(); }
+    const_reference operator[](size_t pos) const { check(); return std::string_view::operator[](pos); }
+    std::string_view substr(size_t pos = 0, size_t count = npos) const { check(); return std::string_view::substr(pos, count); }
+    explicit operator string() const { check(); return string(std::string_view(*this)); }
+  };
+
+  inline text_view make_view(std::string_view text, const view_source& source) {
+    return text_view(text, &source);
+  }
+#else
+  using text_view = std::string_view;
+
+  inline text_view make_view(std::string_view text, const view_source&) {
+    return text;
+  }
+#endif
+
+  // Returns a view of `buffer`, which the caller has locked
+  // Other threads may rewrite the buffer once it is unlocked, so thread-safe builds copy it to `scratch` instead
+  inline text_view locked_view(const string& buffer, [[maybe_unused]] const view_source& source,
+      [[maybe_unused]] string& scratch) {
+#ifdef LINKT_THREAD_SAFE
+    scratch = buffer;
+    return std::string_view(scratch);
+#else
+    return make_view(buffer, source);
+#endif
+  }
+
   template<> struct
   base<string> {
     virtual ~base() {}
@@ -25,14 +125,66 @@ namespace node {
       return false;
     }
 
+    // Calls `processor` on every node that is read when this node is evaluated
+    virtual void iterate_dependencies(std::function<void(const base_s&)>) const {}
+
+    // Takes over the live state of `previous`, the counterpart of this node in an older tree
+    // Does nothing if `previous` is of another type
+    virtual void carry_state(const base<string>&) {}
+
+    // Drops the results computed from the dependencies, because some of them have been replaced
+    virtual void invalidate() {}
+
+    // Returns the next time that the value may change by itself, without a change to the dependencies
+    // Nodes that only change with their dependencies return `steady_time::max()`, and animations that change on every read return the current time
+    virtual steady_time next_change() const {
+      return steady_time::max();
+    }
+
+    // Returns a file descriptor that becomes readable when the value changes, or -1 if there is none
+    virtual int change_fd() const {
+      return -1;
+    }
+
+    // Evaluates the node without throwing
+    // Nodes that fail often, like references and commands, report their failures here without building an exception
+    virtual outcome<string> try_get(as_type<string>) const {
+      try {
+        return get();
+      } catch (const std::exception& e) {
+        return {failure::error, e.what()};
+      }
+    }
+
+    // Returns the value of the node without copying it, if the node keeps its value in a buffer
+    // The view is valid until the node is evaluated again or changed. Nodes that don't keep their value write it to `scratch` and return a view of that
+    virtual text_view view(string& scratch) const {
+      scratch = get();
+      return std::string_view(scratch);
+    }
+
     string get() const {
       return operator string();
     }
   };
 
+  // Evaluates `node` as `T`, returning the reason of a failure instead of throwing
+  template<class T> inline outcome<T>
+  try_get(const base<T>& node) {
+    return node.try_get(as_type<T>{});
+  }
+
+  // While optimizing, replace `result`, the clone of `source`, with a plain value if it's fixed
+  // Nodes that fail to evaluate are kept, so that they report their errors when read
+  base_s fold_constant(const base_s& source, base_s result, clone_context& context);
+
+  // Clone a key ahead of its place in the tree, folding it and wrapping it for the profiler of `context`
+  // Its path is only known when the clone reaches it
+  base_s profiled_clone(const base_s& source, clone_context& context);
+
   template<class T> std::shared_ptr<base<T>>
   checked_clone(base_s source, clone_context& context, const string& msg) {
-      auto result = source->clone(context);
+      auto result = fold_constant(source, source->clone(context), context);
       auto converted = std::dynamic_pointer_cast<base<T>>(result
           ?: throw clone_error("clone_error: Empty clone result in: " + msg));
       return converted
@@ -40,17 +192,63 @@ namespace node {
             + typeid(result.get()).name());
   }
 
+  // Identifies a cloned node inside the structural key of its parent
+  // Fixed plain values are identified by their value, other nodes by their address
+  string structural_id(const base_s& node);
+  // Identifies the calculator of a cache inside its structural key
+  string calculator_id(const base_s& calculator);
+
+  // While optimizing, returns the node shared under `key` if there is one, otherwise shares `node` under `key`
+  base_s share_node(clone_context& context, const string& key, base_s node);
+
   template<class T> struct
   base : base<string> {
     virtual explicit operator T() const = 0;
+
+    using base<string>::try_get;
+    virtual outcome<T> try_get(as_type<T>) const {
+      try {
+        return operator T();
+      } catch (const std::exception& e) {
+        return {failure::error, e.what()};
+      }
+    }
   };
 
+  // The size of a buffer that holds any number written by `write_number`
+  constexpr size_t number_size = 64;
+  // The most digits after the point that `write_number` writes
+  constexpr int max_precision = 20;
+
+  // Writes `value` to `out`, with `precision` zeros after the point if it's positive, and returns the end of what was written
+  char* write_number(char* out, long long value, int precision = -1);
+  inline char* write_number(char* out, int value, int precision = -1) {
+    return write_number(out, (long long)value, precision);
+  }
+  // Writes `value` with `precision` digits after the point, or without `precision`, with up to 6 digits and no trailing zeros
+  char* write_number(char* out, float value, int precision = -1);
+
   template<> struct
   base<int> : virtual base<string> {
     virtual explicit operator int() const = 0;
 
+    // Whether the string of the node is its number written by `write_number`, so that it can be written without making that string
+    virtual bool prints_number() const {
+      return true;
+    }
+
+    using base<string>::try_get;
+    virtual outcome<int> try_get(as_type<int>) const {
+      try {
+        return operator int();
+      } catch (const std::exception& e) {
+        return {failure::error, e.what()};
+      }
+    }
+
     explicit operator string() const {
-      return std::to_string(operator int());
+      char buffer[number_size];
+      return string(buffer, write_number(buffer, operator int()));
     }
   };
 
@@ -63,14 +261,22 @@ namespace node {
   base<float> : base<int> {
     virtual explicit operator float() const = 0;
 
+    using base<int>::try_get;
+    virtual outcome<float> try_get(as_type<float>) const {
+      try {
+        return operator float();
+      } catch (const std::exception& e) {
+        return {failure::error, e.what()};
+      }
+    }
+
     virtual explicit operator int() const {
       return std::lround(operator float());
     }
 
     explicit operator string() const {
-      std::string str = std::to_string(operator float());
-      auto erase = str.find_last_not_of('0');
-      return str.erase(str[erase] == '.' ? erase : (erase + 1), std::string::npos );
+      char buffer[number_size];
+      return string(buffer, write_number(buffer, operator float()));
     }
   };
 
@@ -91,24 +297,47 @@ namespace node {
       return true;
     }
 
+    // The value of a plain node never changes, so its views never go stale
+    text_view view(string& scratch) const {
+      if constexpr(std::is_same<T, string>::value)
+        return std::string_view(value);
+      else return base<string>::view(scratch);
+    }
   };
 
   template<class T> struct
-  settable_plain : plain<T>, settable<T> {
+  settable_plain : plain<T>, settable<T>, view_source {
+    mutable node_mutex mutex;
     using plain<T>::plain;
 
+    explicit operator T() const {
+      node_lock lock(mutex);
+      return plain<T>::value;
+    }
+
     base_s clone(clone_context&) const {
+        node_lock lock(mutex);
         return std::make_shared<settable_plain<T>>(T(plain<T>::value));
     }
 
     bool set(const T& newval) {
+        node_lock lock(mutex);
         plain<T>::value = newval;
+        view_source::changed();
         return true;
     }
 
     bool is_fixed() const {
         return false;
     }
+
+    // Views stay valid until the next `set`
+    text_view view(string& scratch) const {
+      if constexpr(std::is_same<T, string>::value) {
+        node_lock lock(mutex);
+        return locked_view(plain<T>::value, *this, scratch);
+      } else return base<string>::view(scratch);
+    }
   };
 
   template<class T> T
@@ -123,6 +352,15 @@ namespace node {
     }
   }
 
+  template<class T> inline outcome<T>
+  try_parse(const string& str) {
+    try {
+      return parse<T>(str.data(), str.size());
+    } catch(const std::exception& e) {
+      return {failure::invalid_value, e.what()};
+    }
+  }
+
   template<class Type, class Return> std::shared_ptr<Type>
   parse_plain(const tstring& value) {
     return std::make_shared<Type>(parse<Return>(value, "parse_plain"));
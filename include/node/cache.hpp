@@ -6,21 +6,37 @@
 
 namespace node {
   template<class T> struct
-  cache : base<T> {
+  cache : base<T>, view_source {
     std::shared_ptr<base<T>> calculator;
     std::shared_ptr<base<int>> duration_ms;
     mutable T cache_value;
     mutable steady_time cache_expire;
+    mutable node_mutex mutex;
 
     explicit operator T() const;
+    // Views of a string cache stay valid until its value is calculated again
+    text_view view(string& scratch) const;
     base_s clone(clone_context&) const;
+    void carry_state(const base<string>& previous);
+    void invalidate();
+    // The value is calculated again when it expires
+    steady_time next_change() const;
+    // The calculator is the only thing that can change the value
+    bool is_fixed() const { return calculator->is_fixed(); }
+    void iterate_dependencies(std::function<void(const base_s&)> processor) const {
+      processor(calculator);
+      processor(duration_ms);
+    }
 
       static std::shared_ptr<cache<T>>
     parse(parse_context&, parse_preprocessed&);
+  private:
+    // Calculates the value again if it expired. The caller must hold `mutex`
+    void refresh() const;
   };
 
   template<class T> struct
-  refcache : base<T> {
+  refcache : base<T>, view_source {
     base_s source;
     std::shared_ptr<base<T>> calculator;
     int duration_ms;
@@ -28,26 +44,52 @@ namespace node {
     mutable string prevsrc;
     mutable steady_time cache_expire;
     mutable bool unset;
+    mutable node_mutex mutex;
 
     explicit operator T() const;
+    text_view view(string& scratch) const;
     base_s clone(clone_context&) const;
+    void carry_state(const base<string>& previous);
+    void invalidate();
+    steady_time next_change() const;
+    bool is_fixed() const { return calculator->is_fixed(); }
+    void iterate_dependencies(std::function<void(const base_s&)> processor) const {
+      processor(source);
+      processor(calculator);
+    }
 
       static std::shared_ptr<refcache<T>>
     parse(parse_context&, parse_preprocessed&);
+  private:
+    // Calculates the value again if the source changed or the value expired. The caller must hold `mutex`
+    void refresh() const;
   };
 
   template<class T> struct
-  arrcache : base<T> {
+  arrcache : base<T>, view_source {
     std::shared_ptr<base<int>> source;
     std::shared_ptr<base<T>> calculator;
     mutable std::vector<std::optional<T>> cache_arr;
+    mutable node_mutex mutex;
 
     explicit operator T() const;
     T get(size_t index) const;
+    // Views of a cached string stay valid until the cache is invalidated
+    text_view view(string& scratch) const;
     base_s clone(clone_context&) const;
+    void carry_state(const base<string>& previous);
+    void invalidate();
+    bool is_fixed() const { return source->is_fixed() && calculator->is_fixed(); }
+    void iterate_dependencies(std::function<void(const base_s&)> processor) const {
+      processor(source);
+      processor(calculator);
+    }
 
       static std::shared_ptr<arrcache<T>>
     parse(parse_context&, parse_preprocessed&);
+  private:
+    // The caller must hold `mutex`
+    const T& load(size_t index) const;
   };
 }
 
@@ -2,23 +2,67 @@
 
 namespace node {
 
-template<class T>
-cache<T>::operator T() const {
+template<class T> void
+cache<T>::refresh() const {
   if (auto now = std::chrono::steady_clock::now(); now > cache_expire) {
     cache_value = calculator->operator T();
     cache_expire = now + std::chrono::milliseconds(duration_ms->operator int());
+    this->changed();
   }
+}
+
+template<class T>
+cache<T>::operator T() const {
+  node_lock lock(mutex);
+  refresh();
   return cache_value;
 }
 
+template<class T> text_view
+cache<T>::view(string& scratch) const {
+  if constexpr(std::is_same<T, string>::value) {
+    node_lock lock(mutex);
+    refresh();
+    return locked_view(cache_value, *this, scratch);
+  } else return base<string>::view(scratch);
+}
+
 template<class T> base_s
 cache<T>::clone(clone_context& context) const {
   auto result = std::make_shared<cache>();
   result->calculator = checked_clone<T>(calculator, context, "cache::clone");
   result->duration_ms = checked_clone<int>(duration_ms, context, "cache::clone");
-  result->cache_value = cache_value;
-  result->cache_expire = cache_expire;
-  return result;
+  {
+    node_lock lock(mutex);
+    result->cache_value = cache_value;
+    result->cache_expire = cache_expire;
+  }
+  // Identical caches are shared, so that their calculator is evaluated once per period
+  return share_node(context, string("cache ") + typeid(T).name()
+      + calculator_id(result->calculator) + structural_id(result->duration_ms), result);
+}
+
+template<class T> void
+cache<T>::carry_state(const base<string>& previous) {
+  if (auto prev = dynamic_cast<const cache*>(&previous)) {
+    node_lock prev_lock(prev->mutex);
+    node_lock lock(mutex);
+    cache_value = prev->cache_value;
+    cache_expire = prev->cache_expire;
+    this->changed();
+  }
+}
+
+template<class T> void
+cache<T>::invalidate() {
+  node_lock lock(mutex);
+  cache_expire = steady_time();
+}
+
+template<class T> steady_time
+cache<T>::next_change() const {
+  node_lock lock(mutex);
+  return cache_expire;
 }
 
 template<class T> std::shared_ptr<cache<T>>
@@ -31,23 +75,40 @@ cache<T>::parse(parse_context& context, parse_preprocessed& prep) {
   return result;
 }
 
-template<class T>
-refcache<T>::operator T() const {
+template<class T> void
+refcache<T>::refresh() const {
   auto now = std::chrono::steady_clock::now();
   if (auto newsrc = source->get(); newsrc != prevsrc || now > cache_expire || unset) {
     cache_value = calculator->operator T();
     prevsrc = newsrc;
     unset = false;
     cache_expire = now + std::chrono::milliseconds(duration_ms);
+    this->changed();
   }
+}
+
+template<class T>
+refcache<T>::operator T() const {
+  node_lock lock(mutex);
+  refresh();
   return cache_value;
 }
 
+template<class T> text_view
+refcache<T>::view(string& scratch) const {
+  if constexpr(std::is_same<T, string>::value) {
+    node_lock lock(mutex);
+    refresh();
+    return locked_view(cache_value, *this, scratch);
+  } else return base<string>::view(scratch);
+}
+
 template<class T> base_s
 refcache<T>::clone(clone_context& context) const {
   auto result = std::make_shared<refcache>();
   result->source = checked_clone<string>(source, context, "refcache::clone");
   result->calculator = checked_clone<T>(calculator, context, "refcache::clone");
+  node_lock lock(mutex);
   result->cache_value = cache_value;
   result->duration_ms = duration_ms;
   result->prevsrc = prevsrc;
@@ -55,6 +116,32 @@ refcache<T>::clone(clone_context& context) const {
   return result;
 }
 
+template<class T> void
+refcache<T>::carry_state(const base<string>& previous) {
+  if (auto prev = dynamic_cast<const refcache*>(&previous)) {
+    node_lock prev_lock(prev->mutex);
+    node_lock lock(mutex);
+    cache_value = prev->cache_value;
+    prevsrc = prev->prevsrc;
+    cache_expire = prev->cache_expire;
+    unset = prev->unset;
+    this->changed();
+  }
+}
+
+template<class T> void
+refcache<T>::invalidate() {
+  node_lock lock(mutex);
+  unset = true;
+}
+
+// Changes of the source are found by evaluating it, so only the expiry is reported
+template<class T> steady_time
+refcache<T>::next_change() const {
+  node_lock lock(mutex);
+  return unset ? steady_time() : cache_expire;
+}
+
 template<class T> std::shared_ptr<refcache<T>>
 refcache<T>::parse(parse_context& context, parse_preprocessed& prep) {
   if (prep.token_count != 4)
@@ -74,6 +161,21 @@ arrcache<T>::operator T() const {
 
 template<class T> T
 arrcache<T>::get(size_t index) const {
+  node_lock lock(mutex);
+  return load(index);
+}
+
+template<class T> text_view
+arrcache<T>::view(string& scratch) const {
+  if constexpr(std::is_same<T, string>::value) {
+    auto index = source->operator int();
+    node_lock lock(mutex);
+    return locked_view(load(index), *this, scratch);
+  } else return base<string>::view(scratch);
+}
+
+template<class T> const T&
+arrcache<T>::load(size_t index) const {
   if (index >= cache_arr.size())
     throw node_error("Index larger than cache maximum: " + std::to_string(index) + " > " + std::to_string(cache_arr.size() - 1));
   auto& result = cache_arr.operator[](index);
@@ -88,12 +190,32 @@ arrcache<T>::clone(clone_context& context) const {
   auto result = std::make_shared<arrcache>();
   result->source = checked_clone<int>(source, context, "arrcache::clone");
   result->calculator = checked_clone<T>(calculator, context, "arrcache::clone");
+  node_lock lock(mutex);
   result->cache_arr.reserve(cache_arr.size() + 1);
   for (size_t i = 0; i < cache_arr.size(); i++)
     result->cache_arr.emplace_back();
   return result;
 }
 
+template<class T> void
+arrcache<T>::carry_state(const base<string>& previous) {
+  if (auto prev = dynamic_cast<const arrcache*>(&previous)) {
+    node_lock prev_lock(prev->mutex);
+    node_lock lock(mutex);
+    for (size_t i = 0; i < cache_arr.size() && i < prev->cache_arr.size(); i++)
+      cache_arr[i] = prev->cache_arr[i];
+    this->changed();
+  }
+}
+
+template<class T> void
+arrcache<T>::invalidate() {
+  node_lock lock(mutex);
+  for (auto& value : cache_arr)
+    value.reset();
+  this->changed();
+}
+
 inline std::optional<unsigned long int> parse_ulong(const char* str, size_t len) {
   char* end;
   auto result = std::strtoul(str, &end, 10);
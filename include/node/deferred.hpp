@@ -0,0 +1,38 @@
+#pragma once
+
+#include "base.hpp"
+
+namespace node {
+  // Holds the text of a value, which is only parsed when it is first read or cloned
+  // The parsed node then takes the place of this one in the tree, and this node forwards to it
+  // Parsing changes the tree, so a tree with deferred nodes must be cloned before it is read from multiple threads
+  struct deferred : base<string> {
+    using parser = base_s (*)(parse_context&, tstring&);
+
+    // Values with `clone` or `save` expressions add keys to the tree while being parsed, so they can't wait to be read
+    static bool can_defer(const tstring& value);
+
+    // `place_path` is the path of the key relative to `context.parent`
+    deferred(const parse_context& context, const tstring& place_path, const tstring& value, parser parse);
+
+    explicit operator string() const;
+    text_view view(string& scratch) const;
+    base_s clone(clone_context&) const;
+    bool is_fixed() const;
+    // Parses the text, so that the nodes read by the value are known to whoever walks the tree
+    void iterate_dependencies(std::function<void(const base_s&)> processor) const;
+    // Returns the parsed node, parsing the text first if necessary
+    // If the text can't be parsed, the error is reported to the hook of the parse, then thrown on every call
+    base_s get_parsed() const;
+
+  private:
+    std::weak_ptr<wrapper> parent_w, root_w;
+    string path, place_path, text;
+    parser parse;
+    error_hook on_error;
+    mutable base_s parsed;
+    mutable string error;
+    mutable bool done{false};
+    mutable node_mutex mutex;
+  };
+}
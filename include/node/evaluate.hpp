@@ -0,0 +1,80 @@
+#pragma once
+
+#include "wrapper.hpp"
+
+#include <map>
+#include <deque>
+#include <mutex>
+#include <atomic>
+#include <thread>
+#include <exception>
+#include <functional>
+#include <unordered_set>
+#include <condition_variable>
+
+namespace node {
+  // Runs submitted tasks, possibly concurrently. `wait` blocks until every submitted task is done
+  struct executor {
+    virtual ~executor() {}
+    virtual void submit(std::function<void()> task) = 0;
+    virtual void wait() = 0;
+  };
+
+  // Runs the tasks on the calling thread as soon as they are submitted
+  struct inline_executor : executor {
+    void submit(std::function<void()> task) { task(); }
+    void wait() {}
+  };
+
+  // A work-stealing thread pool: every worker owns a queue and steals from the others when its own queue is empty
+  // The first exception thrown by a task is rethrown by `wait`
+  class thread_pool : public executor {
+    struct worker_queue {
+      std::mutex mutex;
+      std::deque<std::function<void()>> tasks;
+    };
+    std::vector<std::unique_ptr<worker_queue>> queues;
+    std::vector<std::thread> threads;
+    std::mutex state_mutex;
+    std::condition_variable wakeup, idle;
+    size_t queued{0}, pending{0};
+    bool stopping{false};
+    std::atomic<size_t> next_queue{0};
+    std::exception_ptr error;
+
+    bool take(size_t index, std::function<void()>& task);
+    void run(size_t index);
+  public:
+    explicit thread_pool(unsigned thread_count = std::thread::hardware_concurrency());
+    ~thread_pool();
+    void submit(std::function<void()> task);
+    void wait();
+  };
+
+  // Maps the path of each key to its value
+  using snapshot = std::map<string, string>;
+
+  // Evaluate every key under `root`. Keys that share a dependency are evaluated on the same task, in path order, so the nodes don't need to be thread-safe
+  // Keys that fail to evaluate are left out of the result and reported to `errors`
+  snapshot evaluate_all(const wrapper_s& root, executor&, errorlist& errors);
+  snapshot evaluate_all(const wrapper_s& root, executor&);
+
+  // Replace every fixed `color` key under `root` with a plain value of its current color, returning the number of keys replaced
+  // Colors that read a value that can change, like an env or a cmd, are left as they are, so they keep following it
+  // Colors are grouped by their processor, and each group converts its distinct inputs once, on a task of its own
+  // Keys that fail to evaluate are kept and reported to `errors`
+  size_t bake_colors(const wrapper_s& root, executor&, errorlist& errors);
+
+  // Call `invalidate` on every node under `root` that reads one of `changed`, directly or through other nodes
+  // If `removed`, references that can't find their source count as changed too, since the key they read may be gone
+  // Returns the number of nodes invalidated
+  size_t invalidate_dependents(const wrapper_s& root, const std::unordered_set<const base<string>*>& changed,
+      bool removed);
+  // Like the above, but only visits `roots` and the nodes they read
+  // Nodes for which `unaffected` returns true are taken not to read any of `changed`, and aren't visited
+  size_t invalidate_dependents(const std::vector<base_s>& roots, const std::unordered_set<const base<string>*>& changed,
+      bool removed, const std::function<bool(const base<string>*)>& unaffected);
+
+  // Returns whether `node` is a reference that can't find its source
+  bool is_broken_reference(const base<string>& node);
+}
@@ -3,6 +3,9 @@
 #include "base.hpp"
 
 namespace node {
+  // Counts a fallback in the statistics of the key being evaluated, if it is profiled
+  void note_fallback();
+
   template<class T> struct
   with_fallback {
     std::shared_ptr<base<T>> fallback;
@@ -11,11 +14,22 @@ namespace node {
 
     explicit with_fallback(const std::shared_ptr<base<T>>& fallback) : fallback(fallback) {}
 
-    [[nodiscard]] inline string
-    use_fallback(const string& message) const {
-      if (!fallback) throw node_error("Failure: " + message + ". No fallback was found");
+    // Returns the value of the fallback, or throws the message returned by `describe` if there is none
+    // The message is only built when it's thrown, failures with a fallback are common
+    template<class Describe> [[nodiscard]] string
+    use_fallback(Describe&& describe) const {
+      if (!fallback) throw node_error("Failure: " + describe() + ". No fallback was found");
+      note_fallback();
       return fallback->get();
     }
+
+    // Like `use_fallback`, but returns `error` with the message instead of throwing if there is no fallback
+    template<class Describe> outcome<string>
+    try_fallback(failure error, Describe&& describe) const {
+      if (!fallback) return {error, "Failure: " + describe() + ". No fallback was found"};
+      note_fallback();
+      return try_get<string>(*fallback);
+    }
   };
 
   template<class T> struct
@@ -28,12 +42,19 @@ namespace node {
         throw required_field_null_error("fallback_wrapper::fallback_wrapper");
     }
 
+    // Failures of the source don't throw, only those of the fallback do
     operator T() const {
-      try {
-        return source->operator T();
-      } catch (const std::exception& e) {
-        return with_fallback<T>::fallback->operator T();
-      }
+      if (auto result = node::try_get(*source))
+        return std::move(result.value);
+      note_fallback();
+      return with_fallback<T>::fallback->operator T();
+    }
+
+    outcome<T> try_get(as_type<T>) const {
+      if (auto result = node::try_get(*source))
+        return result;
+      note_fallback();
+      return node::try_get(*with_fallback<T>::fallback);
     }
 
     bool set(const T& value) {
@@ -54,9 +75,15 @@ namespace node {
       return std::make_shared<fallback_wrapper>(src_clone, fb_clone);
     }
 
+    void iterate_dependencies(std::function<void(const base_s&)> processor) const {
+      processor(source);
+      processor(with_fallback<T>::fallback);
+    }
+
     bool is_fixed() const {
       try {
-        return source->is_fixed();
+        // The fallback is read whenever the source fails, so it must be fixed too
+        return source->is_fixed() && with_fallback<T>::fallback->is_fixed();
       } catch (const std::exception& e) {
         return false;
       }
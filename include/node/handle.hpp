@@ -0,0 +1,36 @@
+#pragma once
+
+#include "wrapper.hpp"
+
+#include <mutex>
+#include <future>
+#include <functional>
+
+namespace node {
+  // Publishes snapshots of a tree, so that it can be reloaded while other threads are reading it
+  // Readers keep the snapshot they got alive, so references inside it never see their ancestors destroyed
+  class tree_handle {
+    wrapper_s root;
+    std::mutex reload_mutex;
+
+  public:
+    // Builds a new tree, reporting parse errors to the given list
+    using loader = std::function<wrapper_s(errorlist&)>;
+
+    explicit tree_handle(wrapper_s root = std::make_shared<wrapper>());
+
+    // Returns the current snapshot without waiting for reloads in progress
+    wrapper_s get() const;
+
+    // Replace the current snapshot. If `keep_state` is true, nodes in `new_root` take over the state of their counterparts in the current snapshot
+    void publish(wrapper_s new_root, bool keep_state = false);
+
+    // Load and optimize a new tree on another thread, then publish it. The future holds the errors of parsing and optimizing
+    // If the loader throws, the current snapshot is kept and the future rethrows the exception
+    // Like any future from std::async, the returned future blocks on destruction until the reload is done
+    std::future<errorlist> reload(loader load, bool keep_state = true);
+  };
+
+  // Make every node of `current` take over the state of the node at the same place in `previous`
+  void carry_state(const wrapper& current, const wrapper& previous);
+}
@@ -0,0 +1,17 @@
+#pragma once
+
+#include <mutex>
+
+namespace node {
+#ifdef LINKT_THREAD_SAFE
+  using node_mutex = std::mutex;
+#else
+  // Concurrent reads are disabled in this build, so nodes skip locking entirely
+  struct node_mutex {
+    void lock() {}
+    void unlock() {}
+    bool try_lock() { return true; }
+  };
+#endif
+  using node_lock = std::lock_guard<node_mutex>;
+}
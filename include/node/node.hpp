@@ -5,36 +5,69 @@
 #include "parse.hpp"
 
 #include <chrono>
+#include <atomic>
+#include <array>
+#include <vector>
+#include <cstdint>
 #include <cspace/processor.hpp>
 #include <cspace/gradient.hpp>
 #include <poll.h>
 
 namespace node {
-  using steady_time = std::chrono::time_point<std::chrono::steady_clock>;
-
   template<class T> struct
   nested {
     std::shared_ptr<base<T>> value;
 
     nested(parse_context& context, parse_preprocessed& prep);
     nested(const nested<T>& other, clone_context& context);
+    explicit nested(std::shared_ptr<base<T>> value) : value(move(value)) {}
     nested() {}
   };
 
   struct meta : base<string>, nested<string>, with_fallback<string> {
     bool is_fixed() const { return value->is_fixed(); }
+    void iterate_dependencies(std::function<void(const base_s&)> processor) const {
+      processor(value);
+      if (fallback) processor(fallback);
+    }
     meta(parse_context& context, parse_preprocessed& prep)
         : nested(context, prep)
         , with_fallback(prep.pop_fallback()) {}
     meta(const meta& other, clone_context& context)
         : nested(other, context)
         , with_fallback(other.fallback ? other.fallback->clone(context) : base_s()) {}
+    meta(std::shared_ptr<base<string>> value, base_s fallback)
+        : nested(move(value))
+        , with_fallback(move(fallback)) {}
+
+    // Identifies nodes of the same type with the same components
+    string structural_key(const string& type) const {
+      return type + structural_id(value) + structural_id(fallback);
+    }
   };
 
   struct color : meta {
+    // Results of recent hex inputs, in slots chosen by the packed 24-bit input color
+    struct memo_entry {
+      uint32_t input{no_input};
+      string result;
+    };
+    static constexpr uint32_t no_input = ~0u;
+    static constexpr int memo_bits = 4;
+    static constexpr size_t memo_size = 1 << memo_bits;
+
     cspace::processor processor;
+    // The color space and modification given to the processor, which is opaque otherwise
+    string processor_params;
+    // Allocated on the first miss, because most colors are read with few inputs, or folded into plain values while optimizing
+    mutable std::unique_ptr<std::array<memo_entry, memo_size>> memo;
+    mutable node_mutex mutex;
+
+    static uint32_t pack_hex(const string& input);
+    string operate(const string& input) const;
 
     color(parse_context&, parse_preprocessed&);
+    color(std::shared_ptr<base<string>> value, base_s fallback, const string& processor_params);
     explicit operator string() const;
     base_s clone(clone_context&) const;
   protected:
@@ -53,11 +86,31 @@ namespace node {
   template<class To, class Processor> struct
   loaded_node_impl : loaded_node<To, Processor> {};
 
+  // A gradient with its colors precomputed at evenly spaced positions from 0 to 1
+  // Reads inside that range become a table lookup instead of an interpolation and formatting
+  struct baked_gradient {
+    static constexpr int resolution = 1024;
+    cspace::gradient<3> source;
+    std::vector<string> table;
+    // The points that `source` was loaded from
+    string points;
+
+    // Load the points from a string like "0:#000 1:#fff", then bake them
+    void load(const string& points);
+    void bake();
+    string get_hex(float position) const;
+    // Convert `count` positions to colors in a single call
+    void get_hex(const float* positions, size_t count, string* result) const;
+  };
+
   template<> struct
-  loaded_node_impl<string, cspace::gradient<3>>
-      : loaded_node<string, cspace::gradient<3>>, nested<float> {
-    using loaded_node<string, cspace::gradient<3>>::loaded_node;
+  loaded_node_impl<string, baked_gradient>
+      : loaded_node<string, baked_gradient>, nested<float> {
+    using loaded_node<string, baked_gradient>::loaded_node;
     bool is_fixed() const { return value->is_fixed(); }
+    void iterate_dependencies(std::function<void(const base_s&)> processor) const {
+      processor(value);
+    }
     explicit operator string() const {
       return get_base().get_hex(value->operator float());
     }
@@ -68,18 +121,33 @@ namespace node {
   template<class To, class Processor> struct
   lazy_node : loaded_node_impl<To, Processor> {
     base_s base_raw;
+    mutable std::atomic<bool> loaded{false};
+    mutable node_mutex mutex;
 
     Processor& get_base() const;
     base_s clone(clone_context&) const;
+    // The base is loaded again on the next read
+    void invalidate() {
+      node_lock lock(mutex);
+      loaded.store(false, std::memory_order_relaxed);
+    }
+    bool is_fixed() const { return loaded_node_impl<To, Processor>::is_fixed() && base_raw->is_fixed(); }
+    void iterate_dependencies(std::function<void(const base_s&)> processor) const {
+      loaded_node_impl<To, Processor>::iterate_dependencies(processor);
+      processor(base_raw);
+    }
     lazy_node(parse_context&, parse_preprocessed&);
+    lazy_node() {}
   protected:
     using loaded_node_impl<To, Processor>::loaded_node_impl;
   };
 
-  using gradient = lazy_node<string, cspace::gradient<3>>;
+  using gradient = lazy_node<string, baked_gradient>;
+  template<> baked_gradient& gradient::get_base() const;
 
   struct env : meta, settable<string> {
     explicit operator string() const;
+    outcome<string> try_get(as_type<string>) const;
     bool set(const string& value);
     base_s clone(clone_context&) const;
     bool is_fixed() const { return false; }
@@ -90,6 +158,7 @@ namespace node {
 
   struct cmd : meta {
     explicit operator string() const;
+    outcome<string> try_get(as_type<string>) const;
     base_s clone(clone_context&) const;
     bool is_fixed() const { return false; }
     string type_name() const { return "cmd"; }
@@ -99,6 +168,7 @@ namespace node {
 
   struct poll : meta, settable<string> {
     mutable pollfd pfd{0, POLLIN, 0};
+    mutable node_mutex mutex;
 
     ~poll();
     explicit operator string() const;
@@ -106,6 +176,12 @@ namespace node {
     void start_cmd() const;
     bool is_fixed() const { return false; }
     bool set(const string& value);
+    void carry_state(const base<string>& previous);
+    // Closes the output of the command, so that another one is started with the new value on the next read
+    // The old command isn't killed. It ends by itself, at the latest when it writes to the closed output
+    void invalidate();
+    // The output of the command, once it has started
+    int change_fd() const;
     string type_name() const { return "poll"; }
   protected:
     using meta::meta;
@@ -113,6 +189,7 @@ namespace node {
 
   struct file : meta, settable<string> {
     explicit operator string() const;
+    outcome<string> try_get(as_type<string>) const;
     bool set(const string& value);
     base_s clone(clone_context&) const;
     bool is_fixed() const { return false; }
@@ -131,6 +208,10 @@ namespace node {
     explicit operator string() const;
     base_s clone(clone_context&) const;
     bool set(const string&);
+    void iterate_dependencies(std::function<void(const base_s&)> processor) const {
+      processor(value);
+      processor(target);
+    }
   };
 
   struct map : base<float> {
@@ -140,19 +221,61 @@ namespace node {
     explicit operator float() const;
     base_s clone(clone_context&) const;
     bool is_fixed() const { return value->is_fixed(); }
+    void iterate_dependencies(std::function<void(const base_s&)> processor) const {
+      processor(value);
+    }
 
       static std::shared_ptr<map>
     parse(parse_context&, parse_preprocessed&);
   };
 
   struct smooth : base<float> {
+    struct state {
+      float current, velocity;
+    };
+    // The simulation takes steps of a fixed duration, so its speed doesn't depend on how often it's read
+    static constexpr steady_time::duration substep = std::chrono::nanoseconds(1000000000 / 60);
+    // The steps taken at once after a long time without reads, beyond which the motion skips ahead
+    static constexpr int max_steps = 120;
+    // The value of `last_step` while the node rests at its target
+    static constexpr int64_t resting = 0;
+
     std::shared_ptr<base<float>> value;
     float spring, drag;
-    mutable float current{0}, velocity{0};
+    // Both fields are updated with a single compare-and-swap, so concurrent reads never lose a step
+    mutable std::atomic<state> current{state{0, 0}};
+    // The last step taken, counted in substeps since the epoch of the steady clock
+    // Every node counts the same steps, so nodes read in the same frame move together
+    mutable std::atomic<int64_t> last_step{resting};
 
     explicit operator float() const;
+    // Takes the steps up to `now`, and returns the resulting value
+    float advance(float target, steady_time now) const;
+    // Reserves the steps between the last one taken and `now`, and returns their count
+    int claim_steps(steady_time now) const;
+    // Replaces `prev` with `next`, which must be the result of the steps claimed from `prev`
+    // Returns false and loads the current state into `prev` if another thread changed it first
+    // The node rests once it reaches its target, and `next` is set to the target then
+    bool store(state& prev, state& next, float target) const;
+    // Takes steps that were claimed from `prev`, starting over from the current state if another thread changes it
+    state take_steps(state prev, int steps, float target) const;
+    bool at_rest(float target) const;
+
+    static void step(float& current, float& velocity, float target, float spring, float drag) {
+      velocity += (target - current) * spring - velocity * drag;
+      current += velocity;
+    }
+    // Stops the motion once it's a tiny fraction of the target
+    static bool converged(const state&, float target);
+
     base_s clone(clone_context&) const;
+    void carry_state(const base<string>& previous);
+    // The next step while it is moving
+    steady_time next_change() const;
     bool is_fixed() const { return value->is_fixed(); }
+    void iterate_dependencies(std::function<void(const base_s&)> processor) const {
+      processor(value);
+    }
 
       static std::shared_ptr<smooth>
     parse(parse_context&, parse_preprocessed&);
@@ -165,6 +288,8 @@ namespace node {
 
     explicit operator int() const;
     base_s clone(clone_context&) const;
+    // The start of the next tick
+    steady_time next_change() const;
 
       static std::shared_ptr<clock>
     parse(parse_context&, parse_preprocessed&);
@@ -3,6 +3,8 @@
 #include "reference.hpp"
 #include "cache.hpp"
 #include "strsub.hpp"
+#include "scan.hpp"
+#include "shm.hpp"
 
 #include <array>
 
@@ -12,46 +14,41 @@ namespace node {
 template<class T> std::shared_ptr<base<T>>
 parse_raw(parse_context& context, tstring& value) {
   trim_quotes(value);
-  for (auto it = value.begin(); it < value.end() - 1; it++) {
-    if (*it == '\\') {
-      switch (*++it) {
-        case 'n': value.replace(context.raw, it - value.begin() - 1, 2, "\n"); break;
-        case 't': value.replace(context.raw, it - value.begin() - 1, 2, "\t"); break;
-        case '\\': value.replace(context.raw, it - value.begin() - 1, 2, "\\"); break;
-        case '$': --it; break;
-        default: throw parse_error("Unknown escape sequence: \\" + string{*it});
-      }
-    }
-  }
-  size_t start, end;
-  if (!find_enclosed(value, context.raw, "${", "{", "}", start, end)) {
+  std::vector<std::pair<size_t, size_t>> spots;
+  lex_raw(value, spots);
+  if (spots.empty()) {
     // There is no node inside the string, it's a plain string
     return parse_plain<plain<T>, T>(value);
-  } else if (start == 0 && end == value.size()) {
-    // There is a single node inside, interpolation is unecessary
-    value.erase_front(2);
-    value.erase_back();
-    return parse_escaped<T>(context, value);
+  } else if (spots.size() == 1 && spots[0].first == 0 && spots[0].second == value.size()) {
+    // There is a single node inside, interpolation is unecessary unless it has a format
+    auto token = value.interval(2, value.size() - 1);
+    spot_format format;
+    if (!spot_format::cut(token, format))
+      return parse_escaped<T>(context, token);
+    if constexpr(!std::is_same<T, string>::value)
+      throw parse_error("Formats only apply to strings");
   }
   if constexpr(std::is_same<T, string>::value) {
     // String interpolation
-    std::stringstream ss;
     auto newval = std::make_shared<strsub>();
-    do {
+    newval->base.reserve(value.size());
+    size_t base_i = 0;
+    for (auto [start, end] : spots) {
       // Write the part we have moved past to the base string
-      ss << substr(value, 0, start);
+      newval->base.append(value.begin() + base_i, start - base_i);
 
       // Make node from the token, skipping the brackets
+      // Parsing it only changes the text inside the token, so the other spots stay in place
       auto token = value.interval(start + 2, end - 1);
-      auto replacement = parse_escaped<T>(context, token);
-      if (replacement) {
+      spot_format format;
+      spot_format::cut(token, format);
+      if (auto replacement = parse_escaped<T>(context, token)) {
         // Mark the position of the token in the base string
-        newval->spots.emplace_back(int(ss.tellp()), replacement);
+        newval->spots.emplace_back(newval->base.size(), replacement, format);
       }
-      value.erase_front(end);
-    } while (find_enclosed(value, context.raw, "${", "{", "}", start, end));
-    ss << value;
-    newval->base = ss.str();
+      base_i = end;
+    }
+    newval->base.append(value.begin() + base_i, value.size() - base_i);
     newval->tmp.reserve(newval->base.size());
     return newval;
   }
@@ -114,6 +111,12 @@ parse_escaped(parse_context& context, tstring& value) {
     SIMPLE_TYPE(gradient);
     #undef SIMPLE_TYPE
 
+    } else if (prep.tokens[0] == "shm"_ts) {
+      if (prep.token_count != 3)
+        throw parse_error("parse_error: shm: Expected 2 components");
+      if constexpr(std::is_same<T, string>::value)
+        return std::make_shared<shm>(context, prep);
+
     } else if (prep.tokens[0] == "clock"_ts) {
       if constexpr(std::is_same<int, T>::value || std::is_same<string, T>::value)
         return clock::parse(context, prep);
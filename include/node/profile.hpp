@@ -0,0 +1,159 @@
+#pragma once
+
+#include "base.hpp"
+#include "fallback.hpp"
+
+#include <map>
+#include <deque>
+#include <mutex>
+#include <atomic>
+#include <cstdint>
+#include <chrono>
+#include <ostream>
+
+namespace node {
+  // Counts the evaluations of the keys of trees cloned with it
+  // The trees must not outlive the profiler
+  class profiler {
+  public:
+    // The statistics of a single key. Exclusive figures leave out the keys read while evaluating this one
+    struct entry {
+      string path;
+      std::atomic<uint64_t> calls{0}, inclusive_ns{0}, exclusive_ns{0}, allocated_bytes{0}, fallbacks{0};
+    };
+
+    profiler();
+
+    // Returns the number of bytes the program has allocated so far
+    // The library can't see allocations, so bytes are only counted if the program sets this
+    std::function<size_t()> allocated_bytes;
+
+    // Wraps `node`, the clone of the key at `path`, so that its evaluations are counted
+    // Keys cloned out of order by a reference are wrapped before their path is known, and named when it is
+    base_s wrap(const base_s& node, const string* path = nullptr);
+    void name(const base_s& wrapped, const string& path);
+
+    // Prints a line for every key, sorted by exclusive time
+    void report(std::ostream&) const;
+    // Prints the call stacks of the keys in the folded format of flamegraph.pl, weighted by exclusive nanoseconds
+    void write_folded(std::ostream&) const;
+    // Finds the statistics of the key at `path`
+    const entry* find(const string& path) const;
+
+    // Used by the wrapping nodes, while a key is evaluated
+    struct scope {
+      scope(profiler& owner, entry& stats);
+      ~scope();
+    private:
+      profiler& owner;
+    };
+
+    // The call stacks seen by a single thread, as a tree where every stack extends its parent by a key
+    // Only that thread writes to it, and it locks the mutex only to add a stack
+    struct thread_stacks {
+      struct stack {
+        size_t parent;
+        const entry* stats;
+        // The exclusive time of the calls with this stack
+        std::atomic<uint64_t> ns{0};
+        stack(size_t parent, const entry* stats) : parent(parent), stats(stats) {}
+      };
+      static constexpr size_t root = SIZE_MAX;
+
+      mutable std::mutex mutex;
+      std::deque<stack> stacks;
+      std::map<std::pair<size_t, const entry*>, size_t> children;
+
+      // Returns the stack that extends `parent` by `stats`
+      size_t find(size_t parent, const entry* stats);
+    };
+
+  private:
+    mutable std::mutex mutex;
+    // Identifies the profiler to the threads, which keep their stacks across profilers
+    const uint64_t id;
+    std::deque<entry> entries;
+    std::deque<thread_stacks> threads;
+
+    thread_stacks& local_stacks();
+  };
+
+  // Wraps the node of a key, and records its evaluations in a profiler
+  template<class T> struct
+  profiled_base : base<T>, settable<T> {
+    const std::shared_ptr<base<T>> source;
+    profiler& owner;
+    profiler::entry& stats;
+
+    profiled_base(std::shared_ptr<base<T>> source, profiler& owner, profiler::entry& stats)
+        : source(move(source)), owner(owner), stats(stats) {}
+
+    explicit operator T() const {
+      profiler::scope scope(owner, stats);
+      return source->operator T();
+    }
+
+    outcome<T> try_get(as_type<T>) const {
+      profiler::scope scope(owner, stats);
+      return node::try_get(*source);
+    }
+
+    bool set(const T& value) {
+      auto target = std::dynamic_pointer_cast<settable<T>>(source);
+      return target && target->set(value);
+    }
+
+    // Clones aren't profiled, unless their context has a profiler
+    base_s clone(clone_context& context) const {
+      return source->clone(context);
+    }
+
+    bool is_fixed() const {
+      return source->is_fixed();
+    }
+
+    void iterate_dependencies(std::function<void(const base_s&)> processor) const {
+      processor(source);
+    }
+
+    void carry_state(const base<string>& previous) {
+      if (auto other = dynamic_cast<const profiled_base*>(&previous))
+        source->carry_state(*other->source);
+      else source->carry_state(previous);
+    }
+
+    void invalidate() {
+      source->invalidate();
+    }
+  };
+
+  template<class T> struct
+  profiled : profiled_base<T> {
+    using profiled_base<T>::profiled_base;
+
+    // Numbers are printed by their source, which may keep the text they were written with
+    explicit operator string() const {
+      profiler::scope scope(this->owner, this->stats);
+      return this->source->get();
+    }
+
+    // Their strings are evaluated as strings, so that the profiler counts them
+    bool prints_number() const { return false; }
+
+    outcome<string> try_get(as_type<string>) const {
+      profiler::scope scope(this->owner, this->stats);
+      return node::try_get<string>(*this->source);
+    }
+  };
+
+  template<> struct
+  profiled<string> : profiled_base<string> {
+    using profiled_base<string>::profiled_base;
+
+    text_view view(string& scratch) const {
+      profiler::scope scope(owner, stats);
+      return source->view(scratch);
+    }
+  };
+
+}
@@ -19,11 +19,15 @@ namespace node {
 
     address_ref(std::weak_ptr<wrapper> ancestor, tstring path);
     operator T() const;
+    outcome<T> try_get(as_type<T>) const;
+    // String references return the view of their source
+    text_view view(string& scratch) const;
     bool set(const T& value);
     base_s clone(clone_context&) const;
     string get_path() const;
     bool is_fixed() const;
     base_s get_source() const;
+    void iterate_dependencies(std::function<void(const base_s&)> processor) const;
   private:
     base_s* get_source_direct() const;
   };
@@ -34,10 +38,13 @@ namespace node {
 
     ref(std::weak_ptr<base<T>> source_w);
     operator T() const;
+    outcome<T> try_get(as_type<T>) const;
+    text_view view(string& scratch) const;
     bool set(const T& value);
     base_s clone(clone_context&) const;
     bool is_fixed() const;
     base_s get_source() const { return source_w.lock(); }
+    void iterate_dependencies(std::function<void(const base_s&)> processor) const;
   };
 
   struct upref : ref<string> {
@@ -50,7 +57,10 @@ namespace node {
     using ref<string>::ref;
     explicit operator string() const { return ref<string>::get(); }
     explicit operator T() const;
+    outcome<T> try_get(as_type<T>) const;
     bool set(const T& value);
+    // The string is the text of the source, as it was written
+    bool prints_number() const { return false; }
   };
 
 }
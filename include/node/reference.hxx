@@ -29,7 +29,13 @@ address_ref<T>::get_source() const {
     return {};
   }
   auto direct_wrapper = std::dynamic_pointer_cast<wrapper>(*direct);
-  return direct_wrapper ? direct_wrapper->map[""] : *direct;
+  return direct_wrapper ? direct_wrapper->get_value() : *direct;
+}
+
+template<class T> void
+address_ref<T>::iterate_dependencies(std::function<void(const base_s&)> processor) const {
+  if (auto source = get_source())
+    processor(source);
 }
 
 template<class T> base_s*
@@ -47,15 +53,37 @@ address_ref<T>::get_source_direct() const {
 
 template<class T>
 address_ref<T>::operator T() const {
-  try {
-    auto src = get_source();
-    if (!src) throw node_error("Get: Referenced key not found: " + get_path());
-    if (auto convert = std::dynamic_pointer_cast<base<T>>(src))
-      return convert->operator T();
-    return parse<T>(src->get(), "address_ref::operator T");
-  } catch (const std::exception& e) {
-    throw node_error("In " + get_path() + ": " + e.what());
-  }
+  auto result = try_get(as_type<T>{});
+  if (result)
+    return std::move(result.value);
+  if (result.error == failure::missing_key)
+    throw node_error("Get: Referenced key not found: " + get_path());
+  throw node_error("In " + get_path() + ": " + result.message);
+}
+
+template<class T> outcome<T>
+address_ref<T>::try_get(as_type<T>) const {
+  if (ancestor_w.expired())
+    return {failure::error, "Ancestor destroyed"};
+  auto src = get_source();
+  if (!src) return failure::missing_key;
+  if (auto convert = dynamic_cast<const base<T>*>(src.get()))
+    return node::try_get(*convert);
+  auto str = node::try_get(*src);
+  return str ? try_parse<T>(str.value) : outcome<T>(str.error, move(str.message));
+}
+
+template<class T> text_view
+address_ref<T>::view(string& scratch) const {
+  if constexpr(std::is_same<T, string>::value) {
+    try {
+      auto src = get_source();
+      if (!src) throw node_error("Get: Referenced key not found: " + get_path());
+      return src->view(scratch);
+    } catch (const std::exception& e) {
+      throw node_error("In " + get_path() + ": " + e.what());
+    }
+  } else return base<string>::view(scratch);
 }
 
 template<class T> bool
@@ -75,13 +103,10 @@ address_ref<T>::clone(clone_context& context) const {
   auto ancestor = ancestor_w.lock();
   if (!ancestor) throw ancestor_destroyed_error("clone");
   // Find the corresponding ancestor in the clone result tree
-  auto ancestor_it = find_if(context.ancestors.rbegin(), context.ancestors.rend(), [&](auto& pair) { return pair.first == ancestor; });
-  wrapper_s cloned_ancestor;
-  if (ancestor_it != context.ancestors.rend()) {
-    cloned_ancestor = ancestor_it->second;
-  } else if (context.no_dependency) {
-    throw clone_error("Address_ref: External dependency");
-  } else {
+  auto cloned_ancestor = context.ancestors.find(ancestor.get());
+  if (!cloned_ancestor) {
+    if (context.no_dependency)
+      throw clone_error("Address_ref: External dependency");
     cloned_ancestor = ancestor;
   }
 
@@ -92,7 +117,7 @@ address_ref<T>::clone(clone_context& context) const {
       cloned_ancestor = cloned_ancestor->add_wrapper(path);
       if (!(ancestor = ancestor->get_wrapper(path)))
         return std::make_shared<address_ref<T>>(cloned_ancestor, string(get_path()));
-      context.ancestors.emplace_back(ancestor, cloned_ancestor);
+      context.ancestors.push(ancestor, cloned_ancestor);
     }
 
     base_s result;
@@ -114,8 +139,8 @@ address_ref<T>::clone(clone_context& context) const {
       if (cloned_wrapper) {
         if (auto src_wrapper = std::dynamic_pointer_cast<wrapper>(tmp_src)) {
           cloned_wrapper->merge(src_wrapper, context);
-        } else cloned = cloned_wrapper->map[""] = tmp_src->clone(context);
-      } else cloned = tmp_src->clone(context);
+        } else cloned = cloned_wrapper->map[""] = profiled_clone(tmp_src, context);
+      } else cloned = profiled_clone(tmp_src, context);
       src_it->second = tmp_src;
       result = cloned;
     }
@@ -154,6 +179,22 @@ ref<T>::operator T() const {
   return source->operator T();
 }
 
+template<class T> outcome<T>
+ref<T>::try_get(as_type<T>) const {
+  auto source = source_w.lock();
+  if (!source) return failure::missing_key;
+  return node::try_get(*source);
+}
+
+template<class T> text_view
+ref<T>::view(string& scratch) const {
+  if constexpr(std::is_same<T, string>::value) {
+    auto source = source_w.lock();
+    if (!source) throw ancestor_destroyed_error("ancestor_destroyed_error: ref::view");
+    return source->view(scratch);
+  } else return base<string>::view(scratch);
+}
+
 template<class T> bool
 ref<T>::set(const T& value) {
   auto source = this->source_w.lock();
@@ -163,6 +204,12 @@ ref<T>::set(const T& value) {
   return false;
 }
 
+template<class T> void
+ref<T>::iterate_dependencies(std::function<void(const base_s&)> processor) const {
+  if (auto source = source_w.lock())
+    processor(source);
+}
+
 template<class T> base_s
 ref<T>::clone(clone_context&) const {
   throw clone_error("Ref: is optimized and can't be cloned further");
@@ -172,9 +219,8 @@ inline base_s upref::clone(clone_context& context) const {
   auto ancestor = source_w.lock();
   if (!ancestor) throw ancestor_destroyed_error("clone");
   // Find the corresponding ancestor in the clone result tree
-  auto ancestor_it = find_if(context.ancestors.rbegin(), context.ancestors.rend(), [&](auto& pair) { return pair.first == ancestor; });
-  if (ancestor_it != context.ancestors.rend()) {
-    return std::make_shared<upref>(ancestor_it->second);
+  if (auto cloned_ancestor = context.ancestors.find(dynamic_cast<const wrapper*>(ancestor.get()))) {
+    return std::make_shared<upref>(cloned_ancestor);
   } else if (context.no_dependency) {
     throw clone_error("Ref: Can't find the cloned ancestor");
   } else {
@@ -207,4 +253,10 @@ adapter<T>::operator T() const {
   return parse<T>(str, "adapter::operator T");
 }
 
+template<class T> outcome<T>
+adapter<T>::try_get(as_type<T>) const {
+  auto str = ref<string>::try_get(as_type<string>{});
+  return str ? try_parse<T>(str.value) : outcome<T>(str.error, move(str.message));
+}
+
 }
@@ -0,0 +1,53 @@
+#pragma once
+
+#include "tstring.hpp"
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <cstdint>
+
+namespace node {
+  // Classes of bytes that are special in expressions
+  enum scan_class : unsigned {
+    scan_space = 1,      // ' ', '\t', '\n', '\v', '\f', '\r'
+    scan_quote = 2,      // '"', '\''
+    scan_curly = 4,      // '{', '}'
+    scan_bracket = 8,    // '(', ')', '[', ']'
+    scan_dollar = 16,    // '$'
+    scan_question = 32,  // '?'
+    scan_backslash = 64, // '\\'
+  };
+
+  // A set of bytes to stop at, made of scan classes
+  // Sets are meant to be built once and kept, scanning doesn't build anything
+  struct scan_set {
+    char bytes[16];
+    uint8_t count{0};
+    bool space{false};
+    bool table[256]{};
+
+    explicit scan_set(unsigned classes);
+    bool contains(char c) const { return table[(unsigned char)c]; }
+  };
+
+  // Returns the first byte from `begin` to `end` that is in `set`, or `end` if there is none
+  // Blocks of 16 or 32 bytes are checked at once, with the widest instructions the processor supports
+  const char* scan(const char* begin, const char* end, const scan_set& set);
+
+  // Finds the first expression `${...}` in `value`, with its matching closing bracket
+  // `\${` is not an expression, its backslash is removed from `value` and `raw`
+  bool find_expression(tstring& value, std::string& raw, size_t& start, size_t& end);
+
+  // Unescapes `value` and finds its expressions `${...}` in a single forward pass
+  // The unescaped text is written over `value`, which is shortened to fit. The start and end of every expression are added to `spots`
+  // Like `find_expression`, `\${` is not an expression. Expressions that aren't closed are left as plain text
+  void lex_raw(tstring& value, std::vector<std::pair<size_t, size_t>>& spots);
+
+  // Returns whether an expression in `value`, or one nested in it, has the operator `op`
+  // Only the first word of every expression is checked, `op` may appear anywhere else in the value
+  bool has_operator(std::string_view value, std::string_view op);
+
+  // The instruction set that `scan` uses, for benchmarks and tests
+  const char* scan_implementation();
+}
@@ -0,0 +1,54 @@
+#pragma once
+
+#include "wrapper.hpp"
+
+#include <chrono>
+#include <vector>
+
+namespace node {
+  // Waits until some keys of a tree may need to be evaluated again, so that a program can render them only then
+  // The nodes read by the keys report when they change by themselves, like caches expiring, clocks ticking and animations moving, and the file descriptors of running commands
+  // A single timer and epoll instance wait for all of them, so an idle program sleeps until the next change
+  class scheduler {
+  public:
+    // Why `wait` returned
+    enum class wake { deadline, descriptor, notified, timeout };
+
+    // `min_interval` limits the rate of wake ups, when animations change on every read
+    scheduler(wrapper_s tree, std::vector<string> paths, std::chrono::milliseconds min_interval = std::chrono::milliseconds(16));
+    ~scheduler();
+    scheduler(const scheduler&) = delete;
+    scheduler& operator=(const scheduler&) = delete;
+
+    // Finds the nodes read by the keys again, after the tree has been changed
+    void collect();
+
+    // The earliest time that a node of the keys changes by itself, or `steady_time::max()` if none does
+    steady_time next_deadline() const;
+
+    // Blocks until the next deadline, a descriptor becoming readable, a call to `notify`, or `until`
+    wake wait(steady_time until = steady_time::max());
+
+    // Wakes up `wait`, from any thread
+    void notify();
+
+  private:
+    wrapper_s tree;
+    std::vector<string> paths;
+    std::chrono::milliseconds min_interval;
+    std::vector<base_s> nodes;
+    // A descriptor with the file that it refers to, because a number closed by its node is soon reused for another command
+    struct descriptor {
+      int fd;
+      uint64_t device, inode;
+      bool operator==(const descriptor& other) const { return fd == other.fd && device == other.device && inode == other.inode; }
+    };
+    // The descriptors added to the epoll instance, and those that reported a hang up and aren't watched anymore
+    std::vector<descriptor> watched, hung_up;
+    steady_time last_wake;
+    int epoll_fd{-1}, timer_fd{-1}, event_fd{-1};
+
+    void open_epoll();
+    void watch_descriptors();
+  };
+}
@@ -0,0 +1,109 @@
+#pragma once
+
+#include "node.hpp"
+#include "wrapper.hpp"
+
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+
+namespace node {
+  struct shm_error : std::logic_error { using logic_error::logic_error; };
+
+  // Evaluates keys of a tree and writes their values into a POSIX shared memory segment, for other processes to read
+  // Every key has a slot of fixed capacity, guarded by a sequence lock of its own. Readers never block the publisher, and retry while a slot is being written
+  // The segment is removed when the publisher is destroyed
+  class shm_publisher {
+  public:
+    // Creates the segment `name`, which must start with '/', holding the keys at `paths` of `tree`
+    // Values longer than `capacity` bytes are published as failures
+    shm_publisher(const string& name, wrapper_s tree, const std::vector<string>& paths, size_t capacity = 256);
+    ~shm_publisher();
+    shm_publisher(const shm_publisher&) = delete;
+    shm_publisher& operator=(const shm_publisher&) = delete;
+
+    // Evaluates the keys and writes the values that changed. Returns the number of keys that failed
+    size_t publish();
+    // Publishes every `period` on another thread, until `stop` is called or the publisher is destroyed
+    // That thread reads the tree while the program may be using it, which requires a build with LINKT_THREAD_SAFE
+    // Without it, the program must neither read nor change the tree until `stop` returns
+    void start(std::chrono::milliseconds period);
+    void stop();
+
+    const string& name() const { return segment_name; }
+
+  private:
+    string segment_name;
+    wrapper_s tree;
+    prepared_query query;
+    // The values last published, and the values being evaluated
+    std::vector<string> values, fresh;
+    std::vector<failure> errors, fresh_errors;
+    bool published{false};
+    std::mutex publish_mutex;
+
+    void* memory{nullptr};
+    size_t memory_size{0};
+    // Identifies the segment, which another publisher may replace under the same name
+    unsigned long inode{0};
+
+    std::thread thread;
+    std::mutex stop_mutex;
+    std::condition_variable stop_signal;
+    bool stopping{false};
+  };
+
+  // Maps a segment written by a publisher, to read its keys without a system call
+  class shm_reader {
+  public:
+    // Returns the reader of the segment `name`, shared by the whole process
+    // Returns null if the segment doesn't exist or its publisher is gone
+    static std::shared_ptr<shm_reader> open(const string& name);
+    ~shm_reader();
+    shm_reader(const shm_reader&) = delete;
+    shm_reader& operator=(const shm_reader&) = delete;
+
+    // Returns the slot of `path`, or -1 if the segment doesn't hold it
+    int find(const string& path) const;
+    // Reads the value in `slot`. Fails with `unavailable` if it hasn't been published yet, the publisher is gone or the slot is being written for too long
+    outcome<string> read(int slot) const;
+    // Whether the publisher still writes to the segment. A publisher created later under the same name writes to a new segment
+    bool alive() const;
+
+  private:
+    const void* memory{nullptr};
+    size_t memory_size{0};
+    std::vector<string> paths;
+    // Whether the header was filled and matches this version of the library
+    bool valid{false};
+
+    shm_reader(const void* memory, size_t memory_size);
+  };
+
+  // The value of a key published in a shared memory segment
+  // Fallback is returned if the segment or the key doesn't exist, or the key failed in the publisher
+  struct shm : meta {
+    std::shared_ptr<base<string>> segment;
+    // The reader is opened on the first read, and opened again once its publisher is gone
+    mutable std::shared_ptr<shm_reader> reader;
+    mutable string open_segment, open_key;
+    mutable int slot{-1};
+    mutable node_mutex mutex;
+
+    shm(parse_context&, parse_preprocessed&);
+    shm(const shm& other, clone_context& context);
+    shm(std::shared_ptr<base<string>> key, base_s fallback, std::shared_ptr<base<string>> segment);
+    explicit operator string() const;
+    outcome<string> try_get(as_type<string>) const;
+    base_s clone(clone_context&) const;
+    bool is_fixed() const { return false; }
+    void iterate_dependencies(std::function<void(const base_s&)> processor) const {
+      meta::iterate_dependencies(processor);
+      processor(segment);
+    }
+    string type_name() const { return "shm"; }
+  private:
+    // Reads `key` from `segment_name`, opening the segment if necessary
+    outcome<string> read(const string& segment_name, const string& key) const;
+  };
+}
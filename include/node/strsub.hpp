@@ -3,20 +3,43 @@
 #include "base.hpp"
 
 namespace node {
-  struct strsub : base<string> {
+  // How a spot writes its value, given by `:%[-][0][width][.precision]` at the end of its expression
+  // The colon keeps a trailing word like `%5` of a command from being read as a format
+  // Numbers, and text holding a number, are written with `precision` digits after the point, integers included
+  // Values shorter than `width` are padded with spaces on the left, on the right with `-`, or with zeros after the sign with `0`
+  struct spot_format {
+    int width{0}, precision{-1};
+    bool left{false}, zeros{false};
+
+    bool empty() const { return width == 0 && precision < 0; }
+    // Reads the format at the end of `expression` into `result` and removes it. Returns false if there is none
+    static bool cut(tstring& expression, spot_format& result);
+  };
+
+  struct strsub : base<string>, view_source {
     struct replace_spot {
       mutable size_t start, length;
       base_s replacement;
-      replace_spot(size_t pos, base_s repl) : start(pos), length(0), replacement(repl) {}
-      replace_spot(size_t start, size_t length, base_s repl)
-          : start(start), length(length), replacement(repl) {}
+      spot_format format;
+      // The replacement if it prints a number, which is then written without making a string
+      const base<float>* real{nullptr};
+      const base<int>* integer{nullptr};
+      replace_spot(size_t pos, base_s repl, spot_format format = {});
+      replace_spot(size_t start, size_t length, base_s repl, spot_format format = {});
     };
     mutable string base, tmp;
     std::vector<replace_spot> spots;
+    mutable node_mutex mutex;
 
     explicit operator string() const;
-    string substitute(bool full) const;
+    outcome<string> try_get(as_type<string>) const;
+    // Views of the substituted base stay valid until the next evaluation
+    text_view view(string& scratch) const;
+    // The caller must hold `mutex`. Spots that fail keep their previous text
+    // The first failure is written to `failed` if it is given, otherwise its message is thrown
+    const string& substitute(bool full, outcome<string>* failed = nullptr) const;
     base_s clone  (clone_context&) const;
     bool is_fixed() const;
+    void iterate_dependencies(std::function<void(const base_s&)> processor) const;
   };
 }
@@ -4,9 +4,12 @@
 
 #include <vector>
 #include <memory>
+#include <functional>
+#include <unordered_map>
 
 namespace node {
   struct wrapper;
+  class profiler;
   template<class T> struct base;
   using std::string;
   using base_s = std::shared_ptr<base<string>>;
@@ -29,11 +32,36 @@ namespace node {
     bool extract_key(tstring& line, int linecount, char separator, tstring& key);
   };
 
+  // Maps the wrappers of a tree being cloned to their clones
+  // Every change is logged, so that `restore` can undo the changes made after a `mark`
+  class ancestor_map {
+    struct change {
+      const_wrapper_s source;
+      wrapper_s previous;
+    };
+    std::unordered_map<const wrapper*, wrapper_s> index;
+    std::vector<change> log;
+
+  public:
+    void push(const const_wrapper_s& source, const wrapper_s& clone);
+    wrapper_s find(const wrapper* source) const;
+    size_t mark() const { return log.size(); }
+    void restore(size_t mark);
+  };
+
   struct clone_context {
     std::string current_path;
-    std::vector<std::pair<const_wrapper_s, wrapper_s>> ancestors;
+    ancestor_map ancestors;
     bool optimize{false}, no_dependency{false};
     errorlist errors;
+    // Nodes without hidden state that are shared while optimizing, keyed by their structure
+    std::unordered_map<string, base_s> shared_nodes;
+    // Whether the clone of a source node is fixed, so that it is only computed once while optimizing
+    std::unordered_map<const base<string>*, bool> fixed_nodes;
+    // The number of nodes replaced with plain values while optimizing
+    size_t folded_count{0};
+    // Wraps the keys of the clone to count their evaluations, if set
+    profiler* profile{nullptr};
 
     void report_error(const string& msg) {
         errors.report_error(current_path, msg);
@@ -44,10 +72,15 @@ namespace node {
     ~throwing_clone_context() noexcept(false);
   };
 
+  // Receives the errors of values that are parsed on their first use, along with the path of their key
+  using error_hook = std::function<void(const string& path, const string& msg)>;
+
   struct parse_context {
     string raw, current_path;
     wrapper_s parent, current, root;
     base_s* place{nullptr};
+    // If set, values are kept as text in deferred nodes, and parsed on their first use
+    error_hook deferred_errors;
 
     wrapper_s get_current();
     wrapper_s get_parent();
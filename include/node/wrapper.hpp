@@ -14,6 +14,21 @@ namespace node {
   using std::string;
   struct wrapper_error : std::logic_error { using logic_error::logic_error; };
 
+  // Keys of a tree looked up once by `wrapper::prepare`, to be read together many times
+  struct prepared_query {
+    // A node to evaluate, with the indices of the keys that hold it
+    struct entry {
+      base_s node;
+      std::vector<size_t> keys;
+    };
+    std::vector<entry> entries;
+    // The indices of the keys that weren't found
+    std::vector<size_t> missing;
+    size_t key_count{0};
+
+    size_t size() const { return key_count; }
+  };
+
   struct wrapper : base<string>, std::enable_shared_from_this<wrapper> {
     using map_type = std::map<string, base_s>;
 
@@ -29,20 +44,36 @@ namespace node {
     base_s& add(tstring path, parse_context& context, tstring& value);
     wrapper_s add_wrapper(const string& path);
 
+    base_s get_value() const;
     base_s get_child_ptr(tstring path) const;
     base_s* get_child_place(tstring path);
     string get_child(const tstring& path, string&& fallback) const;
     string get_child(const tstring& path) const;
     std::optional<string> get_child_safe(const tstring& path) const;
+    // Evaluates the key at `path` without throwing, failing with `missing_key` if it doesn't exist
+    outcome<string> try_get_child(const tstring& path) const;
+    // Returns a view of the value of the key at `path`, with the lifetime described by `base<string>::view`
+    text_view view_child(const tstring& path, string& scratch) const;
     wrapper_s get_wrapper(const string& path) const;
 
+    // Looks up the nodes of `paths`. Paths in the same section look up the section once
+    // Keys holding the same node, or an optimized reference to it, share their evaluation
+    // The query holds the nodes it found, so keys added or replaced afterwards need a new query
+    prepared_query prepare(const std::vector<string>& paths) const;
+    // Evaluates every key of `query` into `out`, which must hold `query.size()` strings
+    // Keys that fail are left empty, and their failures are written to `errors` if it isn't null
+    // Returns the number of keys that failed
+    static size_t get_many(const prepared_query& query, string* out, failure* errors = nullptr);
+
     void iterate_children(std::function<void(const string&, const base_s&)> processor) const;
 
     void merge(const const_wrapper_s& source, clone_context&);
     void optimize(clone_context&);
     operator string() const;
+    text_view view(string& scratch) const;
     base_s clone(clone_context&) const;
     bool is_fixed() const;
+    void iterate_dependencies(std::function<void(const base_s&)> processor) const;
 
     template<class T> bool
     set(const tstring& path, const T& value) {
@@ -1,7 +1,32 @@
 #pragma once
 #include "node/wrapper.hpp"
 #include <iostream>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
 
-void parse_ini(std::istream&, node::errorlist&, node::wrapper_s& output);
-void parse_yml(std::istream&, node::errorlist&, node::wrapper_s& output);
+// If `value_errors` is set, the values are kept as text, and only parsed when they are first read or cloned
+// Their errors are then reported to `value_errors` instead of the errorlist, which still gets the errors of the keys
+void parse_ini(std::istream&, node::errorlist&, node::wrapper_s& output, node::error_hook value_errors = {});
+void parse_yml(std::istream&, node::errorlist&, node::wrapper_s& output, node::error_hook value_errors = {});
 
+// The text of every key in the last parse of a file, so that the next parse can tell which keys changed
+struct parse_record {
+  std::unordered_map<string, string> sources;
+  // The node of every key, and the key of every node
+  std::unordered_map<string, node::base_s> nodes;
+  std::unordered_map<const node::base<string>*, string> keys;
+  // The keys that every key reads, directly or through nodes that aren't keys, and the keys that read every key
+  std::unordered_map<string, std::vector<string>> reads;
+  std::unordered_map<string, std::unordered_set<string>> readers;
+  // Keys with references that found no key, which may find a key added later
+  std::unordered_set<string> unresolved;
+};
+
+// Parse an edited text into `output`, the tree parsed from the text in `record`. Start with an empty record and tree
+// Keys with unchanged text keep their nodes along with their state. Changed keys are parsed again, removed keys are erased,
+// and the nodes that read them drop their cached results. Returns the number of keys that changed
+// Only the keys that read a changed key are visited, as found in the record. The record must not outlive `output`
+// Texts that clone or assign keys are parsed in full instead, into a new tree that takes over the state of the old one
+size_t reparse_ini(std::istream&, node::errorlist&, node::wrapper_s& output, parse_record&);
+size_t reparse_yml(std::istream&, node::errorlist&, node::wrapper_s& output, parse_record&);
@@ -0,0 +1,13 @@
+#pragma once
+#include "node/wrapper.hpp"
+#include <iostream>
+
+struct snapshot_error : std::logic_error { using logic_error::logic_error; };
+
+// Snapshots hold a parsed or optimized tree in a binary form, which loads without tokenizing any expression
+// Nodes keep their parameters, but not their live state, like the values of caches
+// Numbers are stored in the byte order of the machine that wrote them
+void write_snapshot(std::ostream&, const node::wrapper_s& root);
+node::wrapper_s read_snapshot(const char* data, size_t size);
+// Map the file at `path` into memory and read the snapshot in it
+node::wrapper_s load_snapshot(const string& path);
@@ -2,5 +2,32 @@
 #include "node/wrapper.hpp"
 #include <iostream>
 
+// Collects the output of the serializers in one large buffer, which is written out when it's full and on `flush`
+// Long strings skip the buffer, they are written out together with it
+class output_buffer {
+  string buffer;
+  size_t capacity;
+  std::ostream* os{nullptr};
+  int fd{-1};
+
+  void write_out(const char* extra, size_t extra_size);
+public:
+  static constexpr size_t default_capacity = 1 << 16;
+
+  explicit output_buffer(std::ostream& os, size_t capacity = default_capacity);
+  // Write to a file descriptor, with `writev`
+  explicit output_buffer(int fd, size_t capacity = default_capacity);
+  // Writes out the rest of the buffer, ignoring errors. Call `flush` to have them reported
+  ~output_buffer();
+
+  void append(const char* data, size_t size);
+  void append(const string& str) { append(str.data(), str.size()); }
+  void append(char c);
+  void append_spaces(size_t count);
+  void flush();
+};
+
+void write_ini(output_buffer&, const node::wrapper_s&, const string& prefix = "");
+void write_yml(output_buffer&, const node::wrapper_s&, int indent = 0);
 void write_ini(std::ostream&, const node::wrapper_s&, const string& prefix = "");
 void write_yml(std::ostream&, const node::wrapper_s&, int indent = 0);
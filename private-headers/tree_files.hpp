@@ -0,0 +1,12 @@
+#pragma once
+
+#include "node/wrapper.hpp"
+
+// Checks if `str` ends with `suffix` (case-insensitive)
+bool ends_with(const char *str, const char *suffix);
+
+// Load the snapshot at `path` and merge its tree to `tree`. Returns true if an error occourred
+bool merge_snapshot(const char* path, node::wrapper_s& tree);
+
+// Parse the file at `path` and merge its tree to `tree`, according to its extension. Returns true if an error occourred
+bool merge_file(const char* path, node::wrapper_s& tree);
@@ -0,0 +1,102 @@
+#include "daemon_protocol.hpp"
+#include "common.hpp"
+
+NAMESPACE(daemon_protocol)
+
+bool next_frame(string_view& data, string_view& frame, bool& too_large) {
+  uint32_t size;
+  if (data.size() < sizeof(size))
+    return false;
+  memcpy(&size, data.data(), sizeof(size));
+  if ((too_large = size > max_frame) || data.size() - sizeof(size) < size)
+    return false;
+  frame = data.substr(sizeof(size), size);
+  data.remove_prefix(sizeof(size) + size);
+  return true;
+}
+
+string_view frame_reader::bytes(size_t count) {
+  if (count > rest.size()) {
+    valid = false;
+    count = rest.size();
+  }
+  auto result = rest.substr(0, count);
+  rest.remove_prefix(count);
+  return result;
+}
+
+uint8_t frame_reader::u8() {
+  auto field = bytes(1);
+  return field.empty() ? 0 : field[0];
+}
+
+uint32_t frame_reader::u32() {
+  uint32_t value = 0;
+  auto field = bytes(sizeof(value));
+  memcpy(&value, field.data(), field.size());
+  return field.size() == sizeof(value) ? value : 0;
+}
+
+string_view frame_reader::sized() {
+  return bytes(u32());
+}
+
+responder::responder(node::wrapper_s tree_) : tree(move(tree_)) {
+  if (!tree)
+    throw node::required_field_null_error("responder::responder");
+}
+
+node::base_s responder::find(string_view path) {
+  auto it = nodes.find(string(path));
+  if (it != nodes.end())
+    return it->second;
+  auto result = tree->get_child_ptr(string(path));
+  // Missing keys aren't remembered, because the tree doesn't change their absence
+  if (result)
+    nodes.emplace(path, result);
+  return result;
+}
+
+void responder::put_value(string& out, string_view path, bool sized) {
+  auto node = find(path);
+  auto result = node ? node::try_get(*node) : node::outcome<string>(node::failure::missing_key);
+  out.push_back(uint8_t(result.error));
+  if (sized)
+    put_sized(out, result.value);
+  else out.append(result.value);
+}
+
+void responder::respond(string_view frame, string& out) {
+  frame_reader in(frame);
+  auto start = begin_frame(out);
+  switch (in.u8()) {
+    case request_get:
+      put_value(out, in.rest, false);
+      break;
+    case request_set: {
+      auto path = in.sized();
+      if (!in.valid) break;
+      auto node = find(path);
+      auto target = dynamic_cast<node::settable<string>*>(node.get());
+      out.push_back(!node ? status_missing_key : target && target->set(string(in.rest)) ? status_ok : status_read_only);
+      break;
+    }
+    case request_get_many: {
+      auto count = in.u32();
+      out.push_back(status_ok);
+      put_u32(out, count);
+      for (uint32_t i = 0; i < count && in.valid; i++)
+        put_value(out, in.sized(), true);
+      break;
+    }
+    default:
+      in.valid = false;
+  }
+  if (!in.valid) {
+    out.resize(start + sizeof(uint32_t));
+    out.push_back(status_bad_request);
+  }
+  end_frame(out, start);
+}
+
+NAMESPACE_END
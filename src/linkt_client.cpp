@@ -0,0 +1,272 @@
+#include "daemon_protocol.hpp"
+#include <getopt.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <csignal>
+#include <cstring>
+#include <optional>
+#include <algorithm>
+#include <chrono>
+#include <thread>
+#include <vector>
+#include <deque>
+#include <map>
+#include <iostream>
+
+using namespace std;
+using namespace daemon_protocol;
+using request_clock = chrono::steady_clock;
+
+// A blocking connection to linkt_daemon
+struct client {
+  int fd{-1};
+  string input;
+  size_t read_pos{0};
+
+  explicit client(const char* socket_path) {
+    sockaddr_un address{};
+    address.sun_family = AF_UNIX;
+    strncpy(address.sun_path, socket_path, sizeof(address.sun_path) - 1);
+    fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0 || connect(fd, (sockaddr*)&address, sizeof(address)))
+      throw runtime_error("Can't connect to "s + socket_path + ": " + strerror(errno));
+  }
+  ~client() { close(fd); }
+
+  void send(const string& frames) {
+    for (size_t pos = 0; pos < frames.size();) {
+      auto count = write(fd, frames.data() + pos, frames.size() - pos);
+      if (count < 0 && errno != EINTR)
+        throw runtime_error("Can't send request: "s + strerror(errno));
+      pos += max<ssize_t>(count, 0);
+    }
+  }
+
+  // Waits for the next response
+  string_view receive() {
+    string_view pending, frame;
+    bool too_large = false;
+    while (!next_frame(pending = string_view(input).substr(read_pos), frame, too_large)) {
+      if (too_large)
+        throw runtime_error("Response is too large");
+      // Drop the responses already read before reading more
+      input.erase(0, read_pos);
+      read_pos = 0;
+      char buffer[1 << 16];
+      auto count = read(fd, buffer, sizeof(buffer));
+      if (count == 0)
+        throw runtime_error("The daemon closed the connection");
+      if (count < 0 && errno != EINTR)
+        throw runtime_error("Can't receive response: "s + strerror(errno));
+      input.append(buffer, max<ssize_t>(count, 0));
+    }
+    read_pos = input.size() - pending.size();
+    return frame;
+  }
+};
+
+void put_get(string& out, const string& path) {
+  auto start = begin_frame(out);
+  out.push_back(request_get);
+  out.append(path);
+  end_frame(out, start);
+}
+
+void put_get_many(string& out, const vector<string>& paths) {
+  auto start = begin_frame(out);
+  out.push_back(request_get_many);
+  put_u32(out, paths.size());
+  for (auto& path : paths)
+    put_sized(out, path);
+  end_frame(out, start);
+}
+
+void put_set(string& out, const string& path, const string& value) {
+  auto start = begin_frame(out);
+  out.push_back(request_set);
+  put_sized(out, path);
+  out.append(value);
+  end_frame(out, start);
+}
+
+const char* status_name(uint8_t status) {
+  switch (status) {
+    case status_ok: return "ok";
+    case status_missing_key: return "missing key";
+    case status_unavailable: return "unavailable";
+    case status_invalid_value: return "invalid value";
+    case status_error: return "error";
+    case status_bad_request: return "bad request";
+    case status_read_only: return "read only";
+  }
+  return "unknown status";
+}
+
+// The status of a response. A get_many response fails with the first of its keys that fails
+uint8_t response_status(string_view frame, bool many) {
+  frame_reader response(frame);
+  auto status = response.u8();
+  if (!many || status != status_ok)
+    return status;
+  for (auto count = response.u32(); count-- && response.valid && status == status_ok;) {
+    status = response.u8();
+    response.sized();
+  }
+  return response.valid ? status : status_bad_request;
+}
+
+struct load_options {
+  size_t requests{100000}, connections{1}, depth{16}, batch{0};
+};
+
+// Sends requests for `paths` on every connection, keeping `depth` of them waiting for their responses
+// Prints the successful requests per second, the percentiles of the latency and the failed requests
+int load_test(const char* socket_path, const vector<string>& paths, const load_options& options) {
+  vector<vector<double>> latencies(options.connections);
+  vector<string> errors(options.connections);
+  // The failed requests of every connection, by status
+  vector<map<uint8_t, size_t>> failures(options.connections);
+  vector<thread> threads;
+  auto start = request_clock::now();
+  for (size_t c = 0; c < options.connections; c++) {
+    threads.emplace_back([&, c] {
+      try {
+        client conn(socket_path);
+        size_t total = options.requests / options.connections + (c < options.requests % options.connections);
+        deque<request_clock::time_point> sent;
+        size_t next_path = c, issued = 0;
+        auto send_next = [&] {
+          issued++;
+          string frame;
+          if (options.batch) {
+            vector<string> batch;
+            for (size_t i = 0; i < options.batch; i++)
+              batch.push_back(paths[next_path++ % paths.size()]);
+            put_get_many(frame, batch);
+          } else put_get(frame, paths[next_path++ % paths.size()]);
+          sent.push_back(request_clock::now());
+          conn.send(frame);
+        };
+        auto& result = latencies[c];
+        result.reserve(total);
+        for (size_t i = 0; i < min(total, options.depth); i++)
+          send_next();
+        for (size_t done = 0; done < total; done++) {
+          auto status = response_status(conn.receive(), options.batch);
+          if (status != status_ok)
+            failures[c][status]++;
+          else result.push_back(chrono::duration<double, micro>(request_clock::now() - sent.front()).count());
+          sent.pop_front();
+          if (issued < total)
+            send_next();
+        }
+      } catch (const exception& e) {
+        errors[c] = e.what();
+      }
+    });
+  }
+  for (auto& t : threads)
+    t.join();
+  auto seconds = chrono::duration<double>(request_clock::now() - start).count();
+  for (auto& e : errors)
+    if (!e.empty()) {
+      cerr << e << endl;
+      return 1;
+    }
+
+  vector<double> all;
+  for (auto& l : latencies)
+    all.insert(all.end(), l.begin(), l.end());
+  map<uint8_t, size_t> failed;
+  for (auto& f : failures)
+    for (auto& [status, count] : f)
+      failed[status] += count;
+  sort(all.begin(), all.end());
+  auto percentile = [&](double p) { return all.empty() ? 0 : all[min(all.size() - 1, size_t(p * all.size()))]; };
+  cout << all.size() << " requests in " << seconds << " s: " << size_t(all.size() / seconds) << " requests/s";
+  if (options.batch)
+    cout << ", " << size_t(all.size() * options.batch / seconds) << " keys/s";
+  cout << endl << "Latency in us: p50 " << percentile(0.5) << ", p99 " << percentile(0.99)
+       << ", p99.9 " << percentile(0.999) << ", max " << (all.empty() ? 0 : all.back()) << endl;
+  for (auto& [status, count] : failed)
+    cerr << count << " requests failed: " << status_name(status) << endl;
+  return failed.empty() ? 0 : 1;
+}
+
+void print_help(const char* name) {
+  cout << "Syntax: " << name << " -s socket-path [-g key]... [-w key=value]..." << endl;
+  cout << "        " << name << " -s socket-path -l requests [-c connections] [-d depth] [-b batch-size] -g key..." << endl;
+  cout << "Gets and sets keys of linkt_daemon in the order of the options, printing the values that it gets" << endl;
+  cout << "With -l, sends the given number of get requests for the keys and prints their throughput and latency." << endl;
+  cout << "Every connection keeps `depth` requests in flight. With -b, every request gets many keys at once" << endl;
+}
+
+int main(int argc, char** argv) {
+  const char* socket_path = nullptr;
+  // The requests in the order of the options. Sets hold the key and the value
+  vector<pair<string, optional<string>>> requests;
+  vector<string> paths;
+  load_options options;
+  bool load = false;
+
+  for (int ch; (ch = getopt(argc, argv, "s:g:w:l:c:d:b:h")) != -1;) {
+    switch (ch) {
+      case 's': socket_path = optarg; break;
+      case 'g':
+        requests.emplace_back(optarg, nullopt);
+        paths.emplace_back(optarg);
+        break;
+      case 'w': {
+        string arg = optarg;
+        auto eq = arg.find('=');
+        if (eq == string::npos) {
+          cerr << "Expected key=value: " << arg << endl;
+          return 1;
+        }
+        requests.emplace_back(arg.substr(0, eq), arg.substr(eq + 1));
+        break;
+      }
+      case 'l': load = true; options.requests = stoul(optarg); break;
+      case 'c': options.connections = max(1ul, stoul(optarg)); break;
+      case 'd': options.depth = max(1ul, stoul(optarg)); break;
+      case 'b': options.batch = stoul(optarg); break;
+      default:
+        print_help(*argv);
+        return 1;
+    }
+  }
+  if (!socket_path || (load && paths.empty())) {
+    print_help(*argv);
+    return 1;
+  }
+  signal(SIGPIPE, SIG_IGN);
+  if (load)
+    return load_test(socket_path, paths, options);
+
+  try {
+    client conn(socket_path);
+    // Every request is sent before the first response is read
+    string frames;
+    for (auto& request : requests) {
+      if (request.second)
+        put_set(frames, request.first, *request.second);
+      else put_get(frames, request.first);
+    }
+    conn.send(frames);
+    int result = 0;
+    for (auto& request : requests) {
+      frame_reader response(conn.receive());
+      auto status = response.u8();
+      if (status != status_ok) {
+        cerr << request.first << ": " << status_name(status) << endl;
+        result = 1;
+      } else if (!request.second)
+        cout << response.rest << endl;
+    }
+    return result;
+  } catch (const exception& e) {
+    cerr << e.what() << endl;
+    return 1;
+  }
+}
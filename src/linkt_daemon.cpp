@@ -0,0 +1,210 @@
+#include "tree_files.hpp"
+#include "daemon_protocol.hpp"
+#include <getopt.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <csignal>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unordered_map>
+#include <iostream>
+
+using namespace std;
+using namespace daemon_protocol;
+
+// Responses are queued up to this size, then requests wait in the input until the client reads them
+constexpr size_t max_pending_output = 1 << 20;
+
+volatile sig_atomic_t stopping = 0;
+
+struct connection {
+  int fd;
+  string input, output;
+  // The part of `output` already written
+  size_t written{0};
+  bool writing{false};
+};
+
+struct server {
+  responder protocol;
+  int epoll_fd{-1}, listen_fd{-1};
+  unordered_map<int, connection> connections;
+
+  explicit server(node::wrapper_s tree) : protocol(move(tree)) {}
+
+  void close_connection(connection& conn) {
+    close(conn.fd);
+    connections.erase(conn.fd);
+  }
+
+  void watch(connection& conn, bool writing) {
+    epoll_event event{};
+    // Clients that don't read their responses aren't read from either
+    event.events = writing ? EPOLLOUT : EPOLLIN;
+    event.data.fd = conn.fd;
+    epoll_ctl(epoll_fd, EPOLL_CTL_MOD, conn.fd, &event);
+    conn.writing = writing;
+  }
+
+  // Writes as much of the output as the socket takes. Returns false if the connection failed
+  bool flush(connection& conn) {
+    while (conn.written < conn.output.size()) {
+      auto count = write(conn.fd, conn.output.data() + conn.written, conn.output.size() - conn.written);
+      if (count < 0) {
+        if (errno == EINTR) continue;
+        return errno == EAGAIN || errno == EWOULDBLOCK;
+      }
+      conn.written += count;
+    }
+    conn.output.clear();
+    conn.written = 0;
+    return true;
+  }
+
+  // Responds to the requests that arrived completely, then writes the responses
+  // Returns false if the connection must be closed
+  bool process(connection& conn) {
+    string_view pending, frame;
+    bool too_large = false;
+    do {
+      pending = conn.input;
+      while (conn.output.size() - conn.written < max_pending_output && next_frame(pending, frame, too_large))
+        protocol.respond(frame, conn.output);
+      if (too_large)
+        return false;
+      conn.input.erase(0, conn.input.size() - pending.size());
+      if (!flush(conn))
+        return false;
+      // Requests held back by a full output are handled once it drains
+    } while (conn.output.empty() && next_frame(pending = conn.input, frame, too_large));
+    if (conn.output.empty() != !conn.writing)
+      watch(conn, !conn.output.empty());
+    return true;
+  }
+
+  bool read_input(connection& conn) {
+    char buffer[1 << 16];
+    while (true) {
+      auto count = read(conn.fd, buffer, sizeof(buffer));
+      if (count > 0) {
+        conn.input.append(buffer, count);
+      } else if (count == 0) {
+        return false;
+      } else if (errno == EINTR) {
+        continue;
+      } else return errno == EAGAIN || errno == EWOULDBLOCK;
+    }
+  }
+
+  void accept_connections() {
+    while (true) {
+      int fd = accept4(listen_fd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+      if (fd < 0)
+        return;
+      epoll_event event{};
+      event.events = EPOLLIN;
+      event.data.fd = fd;
+      if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event)) {
+        close(fd);
+        continue;
+      }
+      connections.emplace(fd, connection{fd});
+    }
+  }
+
+  int run(const char* socket_path) {
+    sockaddr_un address{};
+    address.sun_family = AF_UNIX;
+    if (strlen(socket_path) >= sizeof(address.sun_path)) {
+      cerr << "Socket path is too long: " << socket_path << endl;
+      return 1;
+    }
+    strcpy(address.sun_path, socket_path);
+    listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    unlink(socket_path);
+    if (listen_fd < 0 || bind(listen_fd, (sockaddr*)&address, sizeof(address)) || listen(listen_fd, SOMAXCONN)) {
+      cerr << "Can't listen on socket: " << socket_path << ": " << strerror(errno) << endl;
+      return 1;
+    }
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    epoll_event event{};
+    event.events = EPOLLIN;
+    event.data.fd = listen_fd;
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, listen_fd, &event);
+
+    epoll_event events[64];
+    while (!stopping) {
+      int count = epoll_wait(epoll_fd, events, 64, -1);
+      for (int i = 0; i < count; i++) {
+        int fd = events[i].data.fd;
+        if (fd == listen_fd) {
+          accept_connections();
+          continue;
+        }
+        auto it = connections.find(fd);
+        if (it == connections.end())
+          continue;
+        auto& conn = it->second;
+        bool open = !(events[i].events & (EPOLLERR | EPOLLHUP)) || (events[i].events & EPOLLIN);
+        if (open && (events[i].events & EPOLLIN))
+          open = read_input(conn);
+        // Requests that arrived before the client closed its end are still answered, as far as the socket takes the responses
+        if (!process(conn) || !open)
+          close_connection(conn);
+      }
+    }
+    for (auto& pair : connections)
+      close(pair.first);
+    close(epoll_fd);
+    close(listen_fd);
+    unlink(socket_path);
+    return 0;
+  }
+};
+
+void print_help(const char* name) {
+  cout << "Syntax: " << name << " [-i dictionary-path]... -s socket-path" << endl;
+  cout << "Serves the keys of the dictionaries on a Unix domain socket. Dictionaries ending in .bin are snapshots" << endl;
+}
+
+int main(int argc, char** argv) {
+  auto tree = std::make_shared<node::wrapper>();
+  const char* socket_path = nullptr;
+  bool errors = false, snapshots = false;
+
+  for (int ch; (ch = getopt(argc, argv, "i:s:h")) != -1;) {
+    switch (ch) {
+      case 'i':
+        errors |= merge_file(optarg, tree);
+        snapshots |= ends_with(optarg, ".bin");
+        break;
+      case 's':
+        socket_path = optarg;
+        break;
+      default:
+        print_help(*argv);
+        return 1;
+    }
+  }
+  if (!socket_path) {
+    print_help(*argv);
+    return 1;
+  }
+  if (errors)
+    cerr << "Serving the keys that loaded without errors" << endl;
+  // Snapshots may hold optimized trees, which can't be optimized again
+  if (!snapshots) {
+    node::clone_context context;
+    tree->optimize(context);
+    for (auto& e : context.errors)
+      cerr << "At " << e.first << ": " << e.second << endl;
+  }
+
+  struct sigaction action{};
+  action.sa_handler = [](int) { stopping = 1; };
+  sigaction(SIGINT, &action, nullptr);
+  sigaction(SIGTERM, &action, nullptr);
+  signal(SIGPIPE, SIG_IGN);
+  return server(tree).run(socket_path);
+}
@@ -0,0 +1,111 @@
+#include "animate.hpp"
+#include "common.hpp"
+
+#include <algorithm>
+#include <unordered_map>
+#include <unordered_set>
+
+NAMESPACE(node)
+
+smooth_batch::smooth_batch(wrapper_s tree_) : tree(move(tree_)) {
+  if (!tree)
+    throw required_field_null_error("smooth_batch::smooth_batch");
+  collect();
+}
+
+void smooth_batch::collect() {
+  nodes.clear();
+  std::unordered_set<const base<string>*> visited;
+  std::vector<base_s> pending{tree};
+  while (!pending.empty()) {
+    auto node = move(pending.back());
+    pending.pop_back();
+    if (!node || !visited.insert(node.get()).second)
+      continue;
+    if (auto wrp = std::dynamic_pointer_cast<wrapper>(node))
+      wrp->iterate_children([&](const string&, const base_s& child) { pending.push_back(child); });
+    else if (auto animation = std::dynamic_pointer_cast<const smooth>(node))
+      nodes.push_back(animation);
+    try {
+      node->iterate_dependencies([&](const base_s& dep) { pending.push_back(dep); });
+    } catch (const std::exception&) {
+      // Broken references lead to no node
+    }
+  }
+
+  sources.clear();
+  source_of.clear();
+  std::unordered_map<const base<float>*, size_t> source_index;
+  for (auto& node : nodes) {
+    auto inserted = source_index.emplace(node->value.get(), sources.size());
+    if (inserted.second)
+      sources.push_back(node->value);
+    source_of.push_back(inserted.first->second);
+  }
+  source_values.resize(sources.size());
+  source_failed.resize(sources.size());
+}
+
+size_t smooth_batch::update(steady_time now) {
+  for (size_t i = 0; i < sources.size(); i++) {
+    try {
+      source_values[i] = sources[i]->operator float();
+      source_failed[i] = false;
+    } catch (const std::exception&) {
+      // The nodes report the error themselves when they're read
+      source_failed[i] = true;
+    }
+  }
+  size_t result = 0;
+  for (size_t first = 0; first < nodes.size(); first += block_size)
+    result += update_block(first, std::min(nodes.size(), first + block_size), now);
+  return result;
+}
+
+size_t smooth_batch::update_block(size_t first, size_t last, steady_time now) {
+  size_t count = 0, result = 0;
+  for (size_t n = first; n < last; n++) {
+    auto source = source_of[n];
+    if (source_failed[source])
+      continue;
+    auto& node = *nodes[n];
+    auto node_target = source_values[source];
+    if (node.at_rest(node_target))
+      continue;
+    auto node_steps = node.claim_steps(now);
+    if (node_steps == 0) {
+      // Already stepped in this frame
+      result++;
+      continue;
+    }
+    auto state = node.current.load(std::memory_order_relaxed);
+    moving[count] = &node;
+    previous[count] = state;
+    current[count] = state.current;
+    velocity[count] = state.velocity;
+    target[count] = node_target;
+    spring[count] = node.spring;
+    drag[count] = node.drag;
+    steps[count] = node_steps;
+    count++;
+  }
+
+  // Nodes that were read in this frame already take fewer steps than the others
+  int most_steps = count ? *std::max_element(steps.begin(), steps.begin() + count) : 0;
+  for (int s = 0; s < most_steps; s++)
+    for (size_t i = 0; i < count; i++)
+      if (s < steps[i])
+        smooth::step(current[i], velocity[i], target[i], spring[i], drag[i]);
+
+  for (size_t i = 0; i < count; i++) {
+    auto prev = previous[i];
+    smooth::state next{current[i], velocity[i]};
+    if (!moving[i]->store(prev, next, target[i]))
+      next = moving[i]->take_steps(prev, steps[i], target[i]);
+    if (next.velocity != 0 || next.current != target[i])
+      result++;
+  }
+  return result;
+}
+
+NAMESPACE_END
@@ -1,9 +1,14 @@
 #include "base.hpp"
 #include "common.hpp"
 #include "wrapper.hpp"
+#include "reference.hpp"
 #include "token_iterator.hpp"
 
 #include <sstream>
+#include <cstdint>
+#include <cstdio>
+#include <charconv>
+#include <algorithm>
 
 NAMESPACE(node)
 
@@ -17,6 +22,86 @@ throwing_clone_context::~throwing_clone_context()  noexcept(false) {
   THROW_ERROR(node, "Errors while cloning: \n" + ss.str());
 }
 
+template<class T> const base<string>*
+ref_target(const base<string>* node) {
+  auto reference = dynamic_cast<const ref<T>*>(node);
+  return reference ? reference->get_source().get() : nullptr;
+}
+
+bool is_plain(const base<string>* node) {
+  return dynamic_cast<const plain<string>*>(node) || dynamic_cast<const plain<float>*>(node)
+      || dynamic_cast<const plain<int>*>(node);
+}
+
+string structural_id(const base_s& node) {
+  if (!node)
+    return "-";
+  // Optimized references are created for every use, so they are identified by their target
+  if (auto target = ref_target<string>(node.get()) ?: ref_target<float>(node.get()) ?: ref_target<int>(node.get()))
+    return "@" + std::to_string(reinterpret_cast<uintptr_t>(target));
+  // Check the type first, because other nodes may not be ready to be evaluated while cloning
+  if (is_plain(node.get()) && node->is_fixed()) {
+    auto value = node->get();
+    return "=" + std::to_string(value.size()) + ":" + value;
+  }
+  return "@" + std::to_string(reinterpret_cast<uintptr_t>(node.get()));
+}
+
+base_s share_node(clone_context& context, const string& key, base_s node) {
+  // Keys hold addresses, which only identify nodes inside the clone of a single tree
+  if (!context.optimize || context.ancestors.mark() == 0)
+    return node;
+  return context.shared_nodes.emplace(key, move(node)).first->second;
+}
+
+base_s fold_constant(const base_s& source, base_s result, clone_context& context) {
+  if (!context.optimize || !result || dynamic_cast<const wrapper*>(result.get()))
+    return result;
+  if (is_plain(result.get())) {
+    // Some nodes fold themselves when cloned
+    if (!is_plain(source.get()))
+      context.folded_count++;
+    return result;
+  }
+  // References are left to point at their target, which is folded on its own. They may also form cycles that can't be checked
+  if (dynamic_cast<const ref_base<string>*>(result.get()) || dynamic_cast<const ref_base<float>*>(result.get())
+      || dynamic_cast<const ref_base<int>*>(result.get()))
+    return result;
+  // The children of `result` have been folded already, so checking it doesn't go deep
+  // Sources are remembered by their address, so only inside the clone of a single tree
+  bool memoize = context.ancestors.mark() != 0;
+  auto memo = memoize ? context.fixed_nodes.find(source.get()) : context.fixed_nodes.end();
+  bool fixed;
+  if (memo != context.fixed_nodes.end()) {
+    fixed = memo->second;
+  } else {
+    try {
+      fixed = result->is_fixed();
+    } catch (const std::exception&) {
+      // References that can't be resolved yet aren't fixed
+      return result;
+    }
+    if (memoize)
+      context.fixed_nodes.emplace(source.get(), fixed);
+  }
+  if (!fixed)
+    return result;
+  try {
+    base_s folded;
+    // Keep numeric values as numbers, so that they don't lose precision by being printed
+    if (auto number = dynamic_cast<const base<float>*>(result.get()))
+      folded = std::make_shared<plain<float>>(number->operator float());
+    else if (auto integer = dynamic_cast<const base<int>*>(result.get()))
+      folded = std::make_shared<plain<int>>(integer->operator int());
+    else
+      folded = std::make_shared<plain<string>>(result->get());
+    context.folded_count++;
+    return folded;
+  } catch (const std::exception&) {
+    return result;
+  }
+}
+
 // Use in text parsing, separate the key and the content using a separator character
 // Reports an error if the separator character isn't found
 bool errorlist::extract_key(tstring& line, int linecount, char separator, tstring& key) {
@@ -51,6 +136,30 @@ parse<float>(const char* str, size_t len) {
   return result;
 }
 
+char* write_number(char* out, long long value, int precision) {
+  auto end = std::to_chars(out, out + number_size, value).ptr;
+  // Integers are written exactly, rather than through a float that loses their digits above 2^24
+  if (precision > 0) {
+    *end++ = '.';
+    end = std::fill_n(end, std::min(precision, max_precision), '0');
+  }
+  return end;
+}
+
+char* write_number(char* out, float value, int precision) {
+  // snprintf rather than to_chars, which libstdc++ has for floats only from GCC 11
+  auto length = std::snprintf(out, number_size, "%.*f", precision >= 0 ? std::min(precision, max_precision) : 6, value);
+  auto end = out + std::clamp<int>(length, 0, number_size - 1);
+  if (precision >= 0)
+    return end;
+  // Drop the trailing zeros, then the point if they were all the digits after it. Infinities and NaNs have no point
+  if (std::find(out, end, '.') == end)
+    return end;
+  while (end[-1] == '0')
+    end--;
+  return end[-1] == '.' ? end - 1 : end;
+}
+
   template<> string
 parse<string>(const char* str, size_t len) {
   if (!str) throw node_error("trying to parse null");
@@ -0,0 +1,112 @@
+#include "deferred.hpp"
+#include "wrapper.hpp"
+#include "scan.hpp"
+#include "common.hpp"
+
+#include <vector>
+#include <optional>
+#include <algorithm>
+
+NAMESPACE(node)
+
+namespace {
+  // The deferred nodes being parsed by this thread, to catch values that need themselves while being parsed
+  thread_local std::vector<const deferred*> being_parsed;
+}
+
+bool deferred::can_defer(const tstring& value) {
+  std::string_view text(value.begin(), value.size());
+  return !has_operator(text, "clone") && !has_operator(text, "save");
+}
+
+deferred::deferred(const parse_context& context, const tstring& place_path, const tstring& value, parser parse)
+    : parent_w(context.parent), root_w(context.root), path(context.current_path), place_path(place_path),
+      text(value), parse(parse), on_error(context.deferred_errors) {}
+
+base_s deferred::get_parsed() const {
+  if (std::find(being_parsed.begin(), being_parsed.end(), this) != being_parsed.end())
+    throw node_error("In " + path + ": The value is needed while parsing itself");
+  node_lock lock(mutex);
+  if (done) {
+    if (!error.empty())
+      throw node_error(error);
+    return parsed;
+  }
+  parse_context context;
+  context.parent = parent_w.lock();
+  context.root = root_w.lock();
+  if (!context.parent || !context.root)
+    throw node_error("In " + path + ": The tree of the value was destroyed");
+  context.raw = text;
+  context.current_path = path;
+
+  // Parse into the place of this node, unless it has been moved from there
+  base_s self, detached;
+  context.place = &detached;
+  if (auto place = context.parent->get_child_place(place_path)) {
+    auto inner = place;
+    if (auto wrp = std::dynamic_pointer_cast<wrapper>(*place))
+      if (auto it = wrp->map.find(""); it != wrp->map.end())
+        inner = &it->second;
+    if (inner->get() == this) {
+      // Keep this node alive while its place is emptied for the result
+      self = std::move(*inner);
+      context.place = place;
+    }
+  }
+
+  done = true;
+  std::optional<string> msg;
+  being_parsed.push_back(this);
+  try {
+    tstring value(context.raw);
+    if (auto node = parse(context, value))
+      parsed = context.get_place() = node;
+    else
+      parsed = context.current;
+  } catch (const std::exception& e) {
+    msg = e.what();
+  }
+  being_parsed.pop_back();
+  if (msg) {
+    // Like in an eager parse, the key is left without a value
+    error = "In " + path + ": " + *msg;
+    if (on_error)
+      on_error(path, *msg);
+    throw node_error(error);
+  }
+  return parsed;
+}
+
+deferred::operator string() const {
+  auto node = get_parsed();
+  return node ? node->get() : "";
+}
+
+text_view deferred::view(string& scratch) const {
+  auto node = get_parsed();
+  return node ? node->view(scratch) : text_view();
+}
+
+base_s deferred::clone(clone_context& context) const {
+  auto node = get_parsed();
+  return node ? node->clone(context) : base_s();
+}
+
+bool deferred::is_fixed() const {
+  auto node = get_parsed();
+  return !node || node->is_fixed();
+}
+
+void deferred::iterate_dependencies(std::function<void(const base_s&)> processor) const {
+  base_s node;
+  try {
+    node = get_parsed();
+  } catch (const node_error&) {
+    // Values that fail to parse have no dependencies, their error is thrown when they're read
+  }
+  if (node)
+    processor(node);
+}
+
+NAMESPACE_END
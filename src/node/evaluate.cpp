@@ -0,0 +1,358 @@
+#include "evaluate.hpp"
+#include "node.hpp"
+#include "reference.hpp"
+#include "common.hpp"
+
+#include <utility>
+#include <optional>
+#include <unordered_map>
+
+NAMESPACE(node)
+
+thread_pool::thread_pool(unsigned thread_count) {
+  if (!thread_count)
+    thread_count = 1;
+  for (unsigned i = 0; i < thread_count; i++)
+    queues.emplace_back(std::make_unique<worker_queue>());
+  for (unsigned i = 0; i < thread_count; i++)
+    threads.emplace_back([this, i] { run(i); });
+}
+
+thread_pool::~thread_pool() {
+  {
+    std::lock_guard<std::mutex> lock(state_mutex);
+    stopping = true;
+  }
+  wakeup.notify_all();
+  for (auto& thread : threads)
+    thread.join();
+}
+
+void thread_pool::submit(std::function<void()> task) {
+  auto& queue = *queues[next_queue++ % queues.size()];
+  {
+    std::lock_guard<std::mutex> lock(queue.mutex);
+    queue.tasks.push_back(move(task));
+  }
+  {
+    std::lock_guard<std::mutex> lock(state_mutex);
+    queued++;
+    pending++;
+  }
+  wakeup.notify_one();
+}
+
+void thread_pool::wait() {
+  std::unique_lock<std::mutex> lock(state_mutex);
+  idle.wait(lock, [&] { return pending == 0; });
+  if (auto rethrown = std::exchange(error, nullptr))
+    std::rethrow_exception(rethrown);
+}
+
+// Take a task from the back of our own queue, or steal one from the front of another worker's queue
+bool thread_pool::take(size_t index, std::function<void()>& task) {
+  for (size_t i = 0; i < queues.size(); i++) {
+    auto& queue = *queues[(index + i) % queues.size()];
+    std::lock_guard<std::mutex> lock(queue.mutex);
+    if (queue.tasks.empty())
+      continue;
+    if (i == 0) {
+      task = move(queue.tasks.back());
+      queue.tasks.pop_back();
+    } else {
+      task = move(queue.tasks.front());
+      queue.tasks.pop_front();
+    }
+    return true;
+  }
+  return false;
+}
+
+void thread_pool::run(size_t index) {
+  while (true) {
+    {
+      // Claim one of the queued tasks, the task itself is found afterward
+      std::unique_lock<std::mutex> lock(state_mutex);
+      wakeup.wait(lock, [&] { return stopping || queued > 0; });
+      if (!queued)
+        return;
+      queued--;
+    }
+    std::function<void()> task;
+    while (!take(index, task))
+      std::this_thread::yield();
+    try {
+      task();
+    } catch (...) {
+      std::lock_guard<std::mutex> lock(state_mutex);
+      if (!error)
+        error = std::current_exception();
+    }
+    std::lock_guard<std::mutex> lock(state_mutex);
+    if (--pending == 0)
+      idle.notify_all();
+  }
+}
+
+namespace {
+  struct evaluation_key {
+    string path;
+    base_s node;
+  };
+
+  // Collect the keys to be evaluated, skipping hidden keys like `wrapper::merge` does
+  void collect_keys(const wrapper& source, const string& prefix, vector<evaluation_key>& keys) {
+    for (auto& pair : source.map) {
+      if (!pair.second || (!pair.first.empty() && pair.first.front() == '.'))
+        continue;
+      auto path = pair.first.empty() ? prefix : prefix.empty() ? pair.first : prefix + "." + pair.first;
+      if (auto wrp = std::dynamic_pointer_cast<wrapper>(pair.second)) {
+        if (wrp->map.find(".hidden") == wrp->map.end())
+          collect_keys(*wrp, path, keys);
+      } else if (!path.empty())
+        keys.push_back({path, pair.second});
+    }
+  }
+
+  // Union-find over nodes, used to group the keys that read from the same nodes
+  struct node_groups {
+    std::unordered_map<const base<string>*, const base<string>*> parents;
+
+    const base<string>* find(const base<string>* node) {
+      auto root = node;
+      while (parents[root] != root)
+        root = parents[root];
+      while (node != root)
+        node = std::exchange(parents[node], root);
+      return root;
+    }
+
+    // Returns false if the node was already added
+    bool add(const base<string>* node) {
+      return parents.emplace(node, node).second;
+    }
+
+    void unite(const base<string>* a, const base<string>* b) {
+      parents[find(a)] = find(b);
+    }
+  };
+}
+
+snapshot evaluate_all(const wrapper_s& root, executor& exec, errorlist& errors) {
+  vector<evaluation_key> keys;
+  collect_keys(*root, "", keys);
+
+  // Each key joins the group of every node it reaches
+  // A node that has been reached before is already united with its own dependencies, so we don't descend into it again
+  node_groups groups;
+  for (auto& key : keys) {
+    if (!groups.add(key.node.get()))
+      continue;
+    vector<base_s> stack{key.node};
+    while (!stack.empty()) {
+      auto current = move(stack.back());
+      stack.pop_back();
+      try {
+        current->iterate_dependencies([&](const base_s& dependency) {
+          if (!dependency) return;
+          if (groups.add(dependency.get()))
+            stack.push_back(dependency);
+          groups.unite(key.node.get(), dependency.get());
+        });
+      } catch (const std::exception&) {
+        // Broken references are reported when the key is evaluated
+      }
+    }
+  }
+  std::unordered_map<const base<string>*, vector<const evaluation_key*>> tasks;
+  for (auto& key : keys)
+    tasks[groups.find(key.node.get())].push_back(&key);
+
+  snapshot result;
+  std::mutex result_mutex;
+  for (auto& pair : tasks) {
+    exec.submit([&, group = &pair.second] {
+      vector<std::pair<string, string>> values, group_errors;
+      for (auto key : *group) {
+        try {
+          values.emplace_back(key->path, key->node->get());
+        } catch (const std::exception& e) {
+          group_errors.emplace_back(key->path, e.what());
+        }
+      }
+      std::lock_guard<std::mutex> lock(result_mutex);
+      for (auto& value : values)
+        result.emplace(move(value));
+      for (auto& err : group_errors)
+        errors.report_error(err.first, err.second);
+    });
+  }
+  exec.wait();
+  return result;
+}
+
+snapshot evaluate_all(const wrapper_s& root, executor& exec) {
+  errorlist errors;
+  return evaluate_all(root, exec, errors);
+}
+
+namespace {
+  struct color_key {
+    string path;
+    base_s* place;
+    const color* node;
+    string input;
+    std::optional<string> result;
+    string error;
+  };
+
+  // Whether the color always gives the same value, including its fallback. A broken reference counts as not fixed
+  bool is_fixed_color(const color& node) {
+    try {
+      return node.is_fixed() && (!node.fallback || node.fallback->is_fixed());
+    } catch (const std::exception&) {
+      return false;
+    }
+  }
+
+  // Collect the places of the fixed color keys, skipping hidden keys like `collect_keys` does
+  void collect_colors(wrapper& source, const string& prefix, vector<color_key>& keys) {
+    for (auto& pair : source.map) {
+      if (!pair.second || (!pair.first.empty() && pair.first.front() == '.'))
+        continue;
+      auto path = pair.first.empty() ? prefix : prefix.empty() ? pair.first : prefix + "." + pair.first;
+      if (auto wrp = std::dynamic_pointer_cast<wrapper>(pair.second)) {
+        if (wrp->map.find(".hidden") == wrp->map.end())
+          collect_colors(*wrp, path, keys);
+      } else if (auto node = dynamic_cast<const color*>(pair.second.get()); node && is_fixed_color(*node))
+        keys.push_back({path, &pair.second, node, {}, {}, {}});
+    }
+  }
+}
+
+size_t bake_colors(const wrapper_s& root, executor& exec, errorlist& errors) {
+  vector<color_key> keys;
+  collect_colors(*root, "", keys);
+
+  // The inputs are read here, because the nodes they come from may not be thread-safe
+  std::unordered_map<string, vector<color_key*>> groups;
+  for (auto& key : keys) {
+    try {
+      key.input = key.node->value->get();
+      groups[key.node->processor_params].push_back(&key);
+    } catch (const std::exception& e) {
+      // Left without a result, so that the fallback applies below
+      key.error = e.what();
+    }
+  }
+  for (auto& pair : groups) {
+    exec.submit([group = &pair.second] {
+      auto& processor = group->front()->node->processor;
+      // Maps each distinct input to its result, or the error it caused
+      std::unordered_map<string, std::pair<std::optional<string>, string>> converted;
+      for (auto key : *group) {
+        auto [it, inserted] = converted.emplace(key->input, std::make_pair(std::nullopt, string()));
+        if (inserted) {
+          try {
+            it->second.first = processor.operate(key->input);
+          } catch (const std::exception& e) {
+            it->second.second = e.what();
+          }
+        }
+        key->result = it->second.first;
+        key->error = it->second.second;
+      }
+    });
+  }
+  exec.wait();
+
+  // Fallbacks follow the rules of `color::operator string`
+  size_t count = 0;
+  for (auto& key : keys) {
+    try {
+      if (!key.result || key.result->empty()) {
+        if (auto& fallback = key.node->fallback)
+          key.result = fallback->get();
+        else if (!key.result)
+          THROW_ERROR(node, "Color processing failed, due to: " + key.error);
+      }
+    } catch (const std::exception& e) {
+      errors.report_error(key.path, e.what());
+      continue;
+    }
+    *key.place = std::make_shared<plain<string>>(move(*key.result));
+    count++;
+  }
+  return count;
+}
+
+template<class T> bool
+is_broken_ref(const base<string>& node) {
+  auto ref = dynamic_cast<const ref_base<T>*>(&node);
+  return ref && !ref->get_source();
+}
+
+bool is_broken_reference(const base<string>& node) {
+  return is_broken_ref<string>(node) || is_broken_ref<int>(node) || is_broken_ref<float>(node);
+}
+
+// Finds the nodes that read changed nodes, remembering the answer for every node visited
+struct dependent_finder {
+  const std::unordered_set<const base<string>*>& changed;
+  bool removed;
+  std::function<bool(const base<string>*)> unaffected;
+  std::unordered_map<const base<string>*, bool> reads_changed;
+  size_t invalidated{0};
+
+  bool visit(const base_s& node) {
+    if (!node || (unaffected && unaffected(node.get())))
+      return false;
+    if (auto it = reads_changed.find(node.get()); it != reads_changed.end())
+      return it->second;
+    // A node that reads itself through a cycle doesn't count as reading a change through it
+    reads_changed.emplace(node.get(), false);
+    auto result = changed.count(node.get()) > 0;
+    try {
+      node->iterate_dependencies([&](const base_s& dep) {
+        if (visit(dep))
+          result = true;
+      });
+      if (removed && is_broken_reference(*node))
+        result = true;
+    } catch (const std::exception&) {
+      result = true;
+    }
+    if (result && !changed.count(node.get())) {
+      node->invalidate();
+      invalidated++;
+    }
+    reads_changed[node.get()] = result;
+    return result;
+  }
+
+  void visit_children(const wrapper& wrp) {
+    for (auto& pair : wrp.map) {
+      if (auto child = std::dynamic_pointer_cast<wrapper>(pair.second))
+        visit_children(*child);
+      else
+        visit(pair.second);
+    }
+  }
+};
+
+size_t invalidate_dependents(const wrapper_s& root, const std::unordered_set<const base<string>*>& changed,
+    bool removed) {
+  dependent_finder finder{changed, removed};
+  finder.visit_children(*root);
+  return finder.invalidated;
+}
+
+size_t invalidate_dependents(const vector<base_s>& roots, const std::unordered_set<const base<string>*>& changed,
+    bool removed, const std::function<bool(const base<string>*)>& unaffected) {
+  dependent_finder finder{changed, removed, unaffected};
+  for (auto& node : roots)
+    finder.visit(node);
+  return finder.invalidated;
+}
+
+NAMESPACE_END
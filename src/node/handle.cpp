@@ -0,0 +1,85 @@
+#include "handle.hpp"
+#include "common.hpp"
+
+#include <atomic>
+#include <typeinfo>
+#include <unordered_set>
+
+NAMESPACE(node)
+
+tree_handle::tree_handle(wrapper_s root) : root(move(root)) {}
+
+wrapper_s tree_handle::get() const {
+  return std::atomic_load(&root);
+}
+
+void tree_handle::publish(wrapper_s new_root, bool keep_state) {
+  std::lock_guard<std::mutex> lock(reload_mutex);
+  if (keep_state)
+    if (auto old_root = get())
+      carry_state(*new_root, *old_root);
+  std::atomic_store(&root, move(new_root));
+}
+
+std::future<errorlist> tree_handle::reload(loader load, bool keep_state) {
+  return std::async(std::launch::async, [this, load = move(load), keep_state] {
+    errorlist errors;
+    auto new_root = load(errors);
+    if (!new_root)
+      THROW_ERROR(node, "tree_handle::reload: Loader returned an empty tree");
+    clone_context context;
+    new_root->optimize(context);
+    for (auto& err : context.errors)
+      errors.emplace_back(err);
+    publish(move(new_root), keep_state);
+    return errors;
+  });
+}
+
+// Pairs up the nodes of two trees by walking their dependencies side by side
+// Nodes of different types end the walk, since their dependencies can't be matched
+struct state_carrier {
+  std::unordered_set<const base<string>*> visited;
+
+  void carry(const base_s& current, const base_s& previous) {
+    if (!current || !previous || !visited.insert(current.get()).second)
+      return;
+    auto& cur = *current;
+    auto& prev = *previous;
+    if (typeid(cur) != typeid(prev))
+      return;
+    current->carry_state(*previous);
+    std::vector<base_s> current_deps, previous_deps;
+    try {
+      current->iterate_dependencies([&](const base_s& dep) { current_deps.push_back(dep); });
+      previous->iterate_dependencies([&](const base_s& dep) { previous_deps.push_back(dep); });
+    } catch (const std::exception&) {
+      // Broken references have no state to carry
+      return;
+    }
+    if (current_deps.size() == previous_deps.size())
+      for (size_t i = 0; i < current_deps.size(); i++)
+        carry(current_deps[i], previous_deps[i]);
+  }
+
+  void carry_children(const wrapper& current, const wrapper& previous) {
+    for (auto& pair : current.map) {
+      auto prev = previous.map.find(pair.first);
+      if (prev == previous.map.end())
+        continue;
+      auto cur_wrp = std::dynamic_pointer_cast<wrapper>(pair.second);
+      auto prev_wrp = std::dynamic_pointer_cast<wrapper>(prev->second);
+      if (cur_wrp && prev_wrp) {
+        if (visited.insert(cur_wrp.get()).second)
+          carry_children(*cur_wrp, *prev_wrp);
+      } else
+        carry(pair.second, prev->second);
+    }
+  }
+};
+
+void carry_state(const wrapper& current, const wrapper& previous) {
+  state_carrier().carry_children(current, previous);
+}
+
+NAMESPACE_END
@@ -2,12 +2,14 @@
 #include "wrapper.hpp"
 #include "parse.hpp"
 #include "parse.hxx"
+#include "shm.hpp"
 #include "common.hpp"
 #include "token_iterator.hpp"
 
 #include <fstream>
 #include <cstdlib>
 #include <array>
+#include <algorithm>
 #include <unistd.h>
 #include <sys/socket.h>
 
@@ -20,12 +22,50 @@ nested<T>::nested(parse_context& context, parse_preprocessed& prep)
 nested<T>::nested(const nested<T>& other, clone_context& context)
     : value(checked_clone<T>(other.value, context, "nested::nested")) {}
 
+// Returns the 24-bit color of an input in the form #rrggbb, or `no_input` for other forms
+uint32_t color::pack_hex(const string& input) {
+  if (input.size() != 7 || input.front() != '#')
+    return no_input;
+  uint32_t result = 0;
+  for (size_t i = 1; i < 7; i++) {
+    auto c = input[i];
+    int digit = c >= '0' && c <= '9' ? c - '0'
+        : c >= 'a' && c <= 'f' ? c - 'a' + 10
+        : c >= 'A' && c <= 'F' ? c - 'A' + 10 : -1;
+    if (digit < 0)
+      return no_input;
+    result = result << 4 | digit;
+  }
+  return result;
+}
+
+// The processor is costly, and inputs tend to repeat, such as the colors of a gradient
+string color::operate(const string& input) const {
+  auto packed = pack_hex(input);
+  if (packed == no_input)
+    return processor.operate(input);
+  auto slot = (packed * 2654435761u) >> (32 - memo_bits);
+  {
+    node_lock lock(mutex);
+    if (memo && (*memo)[slot].input == packed)
+      return (*memo)[slot].result;
+  }
+  auto result = processor.operate(input);
+  node_lock lock(mutex);
+  if (!memo)
+    memo = std::make_unique<std::array<memo_entry, memo_size>>();
+  auto& entry = (*memo)[slot];
+  entry.input = packed;
+  entry.result = result;
+  return result;
+}
+
 color::operator string() const {
   try {
-    auto result = processor.operate(value->get());
+    auto result = operate(value->get());
     return result.empty() && fallback ? fallback->get() : result;
   } catch(const std::exception& e) {
-    return use_fallback("Color processing failed, due to: "s + e.what());
+    return use_fallback([&] { return "Color processing failed, due to: "s + e.what(); });
   }
 }
 
@@ -34,17 +74,36 @@ base_s color::clone(clone_context& context) const {
     return std::make_shared<plain<string>>(operator string());
   auto result = std::make_shared<color>(*this, context);
   result->processor = processor;
-  return result;
+  result->processor_params = processor_params;
+  return share_node(context, result->structural_key("color " + processor_params), result);
 }
 
 color::color(parse_context& context, parse_preprocessed& prep) : meta(context, prep) {
   if (prep.token_count > 2) {
-    if (prep.token_count > 3)
+    if (prep.token_count > 3) {
       processor.inter = cspace::stospace(prep.tokens[1]);
-    processor.add_modification(trim_quotes(prep.tokens[prep.token_count - 2]));
+      processor_params = prep.tokens[1];
+    }
+    auto modification = trim_quotes(prep.tokens[prep.token_count - 2]);
+    processor.add_modification(modification);
+    processor_params += " " + modification;
   }
 }
 
+// `processor_params` holds the color space, then the modification after the first space
+color::color(std::shared_ptr<base<string>> value, base_s fallback, const string& processor_params)
+    : meta(move(value), move(fallback)), processor_params(processor_params) {
+  if (processor_params.empty())
+    return;
+  auto space = processor_params.find(' ');
+  if (space == string::npos)
+    THROW_ERROR(node, "color: Invalid processor parameters: " + processor_params);
+  tstring params(processor_params);
+  if (space > 0)
+    processor.inter = cspace::stospace(params.interval(0, space));
+  processor.add_modification(params.interval(space + 1));
+}
+
 template<class To, class Processor>
 lazy_node<To, Processor>::lazy_node(parse_context& context, parse_preprocessed& prep)
     : loaded_node_impl<To, Processor>(context, prep) {
@@ -65,48 +124,135 @@ base_s lazy_node<To, Processor>::clone(clone_context& context) const {
   return result;
 }
 
-template<>
-cspace::gradient<3>& gradient::get_base() const {
-  if (!base.points.size()) {
-    auto str = base_raw->get();
-    tstring ts(str);
-    tstring point;
-    trim_quotes(ts);
-    while (!(point = get_word(ts)).untouched()) {
-      if (auto at = cut_front(point, ':'); !at.untouched()) {
-        base.add_hex(node::parse<float>(at.begin(), at.size()), point, false);
-      } else
-        THROW_ERROR(parse, "gradient: invalid point: " + point);
+void baked_gradient::load(const string& points_str) {
+  tstring ts(points_str);
+  tstring point;
+  trim_quotes(ts);
+  while (!(point = get_word(ts)).untouched()) {
+    if (auto at = cut_front(point, ':'); !at.untouched()) {
+      source.add_hex(node::parse<float>(at.begin(), at.size()), point, false);
+    } else
+      THROW_ERROR(parse, "gradient: invalid point: " + point);
+  }
+  source.convert(cspace::colorspaces::rgb, cspace::colorspaces::cielch);
+  source.auto_add(10);
+  source.convert(cspace::colorspaces::cielch, cspace::colorspaces::rgb);
+  bake();
+  points = points_str;
+}
+
+void baked_gradient::bake() {
+  table.resize(resolution + 1);
+  for (int i = 0; i <= resolution; i++)
+    table[i] = source.get_hex(float(i) / resolution);
+}
+
+string baked_gradient::get_hex(float position) const {
+  if (position >= 0 && position <= 1 && !table.empty())
+    return table[int(position * resolution + 0.5f)];
+  return source.get_hex(position);
+}
+
+void baked_gradient::get_hex(const float* positions, size_t count, string* result) const {
+  constexpr size_t chunk = 64;
+  int indices[chunk];
+  for (size_t start = 0; start < count; start += chunk) {
+    auto size = std::min(chunk, count - start);
+    // Kept free of branches, so that the compiler can vectorize it
+    for (size_t i = 0; i < size; i++) {
+      auto position = positions[start + i];
+      auto inside = position >= 0 && position <= 1;
+      indices[i] = inside ? int(position * resolution + 0.5f) : -1;
     }
-    base.convert(cspace::colorspaces::rgb, cspace::colorspaces::cielch);
-    base.auto_add(10);
-    base.convert(cspace::colorspaces::cielch, cspace::colorspaces::rgb);
+    for (size_t i = 0; i < size; i++)
+      result[start + i] = indices[i] >= 0 && !table.empty()
+          ? table[indices[i]] : source.get_hex(positions[start + i]);
+  }
+}
+
+template<>
+baked_gradient& gradient::get_base() const {
+  if (loaded.load(std::memory_order_acquire))
+    return base;
+  node_lock lock(mutex);
+  if (!loaded.load(std::memory_order_relaxed)) {
+    // Build the gradient separately, so that a failed load leaves no partial result
+    baked_gradient result;
+    result.load(base_raw->get());
+    base = std::move(result);
+    loaded.store(true, std::memory_order_release);
   }
   return base;
 }
 
+// getenv and setenv aren't safe to call concurrently
+node_mutex env_mutex;
+
+// Returns whether the variable exists, with its value in `result`
+bool read_env(const string& name, string& result) {
+  node_lock lock(env_mutex);
+  auto value = getenv(name.data());
+  if (value)
+    result = value;
+  return value;
+}
+
 env::operator string() const {
-  auto result = getenv(value->get().data());
-  return string(result ?: use_fallback("Environment variable not found: " + value->get()));
+  auto name = value->get();
+  string result;
+  if (read_env(name, result))
+    return result;
+  return use_fallback([&] { return "Environment variable not found: " + name; });
+}
+
+outcome<string> env::try_get(as_type<string>) const {
+  auto name = node::try_get(*value);
+  if (!name)
+    return name;
+  string result;
+  if (read_env(name.value, result))
+    return result;
+  return try_fallback(failure::unavailable, [&] { return "Environment variable not found: " + name.value; });
 }
 
 bool env::set(const string& newval) {
-  setenv(value->get().data(), newval.data(), true);
+  auto name = value->get();
+  node_lock lock(env_mutex);
+  setenv(name.data(), newval.data(), true);
   return true;
 }
 
 base_s env::clone(clone_context& context) const {
-  return std::make_shared<env>(*this, context);
+  auto result = std::make_shared<env>(*this, context);
+  return share_node(context, result->structural_key("env"), result);
 }
 
-file::operator string() const {
-  std::ifstream ifs(value->get().data());
+// Returns whether the file can be read, with its content in `result`
+bool read_file(const string& path, string& result) {
+  std::ifstream ifs(path.data());
   if (ifs.fail())
-    return use_fallback("Can't read file: " + value->get());
+    return false;
+  result.assign(std::istreambuf_iterator<char>{ifs}, {});
+  result.erase(result.find_last_not_of("\r\n") + 1);
+  return true;
+}
+
+file::operator string() const {
+  auto path = value->get();
+  string result;
+  if (read_file(path, result))
+    return result;
+  return use_fallback([&] { return "Can't read file: " + path; });
+}
 
-  string result(std::istreambuf_iterator<char>{ifs}, {});
-  ifs.close();
-  return result.erase(result.find_last_not_of("\r\n") + 1);
+outcome<string> file::try_get(as_type<string>) const {
+  auto path = node::try_get(*value);
+  if (!path)
+    return path;
+  string result;
+  if (read_file(path.value, result))
+    return result;
+  return try_fallback(failure::unavailable, [&] { return "Can't read file: " + path.value; });
 }
 
 bool file::set(const string& content) {
@@ -120,23 +266,43 @@ bool file::set(const string& content) {
 }
 
 base_s file::clone(clone_context& context) const {
-  return std::make_shared<file>(*this, context);
+  auto result = std::make_shared<file>(*this, context);
+  return share_node(context, result->structural_key("file"), result);
+}
+
+// Runs `command` and returns its exit code, with the output in `result`
+int run_command(const string& command, string& result) {
+  auto file = popen((command + string(" 2>/dev/null")).data(), "r");
+  if (!file)
+    return -1;
+  std::array<char, 128> buf;
+  while (fgets(buf.data(), 128, file) != nullptr)
+    result += buf.data();
+  auto exit_code = WEXITSTATUS(pclose(file));
+  result.erase(result.find_last_not_of("\r\n") + 1);
+  return exit_code;
 }
 
 cmd::operator string() const {
   string result;
+  int exit_code;
   try {
-    auto file = popen((value->get() + string(" 2>/dev/null")).data(), "r");
-    std::array<char, 128> buf;
-    while (fgets(buf.data(), 128, file) != nullptr)
-      result += buf.data();
-    if (auto exit_code = WEXITSTATUS(pclose(file)))
-      return use_fallback("Process produced exit code: " + std::to_string(exit_code));
+    exit_code = run_command(value->get(), result);
   } catch (const std::exception& e) {
-    return use_fallback("Encountered error: "s + e.what());
+    return use_fallback([&] { return "Encountered error: "s + e.what(); });
   }
-  auto last_line = result.find_last_not_of("\r\n");
-  result.erase(last_line + 1);
+  if (exit_code)
+    return use_fallback([&] { return "Process produced exit code: " + std::to_string(exit_code); });
+  return result;
+}
+
+outcome<string> cmd::try_get(as_type<string>) const {
+  auto command = node::try_get(*value);
+  if (!command)
+    return try_fallback(command.error, [&] { return "Encountered error: " + command.message; });
+  string result;
+  if (auto exit_code = run_command(command.value, result))
+    return try_fallback(failure::unavailable, [&] { return "Process produced exit code: " + std::to_string(exit_code); });
   return result;
 }
 
@@ -144,9 +310,76 @@ base_s cmd::clone(clone_context& context) const {
   return std::make_shared<cmd>(*this, context);
 }
 
+string calculator_id(const base_s& calculator) {
+  // Commands keep no state, so caches of the same command are shared even if each of them wrote it
+  if (auto command = dynamic_cast<const cmd*>(calculator.get()))
+    return command->structural_key("cmd");
+  return structural_id(calculator);
+}
+
+shm::shm(parse_context& context, parse_preprocessed& prep)
+    : meta(context, prep)
+    , segment(checked_parse_raw<string>(context, prep.tokens[1])) {}
+
+shm::shm(const shm& other, clone_context& context)
+    : meta(other, context)
+    , segment(checked_clone<string>(other.segment, context, "shm::shm")) {}
+
+shm::shm(std::shared_ptr<base<string>> key, base_s fallback, std::shared_ptr<base<string>> segment)
+    : meta(move(key), move(fallback))
+    , segment(move(segment)) {}
+
+outcome<string> shm::read(const string& segment_name, const string& key) const {
+  node_lock lock(mutex);
+  if (reader && (segment_name != open_segment || !reader->alive()))
+    reader.reset();
+  if (!reader) {
+    if (!(reader = shm_reader::open(segment_name)))
+      return failure::unavailable;
+    open_segment = segment_name;
+    slot = -1;
+  }
+  if (slot < 0 || key != open_key) {
+    slot = reader->find(key);
+    open_key = key;
+  }
+  if (slot < 0)
+    return failure::missing_key;
+  return reader->read(slot);
+}
+
+shm::operator string() const {
+  auto segment_name = segment->get();
+  auto key = value->get();
+  auto result = read(segment_name, key);
+  if (result)
+    return result.value;
+  return use_fallback([&] { return "Can't read " + key + " from shared memory segment " + segment_name; });
+}
+
+outcome<string> shm::try_get(as_type<string>) const {
+  auto segment_name = node::try_get(*segment);
+  if (!segment_name)
+    return segment_name;
+  auto key = node::try_get(*value);
+  if (!key)
+    return key;
+  auto result = read(segment_name.value, key.value);
+  if (result)
+    return result;
+  return try_fallback(result.error, [&] { return "Can't read " + key.value + " from shared memory segment " + segment_name.value; });
+}
+
+base_s shm::clone(clone_context& context) const {
+  return std::make_shared<shm>(*this, context);
+}
+
 void poll::start_cmd() const {
+  // Evaluate the command before forking, the child must not touch the node tree
+  auto command = value->get();
   int pipes[2];
-  if (socketpair(AF_UNIX, SOCK_STREAM, 0, pipes) < 0)
+  // Close-on-exec keeps other processes spawned concurrently from holding our socket open
+  if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, pipes) < 0)
     throw std::runtime_error("socketpair failed");
   switch(fork()) {
     case -1:
@@ -158,7 +391,7 @@ void poll::start_cmd() const {
       dup2(pipes[1], STDIN_FILENO);
       close(pipes[0]);
       close(pipes[1]);
-      execl("/usr/bin/bash", "bash", "-c", value->get().data(), nullptr);
+      execl("/usr/bin/bash", "bash", "-c", command.data(), nullptr);
       throw std::runtime_error("execl failed");
   }
   // Parent case
@@ -174,6 +407,7 @@ poll::~poll() {
 }
 
 poll::operator string() const {
+  node_lock lock(mutex);
   if (!pfd.fd)
     start_cmd();
   if (::poll(&pfd, 1, 0) > 0 && pfd.revents & POLLIN) {
@@ -215,6 +449,7 @@ base_s poll::clone(clone_context& context) const {
 }
 
 bool poll::set(const string& value) {
+  node_lock lock(mutex);
   if (!pfd.fd)
     start_cmd();
   if (write(pfd.fd, value.data(), value.size()) == -1) {
@@ -223,6 +458,30 @@ bool poll::set(const string& value) {
   return write(pfd.fd, "\n", 1) != -1;
 }
 
+void poll::carry_state(const base<string>& previous) {
+  auto prev = dynamic_cast<const poll*>(&previous);
+  if (!prev)
+    return;
+  // Share the running command instead of starting another one
+  node_lock prev_lock(prev->mutex);
+  node_lock lock(mutex);
+  if (prev->pfd.fd && !pfd.fd)
+    pfd.fd = dup(prev->pfd.fd);
+}
+
+int poll::change_fd() const {
+  node_lock lock(mutex);
+  return pfd.fd ? pfd.fd : -1;
+}
+
+void poll::invalidate() {
+  node_lock lock(mutex);
+  if (pfd.fd) {
+    close(pfd.fd);
+    pfd.fd = 0;
+  }
+}
+
 save::operator string() const {
   auto str = value->get();
   auto sep = str.rfind(delimiter);
@@ -294,7 +553,10 @@ base_s map::clone(clone_context& context) const {
   result->from_range = from_range;
   result->to_min = to_min;
   result->to_range = to_range;
-  return result;
+  string key = "map" + structural_id(result->value);
+  for (auto param : {from_min, from_range, to_min, to_range})
+    key.append(reinterpret_cast<const char*>(&param), sizeof(param));
+  return share_node(context, key, result);
 }
 
 std::shared_ptr<map> map::parse(parse_context& context, parse_preprocessed& prep) {
@@ -313,7 +575,67 @@ std::shared_ptr<map> map::parse(parse_context& context, parse_preprocessed& prep
 }
 
 smooth::operator float() const {
-  return current += velocity += (value->operator float() - current) * spring - velocity * drag;
+  auto target = value->operator float();
+  if (at_rest(target))
+    return target;
+  return advance(target, std::chrono::steady_clock::now());
+}
+
+bool smooth::at_rest(float target) const {
+  auto state = current.load(std::memory_order_relaxed);
+  return last_step.load(std::memory_order_relaxed) == resting && state.velocity == 0 && state.current == target;
+}
+
+int smooth::claim_steps(steady_time now) const {
+  int64_t step = now.time_since_epoch() / substep;
+  auto last = last_step.load(std::memory_order_relaxed);
+  do {
+    if (last >= step)
+      return 0;
+  } while (!last_step.compare_exchange_weak(last, step, std::memory_order_relaxed));
+  // A node starting to move takes its first step right away
+  return last == resting ? 1 : std::min<int64_t>(step - last, max_steps);
+}
+
+bool smooth::converged(const state& state, float target) {
+  auto threshold = 1e-4f * std::max(1.0f, std::abs(target));
+  return std::abs(state.velocity) <= threshold && std::abs(target - state.current) <= threshold;
+}
+
+bool smooth::store(state& prev, state& next, float target) const {
+  bool resting_now = converged(next, target);
+  if (resting_now)
+    next = state{target, 0};
+  if (!current.compare_exchange_strong(prev, next, std::memory_order_relaxed))
+    return false;
+  if (resting_now)
+    last_step.store(resting, std::memory_order_relaxed);
+  return true;
+}
+
+float smooth::advance(float target, steady_time now) const {
+  auto steps = claim_steps(now);
+  auto prev = current.load(std::memory_order_relaxed);
+  if (steps == 0)
+    return prev.current;
+  return take_steps(prev, steps, target).current;
+}
+
+smooth::state smooth::take_steps(state prev, int steps, float target) const {
+  state next;
+  do {
+    next = prev;
+    for (int i = 0; i < steps; i++)
+      step(next.current, next.velocity, target, spring, drag);
+  } while (!store(prev, next, target));
+  return next;
+}
+
+steady_time smooth::next_change() const {
+  auto last = last_step.load(std::memory_order_relaxed);
+  if (last == resting)
+    return steady_time::max();
+  return steady_time((last + 1) * substep);
 }
 
 std::shared_ptr<smooth> smooth::parse(parse_context& context, parse_preprocessed& prep) {
@@ -346,11 +668,23 @@ base_s smooth::clone(clone_context& context) const {
   return result;
 }
 
+void smooth::carry_state(const base<string>& previous) {
+  if (auto prev = dynamic_cast<const smooth*>(&previous)) {
+    current.store(prev->current.load(std::memory_order_relaxed), std::memory_order_relaxed);
+    last_step.store(prev->last_step.load(std::memory_order_relaxed), std::memory_order_relaxed);
+  }
+}
+
 clock::operator int() const {
   auto unlooped = (std::chrono::steady_clock::now() - zero_point) / tick_duration;
   return unlooped % loop;
 }
 
+steady_time clock::next_change() const {
+  auto unlooped = (std::chrono::steady_clock::now() - zero_point) / tick_duration;
+  return zero_point + (unlooped + 1) * tick_duration;
+}
+
 base_s clock::clone(clone_context&) const {
   auto result = std::make_shared<clock>();
   result->tick_duration = tick_duration;
@@ -0,0 +1,193 @@
+#include "profile.hpp"
+#include "wrapper.hpp"
+#include "common.hpp"
+
+#include <vector>
+#include <iomanip>
+#include <algorithm>
+
+NAMESPACE(node)
+
+using profile_clock = std::chrono::steady_clock;
+
+namespace {
+  // A key being evaluated by this thread
+  struct profile_frame {
+    profiler::entry* stats;
+    profiler::thread_stacks* stacks;
+    size_t stack;
+    profile_clock::time_point start;
+    // The bytes allocated by the profiler before the key started, which are left out of its parent
+    size_t start_bytes, overhead_bytes;
+    // The time and bytes spent in the profiled keys it read
+    uint64_t child_ns, child_bytes;
+  };
+  thread_local std::vector<profile_frame> profile_stack;
+  // The stacks of this thread in every profiler it has used, by the id of the profiler
+  thread_local std::vector<std::pair<uint64_t, profiler::thread_stacks*>> local_profilers;
+  std::atomic<uint64_t> next_profiler_id{0};
+}
+
+void note_fallback() {
+  if (!profile_stack.empty())
+    profile_stack.back().stats->fallbacks.fetch_add(1, std::memory_order_relaxed);
+}
+
+profiler::profiler() : id(next_profiler_id.fetch_add(1, std::memory_order_relaxed)) {}
+
+size_t profiler::thread_stacks::find(size_t parent, const entry* stats) {
+  auto it = children.find({parent, stats});
+  if (it != children.end())
+    return it->second;
+  std::lock_guard<std::mutex> lock(mutex);
+  stacks.emplace_back(parent, stats);
+  children.emplace(std::make_pair(parent, stats), stacks.size() - 1);
+  return stacks.size() - 1;
+}
+
+profiler::thread_stacks& profiler::local_stacks() {
+  for (auto& [owner_id, stacks] : local_profilers)
+    if (owner_id == id)
+      return *stacks;
+  thread_stacks* result;
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    result = &threads.emplace_back();
+  }
+  local_profilers.emplace_back(id, result);
+  return *result;
+}
+
+profiler::scope::scope(profiler& owner, entry& stats) : owner(owner) {
+  auto before = owner.allocated_bytes ? owner.allocated_bytes() : 0;
+  auto& stacks = owner.local_stacks();
+  auto parent = !profile_stack.empty() && profile_stack.back().stacks == &stacks ? profile_stack.back().stack : thread_stacks::root;
+  profile_stack.push_back({&stats, &stacks, stacks.find(parent, &stats), {}, 0, 0, 0, 0});
+  auto& frame = profile_stack.back();
+  if (owner.allocated_bytes) {
+    frame.start_bytes = owner.allocated_bytes();
+    frame.overhead_bytes = frame.start_bytes - std::min(frame.start_bytes, before);
+  }
+  frame.start = profile_clock::now();
+}
+
+profiler::scope::~scope() {
+  auto end = profile_clock::now();
+  auto& frame = profile_stack.back();
+  uint64_t inclusive = std::chrono::duration_cast<std::chrono::nanoseconds>(end - frame.start).count();
+  uint64_t bytes = owner.allocated_bytes ? owner.allocated_bytes() - frame.start_bytes : 0;
+  uint64_t exclusive = inclusive - std::min(inclusive, frame.child_ns);
+  auto& stats = *frame.stats;
+  stats.calls.fetch_add(1, std::memory_order_relaxed);
+  stats.inclusive_ns.fetch_add(inclusive, std::memory_order_relaxed);
+  stats.exclusive_ns.fetch_add(exclusive, std::memory_order_relaxed);
+  stats.allocated_bytes.fetch_add(bytes - std::min(bytes, frame.child_bytes), std::memory_order_relaxed);
+  frame.stacks->stacks[frame.stack].ns.fetch_add(exclusive, std::memory_order_relaxed);
+  auto overhead = frame.overhead_bytes;
+  profile_stack.pop_back();
+  if (!profile_stack.empty()) {
+    profile_stack.back().child_ns += inclusive;
+    profile_stack.back().child_bytes += bytes + overhead;
+  }
+}
+
+base_s profiled_clone(const base_s& source, clone_context& context) {
+  auto result = fold_constant(source, source->clone(context), context);
+  return context.profile ? context.profile->wrap(result) : result;
+}
+
+base_s profiler::wrap(const base_s& node, const string* path) {
+  if (!node || dynamic_cast<const wrapper*>(node.get()))
+    return node;
+  entry* stats;
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    stats = &entries.emplace_back();
+    if (path)
+      stats->path = *path;
+  }
+  if (auto number = std::dynamic_pointer_cast<base<float>>(node))
+    return std::make_shared<profiled<float>>(number, *this, *stats);
+  if (auto number = std::dynamic_pointer_cast<base<int>>(node))
+    return std::make_shared<profiled<int>>(number, *this, *stats);
+  return std::make_shared<profiled<string>>(node, *this, *stats);
+}
+
+void profiler::name(const base_s& wrapped, const string& path) {
+  entry* stats;
+  if (auto p = dynamic_cast<const profiled_base<string>*>(wrapped.get()))
+    stats = &p->stats;
+  else if (auto p = dynamic_cast<const profiled_base<int>*>(wrapped.get()))
+    stats = &p->stats;
+  else if (auto p = dynamic_cast<const profiled_base<float>*>(wrapped.get()))
+    stats = &p->stats;
+  else return;
+  std::lock_guard<std::mutex> lock(mutex);
+  if (stats->path.empty())
+    stats->path = path;
+}
+
+const profiler::entry* profiler::find(const string& path) const {
+  std::lock_guard<std::mutex> lock(mutex);
+  for (auto& stats : entries)
+    if (stats.path == path)
+      return &stats;
+  return nullptr;
+}
+
+void profiler::report(std::ostream& os) const {
+  std::lock_guard<std::mutex> lock(mutex);
+  std::vector<const entry*> sorted;
+  for (auto& stats : entries)
+    if (stats.calls)
+      sorted.push_back(&stats);
+  std::stable_sort(sorted.begin(), sorted.end(), [](const entry* a, const entry* b) {
+    return a->exclusive_ns > b->exclusive_ns;
+  });
+  auto ms = [](uint64_t ns) { return ns / 1e6; };
+  os << std::setw(12) << "exclusive ms" << std::setw(13) << "inclusive ms" << std::setw(10) << "calls"
+     << std::setw(12) << "bytes" << std::setw(10) << "fallbacks" << "  key\n";
+  os << std::fixed << std::setprecision(3);
+  for (auto stats : sorted)
+    os << std::setw(12) << ms(stats->exclusive_ns) << std::setw(13) << ms(stats->inclusive_ns)
+       << std::setw(10) << stats->calls << std::setw(12) << stats->allocated_bytes
+       << std::setw(10) << stats->fallbacks << "  " << stats->path << "\n";
+  os << std::defaultfloat;
+}
+
+void profiler::write_folded(std::ostream& os) const {
+  // The stacks of the threads are merged, as lists of entries from the outermost key
+  std::map<std::vector<const entry*>, uint64_t> merged;
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    for (auto& thread : threads) {
+      std::lock_guard<std::mutex> thread_lock(thread.mutex);
+      for (auto& leaf : thread.stacks) {
+        auto ns = leaf.ns.load(std::memory_order_relaxed);
+        if (!ns)
+          continue;
+        std::vector<const entry*> stack;
+        for (auto* s = &leaf;; s = &thread.stacks[s->parent]) {
+          stack.push_back(s->stats);
+          if (s->parent == thread_stacks::root)
+            break;
+        }
+        std::reverse(stack.begin(), stack.end());
+        merged[move(stack)] += ns;
+      }
+    }
+  }
+  std::lock_guard<std::mutex> lock(mutex);
+  for (auto& [stack, ns] : merged) {
+    for (size_t i = 0; i < stack.size(); i++) {
+      // Semicolons separate the frames of a stack, and spaces separate the stack from its weight
+      auto name = stack[i]->path.empty() ? string("?") : stack[i]->path;
+      std::replace(name.begin(), name.end(), ';', ':');
+      std::replace(name.begin(), name.end(), ' ', '_');
+      os << (i ? ";" : "") << name;
+    }
+    os << " " << ns << "\n";
+  }
+}
+
+NAMESPACE_END
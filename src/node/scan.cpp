@@ -0,0 +1,219 @@
+#include "scan.hpp"
+#include "base.hpp"
+#include "common.hpp"
+
+#include <cstring>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define LINKT_SCAN_X86
+#endif
+
+NAMESPACE(node)
+
+scan_set::scan_set(unsigned classes) {
+  auto add = [&](const char* chars) {
+    for (; *chars; chars++) {
+      bytes[count++] = *chars;
+      table[(unsigned char)*chars] = true;
+    }
+  };
+  if (classes & scan_quote) add("\"'");
+  if (classes & scan_curly) add("{}");
+  if (classes & scan_bracket) add("()[]");
+  if (classes & scan_dollar) add("$");
+  if (classes & scan_question) add("?");
+  if (classes & scan_backslash) add("\\");
+  if ((space = classes & scan_space))
+    for (char c : {' ', '\t', '\n', '\v', '\f', '\r'})
+      table[(unsigned char)c] = true;
+}
+
+namespace {
+  const char* scan_scalar(const char* begin, const char* end, const scan_set& set) {
+    while (begin < end && !set.contains(*begin))
+      begin++;
+    return begin;
+  }
+
+#ifdef LINKT_SCAN_X86
+  __attribute__((target("sse2")))
+  const char* scan_sse2(const char* begin, const char* end, const scan_set& set) {
+    __m128i needles[sizeof(set.bytes)];
+    for (int i = 0; i < set.count; i++)
+      needles[i] = _mm_set1_epi8(set.bytes[i]);
+    // Whitespace is ' ' or a control character from '\t' to '\r'
+    auto space = _mm_set1_epi8(' '), tab = _mm_set1_epi8('\t'), controls = _mm_set1_epi8('\r' - '\t');
+    for (; end - begin >= 16; begin += 16) {
+      auto block = _mm_loadu_si128((const __m128i*)begin);
+      auto hits = _mm_setzero_si128();
+      for (int i = 0; i < set.count; i++)
+        hits = _mm_or_si128(hits, _mm_cmpeq_epi8(block, needles[i]));
+      if (set.space) {
+        auto offset = _mm_sub_epi8(block, tab);
+        hits = _mm_or_si128(hits, _mm_cmpeq_epi8(block, space));
+        hits = _mm_or_si128(hits, _mm_cmpeq_epi8(_mm_min_epu8(offset, controls), offset));
+      }
+      if (auto mask = _mm_movemask_epi8(hits))
+        return begin + __builtin_ctz(mask);
+    }
+    return scan_scalar(begin, end, set);
+  }
+
+  __attribute__((target("avx2")))
+  const char* scan_avx2(const char* begin, const char* end, const scan_set& set) {
+    __m256i needles[sizeof(set.bytes)];
+    for (int i = 0; i < set.count; i++)
+      needles[i] = _mm256_set1_epi8(set.bytes[i]);
+    auto space = _mm256_set1_epi8(' '), tab = _mm256_set1_epi8('\t'), controls = _mm256_set1_epi8('\r' - '\t');
+    for (; end - begin >= 32; begin += 32) {
+      auto block = _mm256_loadu_si256((const __m256i*)begin);
+      auto hits = _mm256_setzero_si256();
+      for (int i = 0; i < set.count; i++)
+        hits = _mm256_or_si256(hits, _mm256_cmpeq_epi8(block, needles[i]));
+      if (set.space) {
+        auto offset = _mm256_sub_epi8(block, tab);
+        hits = _mm256_or_si256(hits, _mm256_cmpeq_epi8(block, space));
+        hits = _mm256_or_si256(hits, _mm256_cmpeq_epi8(_mm256_min_epu8(offset, controls), offset));
+      }
+      if (auto mask = (unsigned)_mm256_movemask_epi8(hits))
+        return begin + __builtin_ctz(mask);
+    }
+    return scan_sse2(begin, end, set);
+  }
+#endif
+
+  using scan_function = const char* (*)(const char*, const char*, const scan_set&);
+
+  struct scan_choice {
+    scan_function function;
+    const char* name;
+  };
+
+  // Picks the widest implementation that the processor supports, once
+  const scan_choice& choose_scan() {
+    static const scan_choice choice = [] {
+#ifdef LINKT_SCAN_X86
+      __builtin_cpu_init();
+      if (__builtin_cpu_supports("avx2"))
+        return scan_choice{scan_avx2, "avx2"};
+      if (__builtin_cpu_supports("sse2"))
+        return scan_choice{scan_sse2, "sse2"};
+#endif
+      return scan_choice{scan_scalar, "scalar"};
+    }();
+    return choice;
+  }
+}
+
+const char* scan(const char* begin, const char* end, const scan_set& set) {
+  // Short strings, like most tokens, aren't worth a block
+  if (end - begin < 16)
+    return scan_scalar(begin, end, set);
+  return choose_scan().function(begin, end, set);
+}
+
+const char* scan_implementation() {
+  return choose_scan().name;
+}
+
+bool has_operator(std::string_view value, std::string_view op) {
+  static const scan_set dollars(scan_dollar);
+  for (auto it = value.begin(); (it = scan(it, value.end(), dollars)) != value.end(); it++) {
+    if (it + 1 == value.end() || it[1] != '{')
+      continue;
+    std::string_view rest(it + 2, value.end() - it - 2);
+    auto start = rest.find_first_not_of(" \t");
+    if (start != rest.npos && rest.compare(start, op.size(), op) == 0
+        && (start + op.size() == rest.size() || strchr(" \t}", rest[start + op.size()])))
+      return true;
+  }
+  return false;
+}
+
+bool find_expression(tstring& value, std::string& raw, size_t& start, size_t& end) {
+  static const scan_set dollars(scan_dollar), curlies(scan_curly);
+  for (auto it = value.begin(); (it = scan(it, value.end(), dollars)) != value.end() && it + 1 != value.end(); it++) {
+    if (it[1] != '{')
+      continue;
+    size_t pos = it - value.begin();
+    if (pos > 0 && it[-1] == '\\') {
+      // The backslash is removed, then the scan continues after the bracket
+      value.replace(raw, pos - 1, 1, "");
+      it = value.begin() + pos;
+      continue;
+    }
+    int depth = 1;
+    for (auto close = it + 2; (close = scan(close, value.end(), curlies)) < value.end(); close++) {
+      if (*close == '{') {
+        depth++;
+      } else if (--depth == 0) {
+        start = pos;
+        end = close + 1 - value.begin();
+        return true;
+      }
+    }
+    return false;
+  }
+  return false;
+}
+
+void lex_raw(tstring& value, std::vector<std::pair<size_t, size_t>>& spots) {
+  static const scan_set stops(scan_backslash | scan_dollar | scan_curly);
+  auto src = value.begin(), end = value.end();
+  // Escapes only shorten the text, so the output is written behind `src`, over the text already read
+  // Nothing is written until the first escape, so values without escapes may be read-only
+  auto first = const_cast<char*>(src), out = first;
+  auto put = [&](char c) {
+    if (out != src)
+      *out = c;
+    out++;
+  };
+  int depth = 0;
+  size_t spot_start = 0;
+  while (true) {
+    auto stop = scan(src, end, stops);
+    if (out != src)
+      memmove(out, src, stop - src);
+    out += stop - src;
+    if ((src = stop) == end)
+      break;
+    if (*src == '\\') {
+      if (src + 1 == end) {
+        put(*src++);
+        continue;
+      }
+      switch (src[1]) {
+        case 'n': *out++ = '\n'; break;
+        case 't': *out++ = '\t'; break;
+        case '\\': *out++ = '\\'; break;
+        // The backslash is kept, an expression after it is plain text
+        case '$': put(*src++); continue;
+        default: throw parse_error("Unknown escape sequence: \\" + string{src[1]});
+      }
+      src += 2;
+    } else if (*src == '$') {
+      if (depth == 0 && src + 1 != end && src[1] == '{') {
+        if (out != first && out[-1] == '\\') {
+          // Remove the backslash in front
+          out--;
+        } else {
+          spot_start = out - first;
+          depth = 1;
+        }
+        put(*src++);
+      }
+      put(*src++);
+    } else {
+      if (depth && *src == '{') {
+        depth++;
+      } else if (depth && --depth == 0) {
+        spots.emplace_back(spot_start, out - first + 1);
+      }
+      put(*src++);
+    }
+  }
+  value.erase_back(end - out);
+}
+
+NAMESPACE_END
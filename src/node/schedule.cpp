@@ -0,0 +1,162 @@
+#include "schedule.hpp"
+#include "common.hpp"
+
+#include <algorithm>
+#include <unordered_set>
+#include <cstring>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/eventfd.h>
+#include <sys/stat.h>
+
+NAMESPACE(node)
+
+scheduler::scheduler(wrapper_s tree_, std::vector<string> paths_, std::chrono::milliseconds min_interval)
+    : tree(move(tree_)), paths(move(paths_)), min_interval(min_interval) {
+  if (!tree)
+    throw required_field_null_error("scheduler::scheduler");
+  timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+  event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (timer_fd >= 0 && event_fd >= 0)
+    open_epoll();
+  if (epoll_fd < 0 || timer_fd < 0 || event_fd < 0) {
+    auto error = errno;
+    for (int fd : {epoll_fd, timer_fd, event_fd})
+      if (fd >= 0)
+        close(fd);
+    throw std::runtime_error("scheduler: Can't create descriptors: "s + strerror(error));
+  }
+  collect();
+}
+
+scheduler::~scheduler() {
+  for (int fd : {epoll_fd, timer_fd, event_fd})
+    close(fd);
+}
+
+void scheduler::collect() {
+  nodes.clear();
+  std::unordered_set<const base<string>*> visited;
+  std::vector<base_s> pending;
+  for (auto& path : paths)
+    if (auto node = tree->get_child_ptr(path))
+      pending.push_back(node);
+  while (!pending.empty()) {
+    auto node = move(pending.back());
+    pending.pop_back();
+    if (!node || !visited.insert(node.get()).second)
+      continue;
+    node->iterate_dependencies([&](const base_s& dep) { pending.push_back(dep); });
+    nodes.push_back(move(node));
+  }
+}
+
+steady_time scheduler::next_deadline() const {
+  auto result = steady_time::max();
+  for (auto& node : nodes)
+    result = std::min(result, node->next_change());
+  return result;
+}
+
+void scheduler::open_epoll() {
+  epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  if (epoll_fd < 0)
+    return;
+  for (int fd : {timer_fd, event_fd}) {
+    epoll_event event{};
+    event.events = EPOLLIN;
+    event.data.fd = fd;
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event);
+  }
+}
+
+void scheduler::watch_descriptors() {
+  std::vector<descriptor> current;
+  for (auto& node : nodes) {
+    struct stat info;
+    auto fd = node->change_fd();
+    if (fd < 0 || fstat(fd, &info))
+      continue;
+    descriptor entry{fd, info.st_dev, info.st_ino};
+    if (std::find(current.begin(), current.end(), entry) == current.end())
+      current.push_back(entry);
+  }
+  // A descriptor that hung up stays forgotten as long as a node holds it
+  hung_up.erase(std::remove_if(hung_up.begin(), hung_up.end(), [&](const descriptor& entry) {
+    return std::find(current.begin(), current.end(), entry) == current.end();
+  }), hung_up.end());
+  current.erase(std::remove_if(current.begin(), current.end(), [&](const descriptor& entry) {
+    return std::find(hung_up.begin(), hung_up.end(), entry) != hung_up.end();
+  }), current.end());
+  if (current.size() == watched.size() && std::is_permutation(current.begin(), current.end(), watched.begin()))
+    return;
+  // A descriptor closed by its node may stay in the epoll instance under its old number, if the node shared it with a newer tree,
+  // and that number can't be removed anymore. The instance is made again instead of updated
+  close(epoll_fd);
+  open_epoll();
+  if (epoll_fd < 0)
+    throw std::runtime_error("scheduler: Can't create descriptors: "s + strerror(errno));
+  for (auto& entry : current) {
+    epoll_event event{};
+    event.events = EPOLLIN;
+    event.data.fd = entry.fd;
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, entry.fd, &event);
+  }
+  watched = move(current);
+}
+
+scheduler::wake scheduler::wait(steady_time until) {
+  watch_descriptors();
+  auto deadline = next_deadline();
+  bool timeout = until < deadline;
+  deadline = std::min(std::max(deadline, last_wake + min_interval), until);
+
+  itimerspec spec{};
+  if (deadline != steady_time::max()) {
+    auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(deadline.time_since_epoch()).count();
+    // A zero time disarms the timer, so deadlines in the past are moved to the first nanosecond
+    ns = std::max<int64_t>(ns, 1);
+    spec.it_value.tv_sec = ns / 1000000000;
+    spec.it_value.tv_nsec = ns % 1000000000;
+  }
+  timerfd_settime(timer_fd, TFD_TIMER_ABSTIME, &spec, nullptr);
+
+  wake result = wake::deadline;
+  epoll_event events[16];
+  int count;
+  do {
+    count = epoll_wait(epoll_fd, events, 16, -1);
+  } while (count < 0 && errno == EINTR);
+  uint64_t expirations;
+  bool deadline_passed = false;
+  for (int i = 0; i < count; i++) {
+    int fd = events[i].data.fd;
+    if (fd == timer_fd) {
+      deadline_passed = read(timer_fd, &expirations, sizeof(expirations)) > 0;
+    } else if (fd == event_fd) {
+      read(event_fd, &expirations, sizeof(expirations));
+      result = wake::notified;
+    } else {
+      if (result == wake::deadline)
+        result = wake::descriptor;
+      // A command that ended stays readable forever, so it is only reported once
+      if (events[i].events & (EPOLLHUP | EPOLLERR)) {
+        auto entry = std::find_if(watched.begin(), watched.end(), [&](const descriptor& w) { return w.fd == fd; });
+        if (entry != watched.end())
+          hung_up.push_back(*entry);
+      }
+    }
+  }
+  if (result == wake::deadline && deadline_passed && timeout && deadline == until)
+    result = wake::timeout;
+  last_wake = std::chrono::steady_clock::now();
+  return result;
+}
+
+void scheduler::notify() {
+  uint64_t one = 1;
+  write(event_fd, &one, sizeof(one));
+}
+
+NAMESPACE_END
@@ -0,0 +1,282 @@
+#include "shm.hpp"
+#include "common.hpp"
+
+#include <map>
+#include <atomic>
+#include <algorithm>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+NAMESPACE(node)
+
+// A segment holds a header, the null-terminated paths of its keys, then a slot for every key
+constexpr uint32_t shm_magic = 0x746b6e6c;
+constexpr uint32_t shm_version = 1;
+// Slots start on their own cache line, so that writing one doesn't slow down the readers of another
+constexpr size_t shm_align = 64;
+// Readers give up on a slot that stays half-written, as when its publisher stopped in the middle of a write
+constexpr int max_read_attempts = 100000;
+
+static_assert(std::atomic<uint32_t>::is_always_lock_free, "Shared memory needs lock-free atomics");
+
+namespace {
+  struct shm_header {
+    uint32_t magic, version;
+    uint32_t slot_count, capacity, paths_size, slot_size;
+    // Set once the segment is filled, and cleared when its publisher is gone
+    std::atomic<uint32_t> alive;
+  };
+
+  struct shm_slot {
+    // Odd while the slot is being written, zero until it is written for the first time
+    std::atomic<uint32_t> sequence;
+    std::atomic<uint32_t> length;
+    std::atomic<uint8_t> error;
+  };
+
+  size_t align_up(size_t size) {
+    return (size + shm_align - 1) / shm_align * shm_align;
+  }
+
+  size_t slots_offset(const shm_header& header) {
+    return align_up(sizeof(shm_header) + header.paths_size);
+  }
+
+  shm_slot& slot_at(const void* memory, int index) {
+    auto& header = *(const shm_header*)memory;
+    return *(shm_slot*)((char*)memory + slots_offset(header) + size_t(index) * header.slot_size);
+  }
+
+  char* slot_data(shm_slot& slot) {
+    return (char*)(&slot + 1);
+  }
+
+  void write_slot(shm_slot& slot, const string& value, failure error) {
+    auto sequence = slot.sequence.load(std::memory_order_relaxed);
+    slot.sequence.store(sequence + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    slot.length.store(value.size(), std::memory_order_relaxed);
+    slot.error.store((uint8_t)error, std::memory_order_relaxed);
+    memcpy(slot_data(slot), value.data(), value.size());
+    // Zero means the slot was never written
+    auto next = sequence + 2;
+    slot.sequence.store(next ? next : 2, std::memory_order_release);
+  }
+
+  // Marks the segment left behind by a publisher that wasn't destroyed, so that its readers open the new one
+  void abandon_segment(const string& name) {
+    auto fd = shm_open(name.data(), O_RDWR, 0);
+    if (fd < 0)
+      return;
+    struct stat st;
+    if (!fstat(fd, &st) && size_t(st.st_size) >= sizeof(shm_header)) {
+      auto memory = mmap(nullptr, sizeof(shm_header), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+      if (memory != MAP_FAILED) {
+        ((shm_header*)memory)->alive.store(0, std::memory_order_release);
+        munmap(memory, sizeof(shm_header));
+      }
+    }
+    close(fd);
+    shm_unlink(name.data());
+  }
+}
+
+shm_publisher::shm_publisher(const string& name, wrapper_s tree_, const std::vector<string>& paths, size_t capacity)
+    : segment_name(name), tree(move(tree_)) {
+  if (!tree)
+    throw required_field_null_error("shm_publisher::shm_publisher");
+  query = tree->prepare(paths);
+  values.resize(paths.size());
+  fresh.resize(paths.size());
+  errors.resize(paths.size());
+  fresh_errors.resize(paths.size());
+
+  string paths_block;
+  for (auto& path : paths)
+    paths_block.append(path).push_back('\0');
+  shm_header header{shm_magic, shm_version, uint32_t(paths.size()), uint32_t(capacity),
+      uint32_t(paths_block.size()), uint32_t(align_up(sizeof(shm_slot) + capacity)), {0}};
+  memory_size = slots_offset(header) + paths.size() * header.slot_size;
+
+  auto fd = shm_open(name.data(), O_CREAT | O_EXCL | O_RDWR, 0644);
+  if (fd < 0 && errno == EEXIST) {
+    abandon_segment(name);
+    fd = shm_open(name.data(), O_CREAT | O_EXCL | O_RDWR, 0644);
+  }
+  if (fd < 0)
+    THROW_ERROR(shm, "Can't create segment " + name + ": " + strerror(errno));
+  struct stat st;
+  if (!fstat(fd, &st))
+    inode = st.st_ino;
+  if (ftruncate(fd, memory_size) || (memory = mmap(nullptr, memory_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) == MAP_FAILED) {
+    auto error = errno;
+    close(fd);
+    shm_unlink(name.data());
+    THROW_ERROR(shm, "Can't map segment " + name + ": " + strerror(error));
+  }
+  close(fd);
+
+  auto target = new (memory) shm_header;
+  target->magic = header.magic;
+  target->version = header.version;
+  target->slot_count = header.slot_count;
+  target->capacity = header.capacity;
+  target->paths_size = header.paths_size;
+  target->slot_size = header.slot_size;
+  memcpy((char*)(target + 1), paths_block.data(), paths_block.size());
+  for (size_t i = 0; i < paths.size(); i++) {
+    auto slot = new (&slot_at(memory, i)) shm_slot;
+    slot->sequence.store(0, std::memory_order_relaxed);
+  }
+  target->alive.store(1, std::memory_order_release);
+}
+
+shm_publisher::~shm_publisher() {
+  stop();
+  ((shm_header*)memory)->alive.store(0, std::memory_order_release);
+  munmap(memory, memory_size);
+  auto fd = shm_open(segment_name.data(), O_RDONLY, 0);
+  if (fd < 0)
+    return;
+  struct stat st;
+  if (!fstat(fd, &st) && st.st_ino == inode)
+    shm_unlink(segment_name.data());
+  close(fd);
+}
+
+size_t shm_publisher::publish() {
+  std::lock_guard<std::mutex> lock(publish_mutex);
+  auto failures = wrapper::get_many(query, fresh.data(), fresh_errors.data());
+  auto capacity = ((shm_header*)memory)->capacity;
+  for (size_t i = 0; i < fresh.size(); i++) {
+    if (fresh_errors[i] == failure::none && fresh[i].size() > capacity) {
+      fresh[i].clear();
+      fresh_errors[i] = failure::invalid_value;
+      failures++;
+    }
+    // Slots that didn't change aren't written, so their readers never retry
+    if (!published || fresh[i] != values[i] || fresh_errors[i] != errors[i])
+      write_slot(slot_at(memory, i), fresh[i], fresh_errors[i]);
+  }
+  values.swap(fresh);
+  errors.swap(fresh_errors);
+  published = true;
+  return failures;
+}
+
+void shm_publisher::start(std::chrono::milliseconds period) {
+  stop();
+  stopping = false;
+  thread = std::thread([this, period] {
+    std::unique_lock<std::mutex> lock(stop_mutex);
+    while (!stopping) {
+      lock.unlock();
+      publish();
+      lock.lock();
+      stop_signal.wait_for(lock, period, [this] { return stopping; });
+    }
+  });
+}
+
+void shm_publisher::stop() {
+  {
+    std::lock_guard<std::mutex> lock(stop_mutex);
+    stopping = true;
+  }
+  stop_signal.notify_all();
+  if (thread.joinable())
+    thread.join();
+}
+
+std::shared_ptr<shm_reader> shm_reader::open(const string& name) {
+  static std::mutex mutex;
+  static std::map<string, std::weak_ptr<shm_reader>> readers;
+  std::lock_guard<std::mutex> lock(mutex);
+  auto& cached = readers[name];
+  if (auto reader = cached.lock(); reader && reader->alive())
+    return reader;
+
+  auto fd = shm_open(name.data(), O_RDONLY, 0);
+  if (fd < 0)
+    return {};
+  struct stat st;
+  void* memory = MAP_FAILED;
+  if (!fstat(fd, &st) && size_t(st.st_size) >= sizeof(shm_header))
+    memory = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (memory == MAP_FAILED)
+    return {};
+  auto reader = std::shared_ptr<shm_reader>(new shm_reader(memory, st.st_size));
+  if (!reader->alive())
+    return {};
+  cached = reader;
+  return reader;
+}
+
+shm_reader::shm_reader(const void* memory, size_t memory_size) : memory(memory), memory_size(memory_size) {
+  auto& header = *(const shm_header*)memory;
+  // Segments still being filled by their publisher are read as if it were gone
+  if (!header.alive.load(std::memory_order_acquire) || header.magic != shm_magic || header.version != shm_version
+      || header.slot_size < sizeof(shm_slot) + header.capacity
+      || slots_offset(header) + size_t(header.slot_count) * header.slot_size > memory_size)
+    return;
+  valid = true;
+  auto begin = (const char*)(&header + 1), end = begin + header.paths_size;
+  while (begin < end && paths.size() < header.slot_count) {
+    auto length = strnlen(begin, end - begin);
+    paths.emplace_back(begin, length);
+    begin += length + 1;
+  }
+}
+
+shm_reader::~shm_reader() {
+  munmap(const_cast<void*>(memory), memory_size);
+}
+
+bool shm_reader::alive() const {
+  return valid && ((const shm_header*)memory)->alive.load(std::memory_order_acquire);
+}
+
+int shm_reader::find(const string& path) const {
+  for (size_t i = 0; i < paths.size(); i++)
+    if (paths[i] == path)
+      return i;
+  return -1;
+}
+
+outcome<string> shm_reader::read(int index) const {
+  if (index < 0 || size_t(index) >= paths.size() || !alive())
+    return failure::unavailable;
+  auto& slot = slot_at(memory, index);
+  auto capacity = ((const shm_header*)memory)->capacity;
+  string result;
+  for (int attempt = 0; attempt < max_read_attempts; attempt++) {
+    auto sequence = slot.sequence.load(std::memory_order_acquire);
+    if (sequence == 0)
+      return failure::unavailable;
+    if (sequence & 1) {
+      // The publisher is writing this slot, which only takes a copy, unless it died while writing
+      if (attempt > 64) {
+        if (!alive())
+          return failure::unavailable;
+        std::this_thread::yield();
+      }
+      continue;
+    }
+    auto length = std::min(slot.length.load(std::memory_order_relaxed), capacity);
+    auto error = failure(slot.error.load(std::memory_order_relaxed));
+    result.assign(slot_data(slot), length);
+    std::atomic_thread_fence(std::memory_order_acquire);
+    if (slot.sequence.load(std::memory_order_relaxed) == sequence) {
+      if (error != failure::none)
+        return error;
+      return result;
+    }
+  }
+  return failure::unavailable;
+}
+
+NAMESPACE_END
@@ -3,15 +3,118 @@
 #include "wrapper.hpp"
 #include "reference.hpp"
 
+#include <cctype>
+#include <charconv>
+#include <cstdlib>
+
 namespace node {
 
+bool spot_format::cut(tstring& expression, spot_format& result) {
+  std::string_view text(expression.begin(), expression.size());
+  auto end = text.find_last_not_of(" \t");
+  if (end == std::string_view::npos)
+    return false;
+  auto percent = text.rfind('%', end);
+  // The format is a component of its own starting with `:%`, after the expression and its fallback
+  if (percent == std::string_view::npos || percent < 2 || text[percent - 1] != ':' || !std::isspace(text[percent - 2]))
+    return false;
+  spot_format format;
+  size_t i = percent + 1;
+  auto digits = [&](int& value, size_t max_count) {
+    size_t start = i;
+    value = 0;
+    for (; i <= end && i - start < max_count && std::isdigit(text[i]); i++)
+      value = value * 10 + (text[i] - '0');
+    return i > start;
+  };
+  if (i <= end && text[i] == '-')
+    format.left = true, i++;
+  if (i <= end && text[i] == '0')
+    format.zeros = true, i++;
+  bool has_width = digits(format.width, 4);
+  bool has_precision = false;
+  if (i <= end && text[i] == '.') {
+    i++;
+    has_precision = digits(format.precision, 2);
+    if (!has_precision)
+      return false;
+    format.precision = std::min(format.precision, max_precision);
+  }
+  if (i != end + 1 || !(has_width || has_precision || format.zeros))
+    return false;
+  // A lone `0` is the width rather than a flag
+  if (format.zeros && !has_width && !has_precision)
+    return false;
+  if (format.left)
+    format.zeros = false;
+  result = format;
+  expression.erase_back(expression.size() - percent + 1);
+  return true;
+}
+
+namespace {
+  template<class T> const base<T>*
+  as_number(const base_s& node) {
+    auto number = dynamic_cast<const base<T>*>(node.get());
+    return number && number->prints_number() ? number : nullptr;
+  }
+
+  // Pads `value` to the width of `format`, writing the result to `out` if it's padded
+  std::string_view pad(std::string_view value, const spot_format& format, string& out) {
+    if (value.size() >= size_t(format.width))
+      return value;
+    auto fill = format.width - value.size();
+    out.clear();
+    if (format.left) {
+      out.append(value);
+      out.append(fill, ' ');
+    } else if (format.zeros) {
+      size_t sign = !value.empty() && (value[0] == '-' || value[0] == '+');
+      out.append(value.substr(0, sign));
+      out.append(fill, '0');
+      out.append(value.substr(sign));
+    } else {
+      out.append(fill, ' ');
+      out.append(value);
+    }
+    return out;
+  }
+}
+
+strsub::replace_spot::replace_spot(size_t pos, base_s repl, spot_format format)
+    : replace_spot(pos, 0, move(repl), format) {}
+
+strsub::replace_spot::replace_spot(size_t start, size_t length, base_s repl, spot_format format)
+    : start(start), length(length), replacement(move(repl)), format(format) {
+  if (!(real = as_number<float>(replacement)))
+    integer = as_number<int>(replacement);
+}
+
 strsub::operator string() const {
+  node_lock lock(mutex);
   return substitute(true);
 }
 
-string strsub::substitute(bool full) const {
+outcome<string> strsub::try_get(as_type<string>) const {
+  node_lock lock(mutex);
+  outcome<string> failed{failure::none};
+  auto& result = substitute(true, &failed);
+  if (failed.error != failure::none)
+    return failed;
+  return result;
+}
+
+text_view strsub::view(string& scratch) const {
+  node_lock lock(mutex);
+  return locked_view(substitute(true), *this, scratch);
+}
+
+const string& strsub::substitute(bool full, outcome<string>* failed) const {
+  // The base is rewritten in place, which invalidates the views of it
+  changed();
   size_t base_i = 0;
   bool copied = false;
+  outcome<string> first_failure{failure::none};
   for (auto& spot : spots) {
     if (!full && !spot.replacement->is_fixed()) {
       auto old_base_i = base_i;
@@ -22,7 +125,45 @@ string strsub::substitute(bool full) const {
       }
       continue;
     }
-    auto replacement = spot.replacement->get();
+    // Numbers are written to `number`, and padded values to `padded`
+    char number[number_size];
+    string text, padded;
+    std::string_view replacement;
+    failure spot_error{failure::none};
+    string spot_message;
+    if (spot.real) {
+      if (auto value = node::try_get(*spot.real))
+        replacement = std::string_view(number, write_number(number, value.value, spot.format.precision) - number);
+      else spot_error = value.error, spot_message = move(value.message);
+    } else if (spot.integer) {
+      if (auto value = node::try_get(*spot.integer))
+        replacement = std::string_view(number, write_number(number, value.value, spot.format.precision) - number);
+      else spot_error = value.error, spot_message = move(value.message);
+    } else if (auto value = node::try_get(*spot.replacement); !value) {
+      spot_error = value.error;
+      spot_message = move(value.message);
+    } else {
+      text = move(value.value);
+      replacement = text;
+      if (spot.format.precision >= 0 && !text.empty() && !std::isspace(text[0])) {
+        auto text_end = text.data() + text.size();
+        long long integer;
+        char* end;
+        if (std::from_chars(text.data(), text_end, integer).ptr == text_end) {
+          replacement = std::string_view(number, write_number(number, integer, spot.format.precision) - number);
+        } else if (auto value = std::strtof(text.c_str(), &end); end == text_end) {
+          replacement = std::string_view(number, write_number(number, value, spot.format.precision) - number);
+        }
+      }
+    }
+    if (spot_error != failure::none) {
+      // The spot keeps its previous text, so that the base stays consistent with the spots
+      if (first_failure.error == failure::none)
+        first_failure = outcome<string>(spot_error, move(spot_message));
+      text.assign(base, spot.start, spot.length);
+      replacement = text;
+    } else if (spot.format.width)
+      replacement = pad(replacement, spot.format, padded);
     if (copied) {
       tmp.append(base, base_i, spot.start - base_i);
     } else if (replacement.size() != spot.length) {
@@ -42,39 +183,61 @@ string strsub::substitute(bool full) const {
     tmp.append(base, base_i, string::npos);
     base.swap(tmp);
   }
+  if (first_failure.error != failure::none) {
+    if (!failed)
+      throw node_error(first_failure.message);
+    *failed = move(first_failure);
+  }
   return base;
 }
 
 base_s strsub::clone(clone_context& context) const {
   auto result = std::make_unique<strsub>();
+  node_lock lock(mutex);
 
   if (context.optimize) {
     substitute(false);
+    // Rebuild the base string, because nested interpolations are flattened into this one
+    size_t base_i = 0;
     for (auto& spot : spots) {
       if (!spot.replacement->is_fixed()) {
         auto replacement = checked_clone<string>(spot.replacement, context, "strsub::clone");
         while (auto repref = std::dynamic_pointer_cast<ref_base<string>>(replacement))
           replacement = repref->get_source();
-        if (auto repsub = std::dynamic_pointer_cast<strsub>(replacement)) {
+        result->base.append(base, base_i, spot.start - base_i);
+        base_i = spot.start + spot.length;
+        // A nested interpolation with a format of its own is kept whole, so that the format applies to all of it
+        auto repsub = spot.format.empty() ? std::dynamic_pointer_cast<strsub>(replacement) : nullptr;
+        if (repsub) {
+          // The base of the nested interpolation holds its fixed parts, which may not have been substituted here yet
+          auto offset = result->base.size();
           for (auto& repspot : repsub->spots)
-            result->spots.emplace_back(repspot.start + spot.start, repspot.length, repspot.replacement);
+            result->spots.emplace_back(repspot.start + offset, repspot.length, repspot.replacement, repspot.format);
+          result->base.append(repsub->base);
         } else {
-          result->spots.emplace_back(spot.start, spot.length, replacement);
+          result->spots.emplace_back(result->base.size(), spot.length, replacement, spot.format);
+          result->base.append(base, spot.start, spot.length);
         }
       }
     }
     if (result->spots.empty())
       return std::make_shared<plain<string>>(string(base));
+    result->base.append(base, base_i, string::npos);
   } else {
     for(auto& spot : spots)
-      result->spots.emplace_back(spot.start, spot.length, checked_clone<string>(spot.replacement, context, "strsub::clone"));
+      result->spots.emplace_back(spot.start, spot.length, checked_clone<string>(spot.replacement, context, "strsub::clone"), spot.format);
+    result->base = base;
   }
 
-  result->base = base;
   result->spots.reserve(spots.size());
   return result;
 }
 
+void strsub::iterate_dependencies(std::function<void(const base_s&)> processor) const {
+  for (auto& spot : spots)
+    processor(spot.replacement);
+}
+
 bool strsub::is_fixed() const {
   for(auto& spot : spots)
     if (!spot.replacement->is_fixed())
@@ -2,12 +2,69 @@
 #include "parse.hpp"
 #include "common.hpp"
 #include "wrapper.hpp"
-#include "token_iterator.hpp"
+#include "scan.hpp"
+
+#include <utility>
 
 namespace node {
 
-int parse_word_matcher(int c) {
-  return c == '?' ? 2 : std::isspace(c) ? 0 : 1;
+void ancestor_map::push(const const_wrapper_s& source, const wrapper_s& clone) {
+  auto& place = index[source.get()];
+  // References push the same ancestors over and over, there's nothing to undo in that case
+  if (place != clone)
+    log.push_back({source, std::exchange(place, clone)});
+}
+
+wrapper_s ancestor_map::find(const wrapper* source) const {
+  auto it = index.find(source);
+  return it == index.end() ? wrapper_s() : it->second;
+}
+
+void ancestor_map::restore(size_t mark) {
+  while (log.size() > mark) {
+    auto& last = log.back();
+    if (last.previous)
+      index[last.source.get()] = move(last.previous);
+    else
+      index.erase(last.source.get());
+    log.pop_back();
+  }
+}
+
+// Split `value` into words separated by spaces, where a word starting with '?' is the fallback
+// Quoted and bracketed parts belong to the word around them, and may nest in each other
+template<size_t N> unsigned char
+split_words(tstring& value, std::array<tstring, N>& tokens) {
+  static const scan_set stops(scan_space | scan_quote | scan_curly | scan_bracket | scan_question);
+  unsigned char count = 0;
+  auto it = value.begin(), end = value.end();
+  // The quotes and brackets that are open
+  string nesting;
+  while (count < N) {
+    while (it < end && std::isspace((unsigned char)*it))
+      it++;
+    if (it == end)
+      break;
+    auto word = it;
+    nesting.clear();
+    for (; (it = scan(it, end, stops)) != end; it++) {
+      char c = *it;
+      if (c == '"' || c == '\'') {
+        if (!nesting.empty() && nesting.back() == c)
+          nesting.pop_back();
+        else nesting.push_back(c);
+      } else if (c == '{' || c == '(' || c == '[') {
+        nesting.push_back(c);
+      } else if (c == '}' || c == ')' || c == ']') {
+        if (!nesting.empty())
+          nesting.pop_back();
+      } else if (nesting.empty() && (c != '?' || it != word)) {
+        break;
+      }
+    }
+    tokens[count++] = value.interval(word - value.begin(), it - value.begin());
+  }
+  return count;
 }
 
 wrapper_s parse_context::get_current() {
@@ -40,7 +97,7 @@ base_s& parse_context::get_place() {
 }
 
 tstring parse_preprocessed::process(tstring& value) {
-  token_count = fill_tokens<parse_word_matcher>(value, tokens);
+  token_count = split_words(value, tokens);
   // Extract the fallback before anything else
   for (int i = token_count; i--> 0;) {
     if (!tokens[i].empty() && tokens[i].front() == '?') {
@@ -1,4 +1,7 @@
 #include "wrapper.hpp"
+#include "deferred.hpp"
+#include "profile.hpp"
+#include "reference.hpp"
 #include "parse.hpp"
 #include "common.hpp"
 #include "tstring.hpp"
@@ -6,9 +9,17 @@
 
 #include <sstream>
 #include <iostream>
+#include <unordered_map>
 
 NAMESPACE(node)
 
+// Returns the node stored at the empty key, which holds the value of the wrapper
+// Unlike `map[""]`, this doesn't insert the key, so it is safe to call while other threads are reading
+base_s wrapper::get_value() const {
+  auto it = map.find("");
+  return it != map.end() ? it->second : base_s();
+}
+
 // Returns the pointer to the node at the specified path
 // This will return the inner node of a wrapper.
 base_s wrapper::get_child_ptr(tstring path) const {
@@ -17,7 +28,7 @@ base_s wrapper::get_child_ptr(tstring path) const {
       return child->get_child_ptr(path);
   } else if (auto iterator = map.find(path); iterator != map.end()) {
     if (auto child = std::dynamic_pointer_cast<wrapper>(iterator->second))
-      return child->map[""];
+      return child->get_value();
     return iterator->second;
   }
   return {};
@@ -45,13 +56,92 @@ string wrapper::get_child(const tstring& path) const {
 }
 
 string wrapper::get_child(const tstring& path, string&& fallback) const {
-  try {
-    auto result = get_child_safe(path);
-    return result ? *result : move(fallback);
-  } catch (const std::exception& e) {
-    LG_DBUG("Error: " << e.what());
-    return fallback;
+  auto result = try_get_child(path);
+  return result ? move(result.value) : move(fallback);
+}
+
+outcome<string> wrapper::try_get_child(const tstring& path) const {
+  auto ptr = get_child_ptr(path);
+  return ptr ? node::try_get(*ptr) : failure::missing_key;
+}
+
+text_view wrapper::view_child(const tstring& path, string& scratch) const {
+  auto ptr = get_child_ptr(path);
+  return ptr ? ptr->view(scratch) : throw std::logic_error("Child does not exist: " + path);
+}
+
+prepared_query wrapper::prepare(const std::vector<string>& paths) const {
+  prepared_query query;
+  // The sections found so far, by their path
+  std::unordered_map<string, wrapper_s> sections;
+  std::function<const wrapper*(const string&)> find_section = [&](const string& path) -> const wrapper* {
+    if (path.empty())
+      return this;
+    if (auto it = sections.find(path); it != sections.end())
+      return it->second.get();
+    auto dot = path.rfind('.');
+    auto parent = find_section(dot == string::npos ? "" : path.substr(0, dot));
+    auto section = parent ? parent->get_wrapper(dot == string::npos ? path : path.substr(dot + 1)) : wrapper_s();
+    return (sections[path] = section).get();
+  };
+  // The entry of every node found so far
+  std::unordered_map<const base<string>*, size_t> entries;
+  for (auto& raw_path : paths) {
+    auto index = query.key_count++;
+    tstring ts(raw_path);
+    string path(trim(ts));
+    auto dot = path.rfind('.');
+    base_s node;
+    if (auto section = find_section(dot == string::npos ? "" : path.substr(0, dot))) {
+      auto it = section->map.find(dot == string::npos ? path : path.substr(dot + 1));
+      if (it != section->map.end()) {
+        auto wrp = std::dynamic_pointer_cast<wrapper>(it->second);
+        node = wrp ? wrp->get_value() : it->second;
+      }
+    }
+    if (!node) {
+      query.missing.push_back(index);
+      continue;
+    }
+    // An optimized reference to a string reads its source as it is
+    while (auto reference = dynamic_cast<const ref<string>*>(node.get())) {
+      auto source = reference->get_source();
+      if (!source)
+        break;
+      node = move(source);
+    }
+    auto [it, inserted] = entries.emplace(node.get(), query.entries.size());
+    if (inserted)
+      query.entries.push_back({move(node), {}});
+    query.entries[it->second].keys.push_back(index);
   }
+  return query;
+}
+
+size_t wrapper::get_many(const prepared_query& query, string* out, failure* errors) {
+  size_t failed = query.missing.size();
+  for (auto i : query.missing) {
+    out[i].clear();
+    if (errors)
+      errors[i] = failure::missing_key;
+  }
+  for (auto& entry : query.entries) {
+    auto result = node::try_get(*entry.node);
+    auto& first = out[entry.keys.front()];
+    if (result) {
+      first = move(result.value);
+    } else {
+      first.clear();
+      failed += entry.keys.size();
+    }
+    for (auto key : entry.keys) {
+      if (key != entry.keys.front())
+        out[key] = first;
+      if (errors)
+        errors[key] = result.error;
+    }
+  }
+  return failed;
 }
 
 wrapper_s wrapper::get_wrapper(const string& path) const {
@@ -90,6 +180,8 @@ base_s& wrapper::add(tstring path, parse_context& context, tstring& value) {
   context.parent = shared_from_this();
   context.current.reset();
   context.place = get_child_place(path);
+  if (context.deferred_errors && deferred::can_defer(value))
+    return context.get_place() = std::make_shared<deferred>(context, trim(path), value, &parse_raw<string>);
   if (auto node = parse_raw<string>(context, value))
     return context.get_place() = node;
   return *context.place;
@@ -121,14 +213,33 @@ wrapper::operator string() const {
   return value ? value->get() : "";
 }
 
+text_view wrapper::view(string& scratch) const {
+  const auto& value = get_child_ptr(""_ts);
+  return value ? value->view(scratch) : text_view();
+}
+
 void wrapper::merge(const const_wrapper_s& src, clone_context& context) {
-  auto ancestors_mark = context.ancestors.size();
-  context.ancestors.emplace_back(src, shared_from_this());
+  auto ancestors_mark = context.ancestors.mark();
+  // Shared and fixed nodes are identified by addresses, which are only meaningful inside a single clone
+  if (ancestors_mark == 0) {
+    context.shared_nodes.clear();
+    context.fixed_nodes.clear();
+  }
+  context.ancestors.push(src, shared_from_this());
   for(auto& pair : src->map) {
     if (!pair.second || (!pair.first.empty() && pair.first.front() == '.'))
       continue;
+    if (typeid(*pair.second) == typeid(deferred)) {
+      // Parsing a deferred value may turn its place into a wrapper
+      // Values that fail are left empty like in an eager parse, their errors have been reported to the parse
+      try {
+        std::static_pointer_cast<deferred>(pair.second)->get_parsed();
+      } catch (const node_error&) {}
+      if (!pair.second)
+        continue;
+    }
     auto last_path = context.current_path;
-    context.current_path += context.ancestors.size() == 1 ? pair.first : ("." + pair.first);
+    context.current_path += ancestors_mark == 0 ? pair.first : ("." + pair.first);
     try {
       auto& place = map[pair.first];
       if (auto src_wrp = std::dynamic_pointer_cast<wrapper>(pair.second)) {
@@ -140,14 +251,24 @@ void wrapper::merge(const const_wrapper_s& src, clone_context& context) {
         else if (!(wrp = std::dynamic_pointer_cast<wrapper>(place)))
           wrp = wrap(place);
         wrp->merge(src_wrp, context);
-      } else if (!place)
+      } else if (!place) {
         place = checked_clone<string>(pair.second, context, "wrapper::merge");
+        if (context.profile)
+          place = context.profile->wrap(place, pair.first.empty() ? &last_path : &context.current_path);
+      } else if (context.profile) {
+        // Cloned earlier by a reference to it
+        context.profile->name(place, pair.first.empty() ? last_path : context.current_path);
+      }
     } catch (const std::exception& e) {
       context.report_error("Exception while cloning " + context.current_path + ": " + e.what());
     }
     context.current_path = last_path;
   }
-  context.ancestors.erase(context.ancestors.begin() + ancestors_mark, context.ancestors.end());
+  context.ancestors.restore(ancestors_mark);
+  if (ancestors_mark == 0) {
+    context.shared_nodes.clear();
+    context.fixed_nodes.clear();
+  }
 }
 
 void wrapper::optimize(clone_context& context) {
@@ -167,4 +288,9 @@ bool wrapper::is_fixed() const {
   auto it = map.find("");
   return it != map.end() && it->second ? it->second->is_fixed() : true;
 }
+
+void wrapper::iterate_dependencies(std::function<void(const base_s&)> processor) const {
+  if (auto value = get_value())
+    processor(value);
+}
 NAMESPACE_END
@@ -1,16 +1,27 @@
 #include "node/parse.hpp"
 #include "node/parse.hxx"
+#include "node/evaluate.hpp"
+#include "node/handle.hpp"
+#include "node/deferred.hpp"
+#include "node/scan.hpp"
+#include "parse.hpp"
 #include "common.hpp"
 #include "tstring.hpp"
 #include <vector>
+#include <sstream>
+#include <iterator>
+#include <algorithm>
+#include <unordered_set>
+#include <string_view>
 
 constexpr const char comment_chars[] = ";#";
 
-void parse_ini(std::istream& is, node::errorlist& err, node::wrapper_s& root) {
+void parse_ini(std::istream& is, node::errorlist& err, node::wrapper_s& root, node::error_hook value_errors) {
   string prefix;
   string raw;
   node::parse_context context;
   context.parent = context.root = root;
+  context.deferred_errors = move(value_errors);
   // Iterate through lines
   for (int linecount = 1; std::getline(is, context.raw); linecount++, raw.clear()) {
     tstring line(context.raw);
@@ -42,11 +53,53 @@ struct indentpair {
       : indent(indent), node(node), path(path) {}
 };
 
-void parse_yml(std::istream& is, node::errorlist& err, node::wrapper_s& root) {
+// Add `key` to `context.parent`, and make it the current place of `context`
+void add_yml_key(node::parse_context& context, const tstring& key, const tstring& modes) {
+  context.parent->add(key);
+  context.place = context.parent->get_child_place(key);
+  context.current.reset();
+
+  if (find(modes, 'H') != tstring::npos) {
+    context.get_current()->map[".hidden"] = std::make_shared<node::plain<string>>("true");
+  }
+}
+
+// Returns the parser of values with the modes in front of them
+node::deferred::parser yml_parser(const tstring& modes) {
+  if (find(modes, '$') == tstring::npos)
+    return &node::parse_raw<string>;
+  if (find(modes, 'i') != tstring::npos)
+    return [](node::parse_context& context, tstring& value) -> node::base_s {
+      return node::parse_escaped<int>(context, value);
+    };
+  if (find(modes, 'f') != tstring::npos)
+    return [](node::parse_context& context, tstring& value) -> node::base_s {
+      return node::parse_escaped<float>(context, value);
+    };
+  return &node::parse_escaped<string>;
+}
+
+// Parse the value of the current key of `context`, according to the modes in front of it
+void parse_yml_value(node::parse_context& context, const tstring& key, const tstring& modes, tstring& line) {
+  node::base_s value;
+  if (context.deferred_errors && node::deferred::can_defer(line))
+    value = std::make_shared<node::deferred>(context, key, line, yml_parser(modes));
+  else
+    value = yml_parser(modes)(context, line);
+  if (!value)
+    return;
+  // If the key already has children, they stay the children of the key rather than of its value
+  if (!context.current && context.place)
+    context.current = std::dynamic_pointer_cast<node::wrapper>(*context.place);
+  context.get_place() = value;
+}
+
+void parse_yml(std::istream& is, node::errorlist& err, node::wrapper_s& root, node::error_hook value_errors) {
   vector<indentpair> records{indentpair(-1, root, "")};
   string raw;
   node::parse_context context;
   context.root = root;
+  context.deferred_errors = move(value_errors);
 
   // Iterate the lines
   for (int linecount = 1; std::getline(is, context.raw); linecount++, raw.clear()) {
@@ -82,35 +135,397 @@ void parse_yml(std::istream& is, node::errorlist& err, node::wrapper_s& root) {
       // Assign a new value to an existing node
       if (find(modes, '=') != tstring::npos) {
         auto child = context.parent->get_child_ptr(key);
+        if (auto lazy = std::dynamic_pointer_cast<node::deferred>(child))
+          child = lazy->get_parsed();
         if (auto plain = std::dynamic_pointer_cast<node::plain<string>>(child))
           plain->value = line;
         else err.report_error(linecount, key, !child ? "Key to be set doesn't exist." :
             "Can't set value");
         continue;
       }
-      context.parent->add(key);
-      context.place = context.parent->get_child_place(key);
-      context.current.reset();
+      add_yml_key(context, key, modes);
+      records.emplace_back(indent, nullptr, context.current_path);
+      parse_yml_value(context, key, modes, line);
 
-      if (find(modes, 'H') != tstring::npos) {
-        context.get_current()->map[".hidden"] = std::make_shared<node::plain<string>>("true");
+    } catch (const std::exception& e) {
+      err.report_error(linecount, key, e.what());
+    }
+  }
+}
+
+// A key found by scanning a text, without parsing its value
+struct scanned_key {
+  int linecount;
+  string path, parent_path, source;
+  // Assignments in yml change the value of another key, and are recorded under a path of their own
+  bool assignment;
+};
+
+vector<scanned_key> scan_ini(const vector<string>& lines, node::errorlist& err) {
+  vector<scanned_key> result;
+  string prefix;
+  for (size_t i = 0; i < lines.size(); i++) {
+    tstring line(lines[i]);
+    if (trim(line).empty() || strchr(comment_chars, line.front()))
+      continue;
+    if (cut_front_back(line, "["_ts, "]"_ts)) {
+      prefix = line + ".";
+      continue;
+    } if (tstring key; err.extract_key(line, i + 1, '=', key))
+      result.push_back({int(i + 1), prefix + trim(key), "", trim(line), false});
+  }
+  return result;
+}
+
+vector<scanned_key> scan_yml(const vector<string>& lines, node::errorlist& err) {
+  vector<scanned_key> result;
+  vector<std::pair<int, string>> parents{{-1, ""}};
+  for (size_t i = 0; i < lines.size(); i++) {
+    tstring line(lines[i]);
+    int indent = ltrim(line);
+    if (line.empty() || strchr(comment_chars, line.front()))
+      continue;
+    while (parents.back().first >= indent)
+      parents.pop_back();
+    tstring key;
+    if (!err.extract_key(line, i + 1, ':', key))
+      continue;
+    trim(key);
+    trim(line);
+    auto& parent = parents.back().second;
+    auto path = parent.empty() ? (string)key : parent + "." + key;
+    auto value = line;
+    auto modes = cut_front(value, ' ');
+    if (!line.empty() && find(modes, '=') != tstring::npos) {
+      result.push_back({int(i + 1), path + "=", parent, line, true});
+      continue;
+    }
+    result.push_back({int(i + 1), path, parent, line, false});
+    parents.emplace_back(indent, move(path));
+  }
+  return result;
+}
+
+// Erase the children of `wrp` that aren't keys of the text, they were added while parsing its value
+// Returns whether any child was erased
+bool erase_implicit_children(node::wrapper& wrp, const string& path, const std::unordered_set<std::string_view>& paths) {
+  auto erased = false;
+  for (auto it = wrp.map.begin(); it != wrp.map.end();) {
+    if (!it->first.empty() && !std::dynamic_pointer_cast<node::wrapper>(it->second)
+        && !paths.count(path + "." + it->first)) {
+      it = wrp.map.erase(it);
+      erased = true;
+    } else
+      it++;
+  }
+  return erased;
+}
+
+// Empty the place of the key at `path`, so that it can be parsed again
+// Returns whether keys added by the previous parse of its value were erased
+bool clear_key(node::wrapper& root, const string& path, const std::unordered_set<std::string_view>& paths) {
+  auto place = root.get_child_place(path);
+  if (!place || !*place)
+    return false;
+  if (auto wrp = std::dynamic_pointer_cast<node::wrapper>(*place)) {
+    wrp->map.erase("");
+    return erase_implicit_children(*wrp, path, paths);
+  }
+  place->reset();
+  return false;
+}
+
+// Erase the key at `path`, keeping its children that are still keys of the text
+void remove_key(node::wrapper& root, const string& path, const std::unordered_set<std::string_view>& paths) {
+  node::wrapper_s parent = root.shared_from_this();
+  auto name = path;
+  if (auto dot = path.rfind('.'); dot != string::npos) {
+    auto place = root.get_child_place(path.substr(0, dot));
+    if (!place || !(parent = std::dynamic_pointer_cast<node::wrapper>(*place)))
+      return;
+    name = path.substr(dot + 1);
+  }
+  auto it = parent->map.find(name);
+  if (it == parent->map.end())
+    return;
+  if (auto wrp = std::dynamic_pointer_cast<node::wrapper>(it->second)) {
+    wrp->map.erase("");
+    erase_implicit_children(*wrp, path, paths);
+    if (!wrp->map.empty())
+      return;
+  }
+  parent->map.erase(it);
+}
+
+void patch_ini_key(node::parse_context& context, node::errorlist& err, node::wrapper_s& root,
+    const scanned_key& key) {
+  tstring line(context.raw);
+  tstring name;
+  trim(line);
+  err.extract_key(line, key.linecount, '=', name);
+  context.current_path = key.path;
+  try {
+    root->add(context.current_path, context, line);
+  } catch (const std::exception& e) {
+    err.report_error(key.linecount, e.what());
+  }
+}
+
+void patch_yml_key(node::parse_context& context, node::errorlist& err, node::wrapper_s& root,
+    const scanned_key& key) {
+  tstring line(context.raw);
+  tstring name;
+  ltrim(line);
+  err.extract_key(line, key.linecount, ':', name);
+  context.current_path = key.path;
+  try {
+    // Like in `parse_yml`, the parent is wrapped if it isn't a wrapper yet
+    context.parent = root;
+    if (!key.parent_path.empty()) {
+      auto place = root->get_child_place(key.parent_path);
+      if (!place || !*place)
+        throw node::parse_error("Parent key not found: " + key.parent_path);
+      if (!(context.parent = std::dynamic_pointer_cast<node::wrapper>(*place)))
+        context.parent = node::wrapper::wrap(*place);
+    }
+    if (line.empty()) {
+      context.parent->add(name, std::make_shared<node::plain<string>>(""));
+      return;
+    }
+    auto modes = cut_front(line, ' ');
+    add_yml_key(context, name, modes);
+    parse_yml_value(context, name, modes, line);
+  } catch (const std::exception& e) {
+    err.report_error(key.linecount, name, e.what());
+  }
+}
+
+// Forget the node of the key at `path`, and the keys that it reads
+void unindex_key(parse_record& record, const string& path) {
+  if (auto it = record.nodes.find(path); it != record.nodes.end()) {
+    if (auto key = record.keys.find(it->second.get()); key != record.keys.end() && key->second == path)
+      record.keys.erase(key);
+    record.nodes.erase(it);
+  }
+  if (auto it = record.reads.find(path); it != record.reads.end()) {
+    for (auto& read : it->second) {
+      auto readers = record.readers.find(read);
+      if (readers != record.readers.end() && readers->second.erase(path) && readers->second.empty())
+        record.readers.erase(readers);
+    }
+    record.reads.erase(it);
+  }
+  record.unresolved.erase(path);
+}
+
+void register_key(parse_record& record, node::wrapper& root, const string& path) {
+  if (auto node = root.get_child_ptr(path)) {
+    record.keys.emplace(node.get(), path);
+    record.nodes[path] = move(node);
+  }
+}
+
+// Record the keys read by the key at `path`, walking its nodes up to the nodes of other keys
+void index_reads(parse_record& record, const string& path) {
+  auto it = record.nodes.find(path);
+  if (it == record.nodes.end())
+    return;
+  vector<string> reads;
+  std::unordered_set<const node::base<string>*> visited;
+  vector<node::base_s> pending{it->second};
+  while (!pending.empty()) {
+    auto node = move(pending.back());
+    pending.pop_back();
+    if (!node || !visited.insert(node.get()).second)
+      continue;
+    if (node != it->second) {
+      if (auto key = record.keys.find(node.get()); key != record.keys.end()) {
+        if (record.readers[key->second].insert(path).second)
+          reads.push_back(key->second);
+        continue;
       }
+    }
+    try {
+      if (node::is_broken_reference(*node))
+        record.unresolved.insert(path);
+      node->iterate_dependencies([&](const node::base_s& dep) { pending.push_back(dep); });
+    } catch (const std::exception&) {
+      record.unresolved.insert(path);
+    }
+  }
+  if (!reads.empty())
+    record.reads[path] = move(reads);
+}
 
-      records.emplace_back(indent, nullptr, context.current_path);
-      node::base_s value;
-      if (find(modes, '$') == tstring::npos)
-        value = node::parse_raw<string>(context, line);
-      else if (find(modes, 'i') != tstring::npos)
-        value = node::parse_escaped<int>(context, line);
-      else if (find(modes, 'f') != tstring::npos)
-        value = node::parse_escaped<float>(context, line);
+void index_all(parse_record& record, node::wrapper& root) {
+  record.nodes.clear();
+  record.keys.clear();
+  record.reads.clear();
+  record.readers.clear();
+  record.unresolved.clear();
+  for (auto& pair : record.sources)
+    register_key(record, root, pair.first);
+  for (auto& pair : record.sources)
+    index_reads(record, pair.first);
+}
+
+// Returns the keys that read the keys at `paths`, directly or through other keys
+// Keys whose references found no key are included if `keys_moved`, a key added or removed may be the one they look for
+std::unordered_set<string> find_readers(const parse_record& record, const vector<const string*>& paths, bool keys_moved) {
+  std::unordered_set<string> result;
+  vector<const string*> pending;
+  auto add_readers = [&](const string& path) {
+    if (auto it = record.readers.find(path); it != record.readers.end())
+      for (auto& reader : it->second)
+        if (result.insert(reader).second)
+          pending.push_back(&reader);
+  };
+  for (auto path : paths)
+    add_readers(*path);
+  if (keys_moved)
+    for (auto& path : record.unresolved)
+      if (result.insert(path).second)
+        pending.push_back(&path);
+  while (!pending.empty()) {
+    auto path = pending.back();
+    pending.pop_back();
+    add_readers(*path);
+  }
+  return result;
+}
+
+size_t reparse(std::istream& is, node::errorlist& err, node::wrapper_s& root, parse_record& record, bool yml) {
+  string text(std::istreambuf_iterator<char>{is}, {});
+  vector<string> lines;
+  {
+    std::istringstream ss(text);
+    for (string line; std::getline(ss, line);)
+      lines.push_back(move(line));
+  }
+  node::errorlist scan_err;
+  auto keys = yml ? scan_yml(lines, scan_err) : scan_ini(lines, scan_err);
+
+  // Compare the keys with the record
+  auto full = record.sources.empty();
+  std::unordered_set<std::string_view> paths;
+  paths.reserve(keys.size());
+  vector<const scanned_key*> changed;
+  for (auto& key : keys) {
+    // Duplicate keys are reported by a full parse
+    if (!paths.insert(key.path).second)
+      full = true;
+    if (key.assignment || node::has_operator(key.source, "clone"))
+      full = true;
+    if (auto old = record.sources.find(key.path); old == record.sources.end() || old->second != key.source)
+      changed.push_back(&key);
+  }
+  vector<const string*> removed;
+  for (auto& pair : record.sources)
+    if (!paths.count(pair.first))
+      removed.push_back(&pair.first);
+  if (changed.empty() && removed.empty()) {
+    err.insert(err.end(), scan_err.begin(), scan_err.end());
+    return 0;
+  }
+
+  if (full) {
+    // Parse into a new tree, which takes over the state of the old one
+    auto result = root->map.empty() ? root : std::make_shared<node::wrapper>();
+    std::istringstream ss(text);
+    if (yml)
+      parse_yml(ss, err, result);
+    else
+      parse_ini(ss, err, result);
+    if (result != root) {
+      node::carry_state(*result, *root);
+      root = result;
+    }
+  } else {
+    auto keys_moved = !removed.empty();
+    vector<const string*> moved(removed);
+    for (auto key : changed) {
+      moved.push_back(&key->path);
+      if (!record.nodes.count(key->path))
+        keys_moved = true;
+    }
+    auto stale = find_readers(record, moved, keys_moved);
+
+    // Erase the children of removed keys before their parents
+    std::sort(removed.begin(), removed.end(), [](auto a, auto b) { return a->size() > b->size(); });
+    for (auto path : removed) {
+      remove_key(*root, *path, paths);
+      unindex_key(record, *path);
+      stale.erase(*path);
+    }
+
+    node::parse_context context;
+    context.parent = context.root = root;
+    std::unordered_set<const node::base<string>*> changed_nodes;
+    auto erased_implicit = false;
+    for (auto key : changed) {
+      if (clear_key(*root, key->path, paths))
+        erased_implicit = true;
+      context.raw = lines[key->linecount - 1];
+      context.place = nullptr;
+      context.current.reset();
+      if (yml)
+        patch_yml_key(context, err, root, *key);
       else
-        value = node::parse_escaped<string>(context, line);
-      if (value)
-        context.get_place() = value;
+        patch_ini_key(context, err, root, *key);
+      unindex_key(record, key->path);
+      register_key(record, *root, key->path);
+      if (auto it = record.nodes.find(key->path); it != record.nodes.end())
+        changed_nodes.insert(it->second.get());
+      stale.erase(key->path);
+    }
+    err.insert(err.end(), scan_err.begin(), scan_err.end());
 
-    } catch (const std::exception& e) {
-      err.report_error(linecount, key, e.what());
+    if (erased_implicit) {
+      // The keys added by the values of changed keys aren't in the record, so their readers are found by a full walk
+      node::invalidate_dependents(root, changed_nodes, true);
+    } else {
+      vector<node::base_s> roots;
+      for (auto& path : stale)
+        if (auto it = record.nodes.find(path); it != record.nodes.end())
+          roots.push_back(it->second);
+      node::invalidate_dependents(roots, changed_nodes, !removed.empty(), [&](const node::base<string>* node) {
+        auto key = record.keys.find(node);
+        return key != record.keys.end() && !stale.count(key->second) && !changed_nodes.count(node);
+      });
+    }
+    for (auto key : changed)
+      index_reads(record, key->path);
+    for (auto& path : stale) {
+      unindex_key(record, path);
+      register_key(record, *root, path);
+      index_reads(record, path);
     }
   }
+
+  auto count = changed.size() + removed.size();
+  if (full) {
+    record.sources.clear();
+    for (auto& key : keys)
+      record.sources.emplace(key.path, key.source);
+  } else {
+    for (auto path : removed)
+      record.sources.erase(string(*path));
+    for (auto key : changed)
+      record.sources[key->path] = key->source;
+  }
+  // Keys that failed to parse are left out of the record, so that they are parsed again next time
+  for (auto key : changed)
+    if (!key->assignment && !root->get_child_ptr(key->path))
+      record.sources.erase(key->path);
+  if (full)
+    index_all(record, *root);
+  return count;
+}
+
+size_t reparse_ini(std::istream& is, node::errorlist& err, node::wrapper_s& root, parse_record& record) {
+  return reparse(is, err, root, record, false);
+}
+
+size_t reparse_yml(std::istream& is, node::errorlist& err, node::wrapper_s& root, parse_record& record) {
+  return reparse(is, err, root, record, true);
 }
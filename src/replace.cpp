@@ -1,4 +1,5 @@
 #include "node/parse.hpp"
+#include "node/scan.hpp"
 #include "replace.hpp"
 #include "tstring.hpp"
 
@@ -15,7 +16,7 @@ void replace_text(std::istream& is, std::ostream& os, node::wrapper_s& replaceme
     size_t start, end;
 
     // Find escaped expressions in the line
-    while(find_enclosed(ts, raw, "${", "{", "}", start, end)) {
+    while(node::find_expression(ts, raw, start, end)) {
       auto expression = ts.interval(start+2, end-1);
 
       // Recognize bash-style substring expressions: `${expr:position:length}` or `${expr:position}`
@@ -0,0 +1,595 @@
+#include "snapshot.hpp"
+#include "node/node.hpp"
+#include "node/reference.hpp"
+#include "node/cache.hpp"
+#include "node/strsub.hpp"
+#include "node/shm.hpp"
+#include "node/deferred.hpp"
+#include "node/profile.hpp"
+#include "common.hpp"
+
+#include <cstring>
+#include <cerrno>
+#include <typeinfo>
+#include <unordered_map>
+#include <unordered_set>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+// Layout of a snapshot:
+//   header: magic, version, string count, wrapper count, node count, root id
+//   strings: length and bytes of every interned key, value and path
+//   wrapper ids: wrappers are created empty before the other nodes, so that references can point to them
+//   nodes: a kind and its fields for every other node, with its dependencies before it
+//   wrapper contents: the keys and node ids of every wrapper, in the order of the wrapper ids
+// Nodes are identified by their position among the wrappers and nodes, starting from 1. Id 0 stands for null
+
+constexpr char snapshot_magic[8] = {'L', 'N', 'K', 'T', 'S', 'N', 'A', 'P'};
+constexpr uint32_t snapshot_version = 2;
+
+// Node types that hold a value of some type take three consecutive kinds: for string, int and float
+enum snapshot_kind : uint8_t {
+  kind_plain = 0,
+  kind_var = 3,
+  kind_address_ref = 6,
+  kind_ref = 9,
+  kind_adapter = 12,
+  kind_fallback = 15,
+  kind_cache = 18,
+  kind_refcache = 21,
+  kind_arrcache = 24,
+  kind_upref = 27,
+  kind_strsub,
+  kind_color,
+  kind_gradient,
+  kind_baked_gradient,
+  kind_env,
+  kind_cmd,
+  kind_file,
+  kind_poll,
+  kind_save,
+  kind_map,
+  kind_smooth,
+  kind_clock,
+  kind_shm,
+};
+
+template<class T> constexpr uint8_t type_offset =
+    std::is_same<T, string>::value ? 0 : std::is_same<T, int>::value ? 1 : 2;
+
+// Returns `node` as a `T`, only if it is of that exact type
+template<class T> const T* exactly(const node::base<string>& node) {
+  return typeid(node) == typeid(T) ? dynamic_cast<const T*>(&node) : nullptr;
+}
+
+template<class T> node::base_s checked_lock(const std::weak_ptr<T>& source) {
+  auto result = source.lock();
+  return result ?: THROW_ERROR(snapshot, "Referenced node destroyed");
+}
+
+// Returns the source of a profiled node, profilers aren't saved
+node::base_s profiled_source(const node::base<string>& node) {
+  if (auto n = dynamic_cast<const node::profiled_base<string>*>(&node))
+    return n->source;
+  if (auto n = dynamic_cast<const node::profiled_base<int>*>(&node))
+    return n->source;
+  if (auto n = dynamic_cast<const node::profiled_base<float>*>(&node))
+    return n->source;
+  return nullptr;
+}
+
+struct snapshot_writer {
+  std::unordered_map<string, uint32_t> string_ids;
+  vector<const string*> strings;
+  std::unordered_map<const node::base<string>*, uint32_t> node_ids;
+  std::unordered_set<const node::base<string>*> in_progress;
+  vector<node::wrapper_s> wrappers;
+  vector<uint32_t> wrapper_ids;
+  uint32_t next_id{1};
+  // Finished node records, and the record being written
+  string nodes, record;
+
+  template<class T> void put_value(T value) {
+    record.append(reinterpret_cast<const char*>(&value), sizeof(value));
+  }
+  void put_string(const string& str) {
+    auto [it, inserted] = string_ids.try_emplace(str, strings.size());
+    if (inserted)
+      strings.push_back(&it->first);
+    put_value<uint32_t>(it->second);
+  }
+  void put_plain(const string& value) { put_string(value); }
+  void put_plain(int value) { put_value<int32_t>(value); }
+  void put_plain(float value) { put_value<float>(value); }
+  void put_node(const node::base_s& node) { put_value<uint32_t>(add(node)); }
+  void put_meta(snapshot_kind kind, const node::meta& meta) {
+    put_value<uint8_t>(kind);
+    put_node(meta.value);
+    put_node(meta.fallback);
+  }
+
+  uint32_t add(const node::base_s& node);
+  void save(const node::base<string>& node);
+  template<class T> bool save_typed(const node::base<string>& node);
+  void write(std::ostream& os, const node::wrapper_s& root);
+};
+
+// Returns the id of `node`, writing its record first if it doesn't have one
+uint32_t snapshot_writer::add(const node::base_s& node) {
+  if (!node)
+    return 0;
+  if (auto it = node_ids.find(node.get()); it != node_ids.end())
+    return it->second;
+  // Nodes that forward to another are saved as that node. Deferred values may be replaced by their parse, so they get no id
+  if (auto lazy = std::dynamic_pointer_cast<node::deferred>(node))
+    return add(lazy->get_parsed());
+  if (auto source = profiled_source(*node))
+    return add(source);
+  if (auto wrp = std::dynamic_pointer_cast<node::wrapper>(node)) {
+    // The contents of wrappers are written after all other nodes
+    node_ids.emplace(wrp.get(), next_id);
+    wrappers.push_back(wrp);
+    wrapper_ids.push_back(next_id);
+    return next_id++;
+  }
+  if (!in_progress.insert(node.get()).second)
+    THROW_ERROR(snapshot, "Cyclic dependency between nodes");
+  // The records of the dependencies are finished while this one is being written
+  auto parent_record = move(record);
+  record.clear();
+  save(*node);
+  nodes += record;
+  record = move(parent_record);
+  in_progress.erase(node.get());
+  node_ids.emplace(node.get(), next_id);
+  return next_id++;
+}
+
+template<class T> bool snapshot_writer::save_typed(const node::base<string>& node) {
+  constexpr uint8_t offset = type_offset<T>;
+  if constexpr(!std::is_same<T, string>::value) {
+    if (auto n = exactly<node::adapter<T>>(node)) {
+      put_value<uint8_t>(kind_adapter + offset);
+      put_node(checked_lock(n->source_w));
+      return true;
+    }
+  }
+  if (auto n = exactly<node::settable_plain<T>>(node)) {
+    put_value<uint8_t>(kind_var + offset);
+    put_plain(n->operator T());
+  } else if (auto n = exactly<node::plain<T>>(node)) {
+    put_value<uint8_t>(kind_plain + offset);
+    put_plain(n->value);
+  } else if (auto n = exactly<node::address_ref<T>>(node)) {
+    auto ancestor = n->ancestor_w.lock();
+    if (!ancestor)
+      THROW_ERROR(snapshot, "Ancestor of reference destroyed: " + n->get_path());
+    put_value<uint8_t>(kind_address_ref + offset);
+    put_node(ancestor);
+    put_string(n->get_path());
+  } else if (auto n = exactly<node::ref<T>>(node)) {
+    put_value<uint8_t>(kind_ref + offset);
+    put_node(checked_lock(n->source_w));
+  } else if (auto n = exactly<node::fallback_wrapper<T>>(node)) {
+    // The dependencies are the source, then the fallback
+    put_value<uint8_t>(kind_fallback + offset);
+    n->iterate_dependencies([&](const node::base_s& dep) { put_node(dep); });
+  } else if (auto n = exactly<node::cache<T>>(node)) {
+    put_value<uint8_t>(kind_cache + offset);
+    put_node(n->calculator);
+    put_node(n->duration_ms);
+  } else if (auto n = exactly<node::refcache<T>>(node)) {
+    put_value<uint8_t>(kind_refcache + offset);
+    put_node(n->source);
+    put_node(n->calculator);
+    put_value<int32_t>(n->duration_ms);
+  } else if (auto n = exactly<node::arrcache<T>>(node)) {
+    uint32_t size;
+    {
+      node::node_lock lock(n->mutex);
+      size = n->cache_arr.size();
+    }
+    put_value<uint8_t>(kind_arrcache + offset);
+    put_value<uint32_t>(size);
+    put_node(n->source);
+    put_node(n->calculator);
+  } else
+    return false;
+  return true;
+}
+
+void snapshot_writer::save(const node::base<string>& node) {
+  if (save_typed<string>(node) || save_typed<int>(node) || save_typed<float>(node))
+    return;
+  if (auto n = exactly<node::upref>(node)) {
+    put_value<uint8_t>(kind_upref);
+    put_node(checked_lock(n->source_w));
+  } else if (auto n = exactly<node::strsub>(node)) {
+    node::node_lock lock(n->mutex);
+    put_value<uint8_t>(kind_strsub);
+    put_string(n->base);
+    put_value<uint32_t>(n->spots.size());
+    for (auto& spot : n->spots) {
+      put_value<uint32_t>(spot.start);
+      put_value<uint32_t>(spot.length);
+      put_value<int32_t>(spot.format.width);
+      put_value<int32_t>(spot.format.precision);
+      put_value<uint8_t>(spot.format.left | spot.format.zeros << 1);
+      put_node(spot.replacement);
+    }
+  } else if (auto n = exactly<node::color>(node)) {
+    put_meta(kind_color, *n);
+    put_string(n->processor_params);
+  } else if (auto n = exactly<node::gradient>(node)) {
+    put_value<uint8_t>(kind_gradient);
+    put_node(n->value);
+    put_node(n->base_raw);
+  } else if (auto n = exactly<node::loaded_node_impl<string, node::baked_gradient>>(node)) {
+    put_value<uint8_t>(kind_baked_gradient);
+    put_node(n->value);
+    put_string(n->get_base().points);
+  } else if (auto n = exactly<node::env>(node)) {
+    put_meta(kind_env, *n);
+  } else if (auto n = exactly<node::cmd>(node)) {
+    put_meta(kind_cmd, *n);
+  } else if (auto n = exactly<node::file>(node)) {
+    put_meta(kind_file, *n);
+  } else if (auto n = exactly<node::poll>(node)) {
+    put_meta(kind_poll, *n);
+  } else if (auto n = exactly<node::shm>(node)) {
+    put_meta(kind_shm, *n);
+    put_node(n->segment);
+  } else if (auto n = exactly<node::save>(node)) {
+    put_value<uint8_t>(kind_save);
+    put_node(n->value);
+    put_node(n->target);
+    put_value<char>(n->delimiter);
+  } else if (auto n = exactly<node::map>(node)) {
+    put_value<uint8_t>(kind_map);
+    put_node(n->value);
+    put_value<float>(n->from_min);
+    put_value<float>(n->from_range);
+    put_value<float>(n->to_min);
+    put_value<float>(n->to_range);
+  } else if (auto n = exactly<node::smooth>(node)) {
+    put_value<uint8_t>(kind_smooth);
+    put_node(n->value);
+    put_value<float>(n->spring);
+    put_value<float>(n->drag);
+  } else if (auto n = exactly<node::clock>(node)) {
+    put_value<uint8_t>(kind_clock);
+    put_value<int64_t>(n->tick_duration.count());
+    put_value<uint32_t>(n->loop);
+    put_value<int64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(n->zero_point.time_since_epoch()).count());
+  } else
+    THROW_ERROR(snapshot, "Unsupported node type: "s + typeid(node).name());
+}
+
+void snapshot_writer::write(std::ostream& os, const node::wrapper_s& root) {
+  auto root_id = add(root);
+  // Writing the contents of a wrapper may add more nodes and wrappers
+  string contents;
+  for (size_t i = 0; i < wrappers.size(); i++) {
+    record.clear();
+    put_value<uint32_t>(wrappers[i]->map.size());
+    for (auto& pair : wrappers[i]->map) {
+      if (pair.second && typeid(*pair.second) == typeid(node::deferred)) {
+        // Parsing a deferred value may turn its place into a wrapper. Values that fail are left empty
+        try {
+          std::static_pointer_cast<node::deferred>(pair.second)->get_parsed();
+        } catch (const node::node_error&) {}
+      }
+      put_string(pair.first);
+      put_node(pair.second);
+    }
+    contents += record;
+  }
+
+  record.clear();
+  record.append(snapshot_magic, sizeof(snapshot_magic));
+  put_value<uint32_t>(snapshot_version);
+  put_value<uint32_t>(strings.size());
+  put_value<uint32_t>(wrappers.size());
+  put_value<uint32_t>(next_id - 1 - wrappers.size());
+  put_value<uint32_t>(root_id);
+  for (auto str : strings) {
+    put_value<uint32_t>(str->size());
+    record += *str;
+  }
+  for (auto id : wrapper_ids)
+    put_value<uint32_t>(id);
+  os.write(record.data(), record.size());
+  os.write(nodes.data(), nodes.size());
+  os.write(contents.data(), contents.size());
+}
+
+void write_snapshot(std::ostream& os, const node::wrapper_s& root) {
+  snapshot_writer().write(os, root);
+}
+
+struct snapshot_reader {
+  const char *pos, *end;
+  vector<std::string_view> strings;
+  vector<node::base_s> nodes;
+
+  template<class T> T get_value() {
+    if (size_t(end - pos) < sizeof(T))
+      THROW_ERROR(snapshot, "Unexpected end of data");
+    T result;
+    memcpy(&result, pos, sizeof(T));
+    pos += sizeof(T);
+    return result;
+  }
+  string get_string() {
+    auto id = get_value<uint32_t>();
+    return id < strings.size() ? string(strings[id]) : THROW_ERROR(snapshot, "Invalid string id");
+  }
+  template<class T> T get_plain() {
+    if constexpr(std::is_same<T, string>::value)
+      return get_string();
+    else if constexpr(std::is_same<T, int>::value)
+      return get_value<int32_t>();
+    else
+      return get_value<float>();
+  }
+  // Reads a node id, and returns that node. It must come before the current node in the data
+  template<class T = string> std::shared_ptr<node::base<T>> get_optional() {
+    auto id = get_value<uint32_t>();
+    if (id == 0)
+      return {};
+    if (id >= nodes.size() || !nodes[id])
+      THROW_ERROR(snapshot, "Invalid node id: " + std::to_string(id));
+    auto result = std::dynamic_pointer_cast<node::base<T>>(nodes[id]);
+    return result ?: THROW_ERROR(snapshot, "Node of unexpected type: " + std::to_string(id));
+  }
+  template<class T = string> std::shared_ptr<node::base<T>> get_node() {
+    auto result = get_optional<T>();
+    return result ?: THROW_ERROR(snapshot, "Required node is null");
+  }
+  node::wrapper_s get_wrapper() {
+    auto result = std::dynamic_pointer_cast<node::wrapper>(get_node());
+    return result ?: THROW_ERROR(snapshot, "Expected a wrapper");
+  }
+  template<class T> std::shared_ptr<T> get_meta() {
+    auto value = get_node();
+    auto fallback = get_optional();
+    return std::make_shared<T>(value, fallback);
+  }
+
+  node::base_s load_node();
+  template<class T> node::base_s load_typed(uint8_t kind);
+  node::wrapper_s read(size_t size);
+};
+
+template<class T> node::base_s snapshot_reader::load_typed(uint8_t kind) {
+  switch (kind) {
+    case kind_plain:
+      return std::make_shared<node::plain<T>>(get_plain<T>());
+    case kind_var:
+      return std::make_shared<node::settable_plain<T>>(get_plain<T>());
+    case kind_address_ref: {
+      auto ancestor = get_wrapper();
+      auto path = get_string();
+      return std::make_shared<node::address_ref<T>>(ancestor, path);
+    }
+    case kind_ref:
+      return std::make_shared<node::ref<T>>(get_node<T>());
+    case kind_adapter:
+      if constexpr(!std::is_same<T, string>::value)
+        return std::make_shared<node::adapter<T>>(get_node());
+      break;
+    case kind_fallback: {
+      auto source = get_node<T>();
+      auto fallback = get_node<T>();
+      return std::make_shared<node::fallback_wrapper<T>>(source, fallback);
+    }
+    case kind_cache: {
+      auto result = std::make_shared<node::cache<T>>();
+      result->calculator = get_node<T>();
+      result->duration_ms = get_node<int>();
+      return result;
+    }
+    case kind_refcache: {
+      auto result = std::make_shared<node::refcache<T>>();
+      result->source = get_node();
+      result->calculator = get_node<T>();
+      result->duration_ms = get_value<int32_t>();
+      result->unset = true;
+      return result;
+    }
+    case kind_arrcache: {
+      auto result = std::make_shared<node::arrcache<T>>();
+      auto size = get_value<uint32_t>();
+      result->cache_arr.reserve(size + 1);
+      result->cache_arr.resize(size);
+      result->source = get_node<int>();
+      result->calculator = get_node<T>();
+      return result;
+    }
+  }
+  THROW_ERROR(snapshot, "Unknown node kind: " + std::to_string(kind + type_offset<T>));
+}
+
+node::base_s snapshot_reader::load_node() {
+  auto kind = get_value<uint8_t>();
+  if (kind < kind_upref) {
+    switch (kind % 3) {
+      case 0: return load_typed<string>(kind);
+      case 1: return load_typed<int>(kind - 1);
+      default: return load_typed<float>(kind - 2);
+    }
+  }
+  switch (kind) {
+    case kind_upref:
+      return std::make_shared<node::upref>(get_node());
+    case kind_strsub: {
+      auto result = std::make_shared<node::strsub>();
+      result->base = get_string();
+      auto count = get_value<uint32_t>();
+      result->spots.reserve(count);
+      for (uint32_t i = 0; i < count; i++) {
+        auto start = get_value<uint32_t>();
+        auto length = get_value<uint32_t>();
+        if (size_t(start) + length > result->base.size())
+          THROW_ERROR(snapshot, "Replacement spot out of range");
+        node::spot_format format;
+        format.width = get_value<int32_t>();
+        format.precision = get_value<int32_t>();
+        auto flags = get_value<uint8_t>();
+        format.left = flags & 1;
+        format.zeros = flags & 2;
+        if (format.width < 0 || format.precision > node::max_precision)
+          THROW_ERROR(snapshot, "Invalid spot format");
+        result->spots.emplace_back(start, length, get_node(), format);
+      }
+      result->tmp.reserve(result->base.size());
+      return result;
+    }
+    case kind_color: {
+      auto value = get_node();
+      auto fallback = get_optional();
+      auto params = get_string();
+      return std::make_shared<node::color>(value, fallback, params);
+    }
+    case kind_gradient: {
+      auto result = std::make_shared<node::gradient>();
+      result->value = get_node<float>();
+      result->base_raw = get_node();
+      return result;
+    }
+    case kind_baked_gradient: {
+      auto result = std::make_shared<node::loaded_node_impl<string, node::baked_gradient>>();
+      result->value = get_node<float>();
+      result->base.load(get_string());
+      return result;
+    }
+    case kind_env: return get_meta<node::env>();
+    case kind_cmd: return get_meta<node::cmd>();
+    case kind_file: return get_meta<node::file>();
+    case kind_poll: return get_meta<node::poll>();
+    case kind_shm: {
+      auto key = get_node();
+      auto fallback = get_optional();
+      return std::make_shared<node::shm>(key, fallback, get_node());
+    }
+    case kind_save: {
+      auto result = std::make_shared<node::save>();
+      result->value = get_node();
+      result->target = get_node();
+      result->delimiter = get_value<char>();
+      return result;
+    }
+    case kind_map: {
+      auto result = std::make_shared<node::map>();
+      result->value = get_node<float>();
+      result->from_min = get_value<float>();
+      result->from_range = get_value<float>();
+      result->to_min = get_value<float>();
+      result->to_range = get_value<float>();
+      return result;
+    }
+    case kind_smooth: {
+      auto result = std::make_shared<node::smooth>();
+      result->value = get_node<float>();
+      result->spring = get_value<float>();
+      result->drag = get_value<float>();
+      return result;
+    }
+    case kind_clock: {
+      auto result = std::make_shared<node::clock>();
+      result->tick_duration = std::chrono::milliseconds(get_value<int64_t>());
+      result->loop = get_value<uint32_t>();
+      result->zero_point = node::steady_time(std::chrono::duration_cast<node::steady_time::duration>(
+          std::chrono::nanoseconds(get_value<int64_t>())));
+      if (result->tick_duration.count() <= 0 || result->loop == 0)
+        THROW_ERROR(snapshot, "Invalid clock parameters");
+      return result;
+    }
+  }
+  THROW_ERROR(snapshot, "Unknown node kind: " + std::to_string(kind));
+}
+
+node::wrapper_s snapshot_reader::read(size_t size) {
+  if (size < sizeof(snapshot_magic) || memcmp(pos, snapshot_magic, sizeof(snapshot_magic)))
+    THROW_ERROR(snapshot, "Not a snapshot");
+  pos += sizeof(snapshot_magic);
+  if (get_value<uint32_t>() != snapshot_version)
+    THROW_ERROR(snapshot, "Unsupported snapshot version");
+  auto string_count = get_value<uint32_t>();
+  auto wrapper_count = get_value<uint32_t>();
+  auto node_count = get_value<uint32_t>();
+  auto root_id = get_value<uint32_t>();
+
+  // Every string takes at least its length, which keeps a corrupted count from reserving too much
+  if (string_count > size_t(end - pos) / sizeof(uint32_t))
+    THROW_ERROR(snapshot, "Invalid string count");
+  strings.reserve(string_count);
+  for (uint32_t i = 0; i < string_count; i++) {
+    auto length = get_value<uint32_t>();
+    if (length > size_t(end - pos))
+      THROW_ERROR(snapshot, "Unexpected end of data");
+    strings.emplace_back(pos, length);
+    pos += length;
+  }
+
+  if (size_t(wrapper_count) + node_count > size_t(end - pos))
+    THROW_ERROR(snapshot, "Invalid node count");
+  nodes.resize(size_t(wrapper_count) + node_count + 1);
+  vector<node::wrapper_s> wrappers;
+  wrappers.reserve(wrapper_count);
+  for (uint32_t i = 0; i < wrapper_count; i++) {
+    auto id = get_value<uint32_t>();
+    if (id == 0 || id >= nodes.size() || nodes[id])
+      THROW_ERROR(snapshot, "Invalid wrapper id: " + std::to_string(id));
+    nodes[id] = wrappers.emplace_back(std::make_shared<node::wrapper>());
+  }
+  // The other nodes fill the remaining ids in order
+  for (size_t id = 1; id < nodes.size(); id++)
+    if (!nodes[id])
+      nodes[id] = load_node();
+
+  for (auto& wrp : wrappers) {
+    auto count = get_value<uint32_t>();
+    for (uint32_t i = 0; i < count; i++) {
+      auto key = get_string();
+      // The keys were written in order, so each one goes to the end of the map
+      wrp->map.emplace_hint(wrp->map.end(), move(key), get_optional());
+    }
+  }
+  if (pos != end)
+    THROW_ERROR(snapshot, "Unexpected data after the end of the snapshot");
+  if (root_id >= nodes.size())
+    THROW_ERROR(snapshot, "Invalid root id");
+  auto root = std::dynamic_pointer_cast<node::wrapper>(nodes[root_id]);
+  return root ?: THROW_ERROR(snapshot, "The root isn't a wrapper");
+}
+
+node::wrapper_s read_snapshot(const char* data, size_t size) {
+  snapshot_reader reader{data, data + size};
+  return reader.read(size);
+}
+
+node::wrapper_s load_snapshot(const string& path) {
+  auto fd = open(path.data(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    THROW_ERROR(snapshot, "Can't open file: " + path + ": " + strerror(errno));
+  struct stat st;
+  if (fstat(fd, &st) < 0 || st.st_size == 0) {
+    close(fd);
+    THROW_ERROR(snapshot, "Can't read file: " + path);
+  }
+  auto data = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED)
+    THROW_ERROR(snapshot, "Can't map file: " + path + ": " + strerror(errno));
+  try {
+    auto result = read_snapshot(static_cast<const char*>(data), st.st_size);
+    munmap(data, st.st_size);
+    return result;
+  } catch (...) {
+    munmap(data, st.st_size);
+    throw;
+  }
+}
@@ -0,0 +1,72 @@
+#include "tree_files.hpp"
+#include "parse.hpp"
+#include "snapshot.hpp"
+#include <fstream>
+#include <cstring>
+#include <strings.h>
+
+using namespace std;
+
+// Checks if `str` ends with `suffix` (case-insensitive)
+bool ends_with(const char *str, const char *suffix) {
+  if (!str || !suffix)
+    return false;
+  size_t lenstr = strlen(str);
+  size_t lensuffix = strlen(suffix);
+  if (lensuffix >  lenstr)
+    return false;
+  return !strncasecmp(str + lenstr - lensuffix, suffix, lensuffix);
+}
+
+// Load the snapshot at `path` and merge its tree to `tree`. Returns true if an error occourred
+bool merge_snapshot(const char* path, node::wrapper_s& tree) {
+  try {
+    auto loaded = load_snapshot(path);
+    if (tree->map.empty()) {
+      // Optimized trees can't be cloned, so take the first one as it is
+      tree = loaded;
+      return false;
+    }
+    node::clone_context context;
+    tree->merge(loaded, context);
+    for (auto& e : context.errors)
+      cerr << "At " << e.first << ": " << e.second << endl;
+    return !context.errors.empty();
+  } catch (const std::exception& e) {
+    cerr << "Can't load snapshot: " << path << endl << e.what() << endl;
+    return true;
+  }
+}
+
+// Parse the file at `path` and merge its tree to `tree`. Returns true if an error occourred
+bool merge_file(const char* path, node::wrapper_s& tree) {
+  if (ends_with(path, ".bin"))
+    return merge_snapshot(path, tree);
+
+  // Try to open the file
+  std::ifstream ifs(path);
+  if (ifs.fail()) {
+    cerr << "Can't open file: " << path << endl;
+    return true;
+  }
+
+  // Parse the file according to its extension
+  node::errorlist err;
+  if (ends_with(path, ".yml") || ends_with(path, ".yaml"))
+    parse_yml(ifs, err, tree);
+  else if (ends_with(path, ".ini"))
+    parse_ini(ifs, err, tree);
+  else {
+    cerr << "Unsupported file type: " << path << endl;
+    return true;
+  }
+
+  // Print out the errors
+  if (!err.empty()) {
+    cerr << "Parse errors of file:" << path << endl;
+    for(auto& e : err)
+      cerr << "At " << e.first << ": " << e.second << endl;
+    return true;
+  }
+  return false;
+}
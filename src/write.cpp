@@ -1,25 +1,108 @@
 #include "write.hpp"
 #include "common.hpp"
 #include <cstring>
+#include <cerrno>
 #include <vector>
+#include <stdexcept>
+#include <sys/uio.h>
 
-// Escape the value and write it and the prefix to the stream
-void write_key(std::ostream& os, const string& prefix, string&& value) {
-  size_t opening = 0;
+output_buffer::output_buffer(std::ostream& os, size_t capacity) : capacity(capacity), os(&os) {
+  buffer.reserve(capacity);
+}
+
+output_buffer::output_buffer(int fd, size_t capacity) : capacity(capacity), fd(fd) {
+  buffer.reserve(capacity);
+}
+
+output_buffer::~output_buffer() {
+  try {
+    write_out(nullptr, 0);
+  } catch (const std::exception&) {}
+}
+
+// Write out the buffer, followed by `extra`
+void output_buffer::write_out(const char* extra, size_t extra_size) {
+  if (os) {
+    os->write(buffer.data(), buffer.size());
+    os->write(extra, extra_size);
+  } else {
+    iovec parts[2] = {{buffer.data(), buffer.size()}, {const_cast<char*>(extra), extra_size}};
+    iovec* current = parts;
+    int count = 2;
+    while (count > 0) {
+      auto written = writev(fd, current, count);
+      if (written < 0) {
+        if (errno == EINTR) continue;
+        buffer.clear();
+        throw std::runtime_error("output_buffer: write failed: "s + strerror(errno));
+      }
+      // Skip the parts that have been written completely, and the written section of the next one
+      for (; count > 0 && size_t(written) >= current->iov_len; current++, count--)
+        written -= current->iov_len;
+      if (count > 0) {
+        current->iov_base = static_cast<char*>(current->iov_base) + written;
+        current->iov_len -= written;
+      }
+    }
+  }
+  buffer.clear();
+}
+
+void output_buffer::append(const char* data, size_t size) {
+  if (buffer.size() + size <= capacity) {
+    buffer.append(data, size);
+  } else if (size >= capacity / 4) {
+    write_out(data, size);
+  } else {
+    write_out(nullptr, 0);
+    buffer.append(data, size);
+  }
+}
+
+void output_buffer::append(char c) {
+  if (buffer.size() >= capacity)
+    write_out(nullptr, 0);
+  buffer.push_back(c);
+}
+
+void output_buffer::append_spaces(size_t count) {
+  static const string spaces(128, ' ');
+  for (; count > spaces.size(); count -= spaces.size())
+    append(spaces);
+  append(spaces.data(), count);
+}
+
+void output_buffer::flush() {
+  write_out(nullptr, 0);
+  if (os)
+    os->flush();
+}
+
+// Write the key, followed by the value, in which every `${` is escaped
+void write_key(output_buffer& out, const string& name, const char* separator, const string& value) {
+  out.append(name);
+  out.append(separator, strlen(separator));
+  if (value.empty()) {
+    out.append('\n');
+    return;
+  }
+  bool quoted = isspace(value.front()) || isspace(value.back());
+  out.append(quoted ? " \"" : " ", quoted ? 2 : 1);
+  size_t start = 0, opening = 0;
   while((opening = value.find("${", opening)) != string::npos) {
-    value.insert(value.begin() + opening, '\\');
+    out.append(value.data() + start, opening - start);
+    out.append('\\');
+    start = opening;
     opening += 2;
   }
-  if (value.empty())
-    os << prefix << endl;
-  else if (isspace(value.front()) || isspace(value.back()))
-    os << prefix << " \"" << value << '"' << endl;
-  else
-    os << prefix << ' ' << value << endl;
+  out.append(value.data() + start, value.size() - start);
+  if (quoted)
+    out.append('"');
+  out.append('\n');
 }
 
-void write_ini(std::ostream& os, const node::wrapper_s& root, const string& prefix) {
-  vector<std::pair<string, const node::wrapper_s>> wrappers;
+void write_ini(output_buffer& out, const node::wrapper_s& root, const string& prefix) {
+  vector<std::pair<const string*, node::wrapper_s>> wrappers;
   root->iterate_children([&](const string& name, const node::base_s& child) {
     if (!child) return;
     // The empty key is used as the value of the wrapper, skip it
@@ -29,32 +112,46 @@ void write_ini(std::ostream& os, const node::wrapper_s& root, const string& pref
     if(ctn) {
       // The keys with children will be written after the other keys
       // Otherwise, they will break the section
-      wrappers.push_back(std::make_pair(name, ctn));
+      wrappers.emplace_back(&name, ctn);
       if (auto value = child->get(); !value.empty())
-        write_key(os, name + " =", move(value));
+        write_key(out, name, " =", value);
     } else
-      write_key(os, name + " =", child->get());
+      write_key(out, name, " =", child->get());
   });
-  for(auto pair : wrappers) {
-    os << endl << '[' << prefix << pair.first << ']' << endl;
-    write_ini(os, pair.second);
+  for(auto& pair : wrappers) {
+    out.append("\n[", 2);
+    out.append(prefix);
+    out.append(*pair.first);
+    out.append("]\n", 2);
+    write_ini(out, pair.second);
   }
 }
 
-void write_yml(std::ostream& os, const node::wrapper_s& root, int indent) {
+void write_yml(output_buffer& out, const node::wrapper_s& root, int indent) {
   root->iterate_children([&](const string& name, const node::base_s& child) {
     if (!child || name.empty() || name[0] == '.') return;
     if(auto ctn = std::dynamic_pointer_cast<node::wrapper>(child)) {
-      if (ctn->map[".hidden"]) {
+      if (auto hidden = ctn->map.find(".hidden"); hidden != ctn->map.end() && hidden->second) {
         return;
       }
-      std::fill_n(std::ostream_iterator<char>(os), indent, ' ');
-      write_key(os, name + ":", child->get());
-      write_yml(os, ctn, indent + 2);
+      out.append_spaces(indent);
+      write_key(out, name, ":", child->get());
+      write_yml(out, ctn, indent + 2);
     } else {
-      std::fill_n(std::ostream_iterator<char>(os), indent, ' ');
-      write_key(os, name + ":", child->get());
+      out.append_spaces(indent);
+      write_key(out, name, ":", child->get());
     }
   });
 }
 
+void write_ini(std::ostream& os, const node::wrapper_s& root, const string& prefix) {
+  output_buffer out(os);
+  write_ini(out, root, prefix);
+  out.flush();
+}
+
+void write_yml(std::ostream& os, const node::wrapper_s& root, int indent) {
+  output_buffer out(os);
+  write_yml(out, root, indent);
+  out.flush();
+}
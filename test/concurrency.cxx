@@ -0,0 +1,185 @@
+#include "test.hxx"
+#include <linkt/node/node.hpp>
+#include <linkt/node/profile.hpp>
+
+#include <atomic>
+#include <thread>
+#include <sstream>
+
+constexpr int reader_count = 8;
+
+const char* stress_doc = R"(
+base = hello
+var = ${var 0}
+num = ${var float 0.5}
+greeting = ${base} world ${var}
+nested = [${greeting}] [${greeting}]
+cache = ${cache 1 ${nested}}
+refcache = ${refcache ${var} 1000 ${nested}}
+index = ${var int 2}
+arrcache = ${arrcache 4 ${index} ${nested}}
+smooth = ${smooth 0.5 0.2 ${num}}
+map = ${map 0:1 0:100 ${smooth}}
+env = ${env linkt_stress ? none}
+steps = ${smooth 0.5 0.2 1}
+)";
+
+node::wrapper_s load_stress_doc() {
+  std::stringstream ss{stress_doc};
+  node::errorlist err;
+  auto doc = std::make_shared<node::wrapper>();
+  parse_ini(ss, err, doc);
+  for (auto& e : err)
+    ADD_FAILURE() << "At " << e.first << ": " << e.second;
+  return doc;
+}
+
+const vector<string> stress_keys{
+  "greeting", "nested", "cache", "refcache", "arrcache", "smooth", "map", "env"};
+
+// Run `reader_count` threads that read every stress key `repeat` times, while another thread keeps setting values
+// Returns the number of reads per second
+double stress(const node::wrapper_s& doc, int repeat) {
+  std::atomic<bool> done{false};
+  std::thread writer([&] {
+    for (int i = 0; !done; i++) {
+      doc->set<string>("var"_ts, std::to_string(i % 10));
+      doc->set<float>("num"_ts, i % 2);
+      doc->set<string>("env"_ts, "set");
+    }
+  });
+  vector<std::thread> readers;
+  std::atomic<int> failures{0};
+  auto time = get_time_milli();
+  for (int t = 0; t < reader_count; t++) {
+    readers.emplace_back([&] {
+      string scratch;
+      for (int i = 0; i < repeat; i++) {
+        for (auto& key : stress_keys) {
+          auto value = doc->get_child(key, "fail");
+          if (value == "fail")
+            failures++;
+        }
+        if (doc->get_child("greeting"_ts).compare(0, 12, "hello world ") != 0)
+          failures++;
+        // Views of buffers that other readers rewrite must stay intact
+        std::string_view view = doc->view_child("nested"_ts, scratch);
+        if (view.substr(0, 13) != "[hello world " || view.find("] [hello world ") == view.npos || view.back() != ']')
+          failures++;
+        doc->get_child("steps"_ts);
+      }
+    });
+  }
+  for (auto& reader : readers)
+    reader.join();
+  auto elapsed = get_time_milli() - time;
+  done = true;
+  writer.join();
+  EXPECT_EQ(failures, 0);
+  return reader_count * repeat * (stress_keys.size() + 2) * 1000.0 / std::max(elapsed, 1.0);
+}
+
+TEST(Concurrency, stress) {
+#ifndef LINKT_THREAD_SAFE
+  GTEST_SKIP() << "Concurrent reads require LINKT_THREAD_SAFE";
+#endif
+  auto repeat = base_repeat * 20;
+  auto doc = load_stress_doc();
+  stress(doc, repeat);
+
+  // Every frame must advance a smooth exactly once, no matter how the threads interleave
+  auto make_smooth = [] {
+    auto result = std::make_shared<node::smooth>();
+    result->value = std::make_shared<node::plain<float>>(1);
+    result->drag = 0.1;
+    result->spring = 0.0001;
+    return result;
+  };
+  auto frame = [](int index) { return node::steady_time(index * node::smooth::substep); };
+  auto shared = make_smooth(), reference = make_smooth();
+  vector<std::thread> steppers;
+  for (int t = 0; t < reader_count; t++)
+    steppers.emplace_back([&] {
+      for (int i = 0; i < repeat; i++)
+        shared->advance(1, frame(1000 + i / 4));
+    });
+  for (auto& stepper : steppers)
+    stepper.join();
+  for (int i = 0; i < repeat; i += 4)
+    reference->advance(1, frame(1000 + i / 4));
+  EXPECT_EQ(shared->current.load().current, reference->current.load().current);
+
+  // The optimized tree must be just as safe
+  node::clone_context context;
+  doc->optimize(context);
+  EXPECT_TRUE(context.errors.empty());
+  stress(doc, repeat);
+}
+
+TEST(Concurrency, throughput) {
+#ifndef LINKT_THREAD_SAFE
+  GTEST_SKIP() << "Concurrent reads require LINKT_THREAD_SAFE";
+#endif
+  auto doc = load_stress_doc();
+  node::clone_context context;
+  doc->optimize(context);
+  auto reads_per_second = stress(doc, base_repeat * 100);
+  if (print_time)
+    cout << "Throughput: " << std::setw(10) << std::lround(reads_per_second) << " reads/s with "
+        << reader_count << " readers" << endl;
+}
+
+TEST(Concurrency, reload) {
+#ifndef LINKT_THREAD_SAFE
+  GTEST_SKIP() << "Concurrent reads require LINKT_THREAD_SAFE";
+#endif
+  node::tree_handle handle(load_stress_doc());
+  std::atomic<bool> done{false};
+  std::atomic<int> failures{0};
+  vector<std::thread> readers;
+  for (int t = 0; t < reader_count; t++) {
+    readers.emplace_back([&] {
+      while (!done) {
+        auto root = handle.get();
+        for (auto& key : stress_keys)
+          if (root->get_child(key, "fail") == "fail")
+            failures++;
+      }
+    });
+  }
+  for (int i = 0; i < base_repeat; i++) {
+    auto errors = handle.reload([](node::errorlist&) { return load_stress_doc(); }).get();
+    EXPECT_TRUE(errors.empty());
+  }
+  done = true;
+  for (auto& reader : readers)
+    reader.join();
+  EXPECT_EQ(failures, 0);
+}
+
+TEST(Concurrency, profile) {
+#ifndef LINKT_THREAD_SAFE
+  GTEST_SKIP() << "Concurrent reads require LINKT_THREAD_SAFE";
+#endif
+  auto doc = load_stress_doc();
+  node::profiler profiler;
+  node::clone_context context;
+  context.profile = &profiler;
+  doc->optimize(context);
+  EXPECT_TRUE(context.errors.empty());
+  // Every thread records its stacks on its own, and they are merged when written
+  vector<std::thread> readers;
+  for (int t = 0; t < reader_count; t++)
+    readers.emplace_back([&] {
+      for (int i = 0; i < base_repeat; i++)
+        doc->get_child("nested"_ts);
+    });
+  for (auto& reader : readers)
+    reader.join();
+  auto nested = profiler.find("nested");
+  ASSERT_TRUE(nested);
+  EXPECT_EQ(nested->calls, reader_count * base_repeat);
+  std::stringstream folded;
+  profiler.write_folded(folded);
+  EXPECT_NE(folded.str().find("nested;greeting"), string::npos);
+}
@@ -0,0 +1,209 @@
+#include "test.hxx"
+#include <linkt/daemon_protocol.hpp>
+
+#include <sstream>
+
+using namespace daemon_protocol;
+
+const char* daemon_doc = R"(
+greeting = hello
+var = ${var 0}
+sentence = ${greeting} world ${var}
+broken = ${env linkt_daemon_nexist}
+)";
+
+responder load_daemon_doc() {
+  std::stringstream ss{daemon_doc};
+  node::errorlist err;
+  auto doc = std::make_shared<node::wrapper>();
+  parse_ini(ss, err, doc);
+  for (auto& e : err)
+    ADD_FAILURE() << "At " << e.first << ": " << e.second;
+  return responder(doc);
+}
+
+string get_request(const string& path) {
+  string out;
+  auto start = begin_frame(out);
+  out.push_back(request_get);
+  out.append(path);
+  end_frame(out, start);
+  return out;
+}
+
+string set_request(const string& path, const string& value) {
+  string out;
+  auto start = begin_frame(out);
+  out.push_back(request_set);
+  put_sized(out, path);
+  out.append(value);
+  end_frame(out, start);
+  return out;
+}
+
+string get_many_request(const vector<string>& paths) {
+  string out;
+  auto start = begin_frame(out);
+  out.push_back(request_get_many);
+  put_u32(out, paths.size());
+  for (auto& path : paths)
+    put_sized(out, path);
+  end_frame(out, start);
+  return out;
+}
+
+// Responds to a single request, and returns the response without its size
+string respond_once(responder& server, const string& request) {
+  string_view data = request, frame;
+  bool too_large = false;
+  EXPECT_TRUE(next_frame(data, frame, too_large));
+  EXPECT_TRUE(data.empty());
+  string out;
+  server.respond(frame, out);
+  string_view response = out;
+  EXPECT_TRUE(next_frame(response, frame, too_large));
+  EXPECT_TRUE(response.empty());
+  return string(frame);
+}
+
+// Feeds `input` to the server `chunk` bytes at a time, the way the daemon reads its connections
+string respond_in_chunks(responder& server, const string& input, size_t chunk) {
+  string pending, out;
+  string_view frame;
+  bool too_large = false;
+  for (size_t pos = 0; pos < input.size(); pos += chunk) {
+    pending.append(input, pos, chunk);
+    string_view rest = pending;
+    while (next_frame(rest, frame, too_large))
+      server.respond(frame, out);
+    EXPECT_FALSE(too_large);
+    pending.erase(0, pending.size() - rest.size());
+  }
+  EXPECT_TRUE(pending.empty());
+  return out;
+}
+
+TEST(Daemon, frames) {
+  auto server = load_daemon_doc();
+  auto input = get_request("greeting") + set_request("var", "1") + get_request("sentence") + get_many_request({"greeting", "var"});
+  auto expected = respond_in_chunks(server, input, input.size());
+  EXPECT_FALSE(expected.empty());
+  // Frames split across reads, or many in a single read, get the same responses
+  for (size_t chunk : {1, 3, 7, 64}) {
+    auto out = respond_in_chunks(server, input, chunk);
+    EXPECT_EQ(out, expected) << "Chunk: " << chunk;
+  }
+
+  vector<string> responses;
+  string_view rest = expected, frame;
+  bool too_large = false;
+  while (next_frame(rest, frame, too_large))
+    responses.emplace_back(frame);
+  ASSERT_EQ(responses.size(), 4);
+  EXPECT_EQ(responses[0], string(1, status_ok) + "hello");
+  EXPECT_EQ(responses[1], string(1, status_ok));
+  EXPECT_EQ(responses[2], string(1, status_ok) + "hello world 1");
+}
+
+TEST(Daemon, too_large) {
+  string input;
+  put_u32(input, max_frame + 1);
+  input.append("abc");
+  string_view data = input, frame;
+  bool too_large = false;
+  EXPECT_FALSE(next_frame(data, frame, too_large));
+  EXPECT_TRUE(too_large);
+  EXPECT_EQ(data.size(), input.size());
+
+  // A frame of the largest size only waits for the rest of its bytes
+  input.clear();
+  put_u32(input, max_frame);
+  data = input;
+  EXPECT_FALSE(next_frame(data, frame, too_large));
+  EXPECT_FALSE(too_large);
+
+  // Neither does the start of a size
+  data = string_view(input).substr(0, 2);
+  EXPECT_FALSE(next_frame(data, frame, too_large));
+  EXPECT_FALSE(too_large);
+}
+
+TEST(Daemon, get) {
+  auto server = load_daemon_doc();
+  EXPECT_EQ(respond_once(server, get_request("sentence")), string(1, status_ok) + "hello world 0");
+  EXPECT_EQ(respond_once(server, get_request("nexist")), string(1, status_missing_key));
+  auto broken = respond_once(server, get_request("broken"));
+  ASSERT_FALSE(broken.empty());
+  EXPECT_NE(broken[0], status_ok);
+  // Paths are remembered only once they are found
+  EXPECT_EQ(server.nodes.count("sentence"), 1);
+  EXPECT_EQ(server.nodes.count("nexist"), 0);
+}
+
+TEST(Daemon, set) {
+  auto server = load_daemon_doc();
+  EXPECT_EQ(respond_once(server, set_request("var", "two")), string(1, status_ok));
+  EXPECT_EQ(respond_once(server, get_request("sentence")), string(1, status_ok) + "hello world two");
+  EXPECT_EQ(respond_once(server, set_request("greeting", "bye")), string(1, status_read_only));
+  EXPECT_EQ(respond_once(server, set_request("sentence", "bye")), string(1, status_read_only));
+  EXPECT_EQ(respond_once(server, set_request("nexist", "bye")), string(1, status_missing_key));
+  EXPECT_EQ(respond_once(server, get_request("greeting")), string(1, status_ok) + "hello");
+}
+
+TEST(Daemon, get_many) {
+  auto server = load_daemon_doc();
+  auto response = respond_once(server, get_many_request({"greeting", "nexist", "sentence"}));
+  frame_reader in(response);
+  EXPECT_EQ(in.u8(), status_ok);
+  EXPECT_EQ(in.u32(), 3);
+  EXPECT_EQ(in.u8(), status_ok);
+  EXPECT_EQ(in.sized(), "hello");
+  EXPECT_EQ(in.u8(), status_missing_key);
+  EXPECT_EQ(in.sized(), "");
+  EXPECT_EQ(in.u8(), status_ok);
+  EXPECT_EQ(in.sized(), "hello world 0");
+  EXPECT_TRUE(in.valid);
+  EXPECT_TRUE(in.rest.empty());
+
+  auto empty_response = respond_once(server, get_many_request({}));
+  frame_reader empty(empty_response);
+  EXPECT_EQ(empty.u8(), status_ok);
+  EXPECT_EQ(empty.u32(), 0);
+  EXPECT_TRUE(empty.rest.empty());
+}
+
+TEST(Daemon, bad_request) {
+  auto server = load_daemon_doc();
+  auto frame = [](string content) {
+    string out;
+    auto start = begin_frame(out);
+    out.append(content);
+    end_frame(out, start);
+    return out;
+  };
+  auto bad = string(1, status_bad_request);
+  EXPECT_EQ(respond_once(server, frame("")), bad);
+  EXPECT_EQ(respond_once(server, frame("\x09greeting")), bad);
+
+  // The path of a set request is longer than the frame
+  string set(1, request_set);
+  put_u32(set, 100);
+  set.append("var");
+  EXPECT_EQ(respond_once(server, frame(set)), bad);
+  EXPECT_EQ(respond_once(server, frame(string(1, request_set) + "ab")), bad);
+  EXPECT_EQ(respond_once(server, get_request("var")), string(1, status_ok) + "0");
+
+  // A get_many request has fewer paths than it counts, so its values are dropped from the response
+  string many(1, request_get_many);
+  put_u32(many, 3);
+  put_sized(many, "greeting");
+  EXPECT_EQ(respond_once(server, frame(many)), bad);
+  EXPECT_EQ(respond_once(server, frame(string(1, request_get_many) + "ab")), bad);
+
+  // Bad requests don't disturb the ones after them
+  auto input = frame("\x09") + get_request("greeting");
+  auto output = respond_in_chunks(server, input, 5);
+  frame_reader response(output);
+  EXPECT_EQ(response.sized(), bad);
+  EXPECT_EQ(response.sized(), string(1, status_ok) + "hello");
+}
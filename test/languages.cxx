@@ -1,8 +1,11 @@
 #include "test.hxx"
+#include <linkt/node/deferred.hpp>
 
 #include <fstream>
+#include <sstream>
 #include <thread>
 #include <unistd.h>
+#include <fcntl.h>
 
 struct file_test_param {
   struct expectation { string path, value; };
@@ -20,6 +23,14 @@ void diff(const string& path) {
   pclose(file);
 }
 
+// Save the tree in a snapshot and load it back
+node::wrapper_s reload_snapshot(const node::wrapper_s& doc) {
+  std::stringstream ss;
+  write_snapshot(ss, doc);
+  auto data = ss.str();
+  return read_snapshot(data.data(), data.size());
+}
+
 void test_language(file_test_param testset) {
   std::ifstream ifs{testset.path + ".txt"};
   ASSERT_FALSE(ifs.fail());
@@ -63,6 +74,20 @@ void test_language(file_test_param testset) {
 
   // Check the export result
   diff(testset.path);
+
+  // Parse the file again, leaving the values to be parsed when they are first read
+  ifs.clear();
+  ifs.seekg(0);
+  node::errorlist lazy_err;
+  auto lazy_doc = std::make_shared<node::wrapper>();
+  auto report = [&](const string& path, const string& msg) { lazy_err.report_error(path, msg); };
+  if (testset.language == "ini")
+    parse_ini(ifs, lazy_err, lazy_doc, report);
+  else if (testset.language == "yml")
+    parse_yml(ifs, lazy_err, lazy_doc, report);
+  for(auto& pair : testset.expectations)
+    check_key(*lazy_doc, pair.path, pair.value, false);
+  triple_node_test(lazy_doc, test_doc);
 }
 
 TEST(Language, Plain_ini) {
@@ -107,6 +132,358 @@ TEST(Language, Functional_ini) {
   });
 }
 
+TEST(Language, evaluate_all) {
+  std::ifstream ifs{"lemonbar_test.txt"};
+  ASSERT_FALSE(ifs.fail());
+  node::errorlist err;
+  auto doc = std::make_shared<node::wrapper>();
+  parse_ini(ifs, err, doc);
+  ASSERT_TRUE(err.empty());
+
+  node::inline_executor serial;
+  auto expected = node::evaluate_all(doc, serial);
+  EXPECT_EQ(expected.at("mod.cpu"), "%{F#f00}CPU 69%");
+  EXPECT_EQ(expected.at("stat.bat"), "0");
+  EXPECT_EQ(expected.size(), 11u);
+
+  node::thread_pool pool(4);
+  for (int i = 0; i < base_repeat; i++) {
+    node::errorlist eval_err;
+    EXPECT_EQ(node::evaluate_all(doc, pool, eval_err), expected);
+    EXPECT_TRUE(eval_err.empty());
+  }
+}
+
+TEST(Language, bake_colors) {
+  // Generate a theme of 10000 colors, with a few processors and repeating inputs
+  std::stringstream theme;
+  const char* modifications[] = {"cielab 'lum * 1.1'", "cielch 'hue + 60'", "'sat * 0.5'", ""};
+  for (int i = 0; i < 10000; i++) {
+    char input[8];
+    snprintf(input, 8, "#%06x", (i % 256) * 0x010203);
+    theme << "theme.c" << i << " = ${color " << modifications[i % 4] << " " << input << "}\n";
+  }
+  theme << "theme.fallback = ${color nexist ? #fff}\ntheme.fail = ${color nexist}\n";
+  theme << "theme.no_input = ${color ${env nexist} ? #123}\ntheme.live = ${color ${env linkt_bake_colors}}\n";
+  auto text = theme.str();
+  auto load = [&] {
+    std::stringstream ss{text};
+    node::errorlist err;
+    auto doc = std::make_shared<node::wrapper>();
+    parse_ini(ss, err, doc);
+    EXPECT_TRUE(err.empty());
+    return doc;
+  };
+
+  auto doc = load();
+  node::inline_executor serial;
+  auto time = get_time_milli();
+  auto expected = node::evaluate_all(doc, serial);
+  auto evaluate_time = get_time_milli() - time;
+  EXPECT_EQ(expected.size(), 10002u);
+
+  node::thread_pool pool(4);
+  node::errorlist err;
+  time = get_time_milli();
+  EXPECT_EQ(node::bake_colors(doc, pool, err), 10001u);
+  auto bake_time = get_time_milli() - time;
+  ASSERT_EQ(err.size(), 1u);
+  EXPECT_EQ(err.front().first, "theme.fail");
+  EXPECT_TRUE(std::dynamic_pointer_cast<node::plain<string>>(doc->get_child_ptr("theme.c0"_ts)));
+  EXPECT_EQ(doc->get_child("theme.no_input"_ts), "#123");
+  err.clear();
+  EXPECT_EQ(node::evaluate_all(doc, serial, err), expected);
+
+  // Colors that read an env aren't baked, so they follow it
+  EXPECT_FALSE(std::dynamic_pointer_cast<node::plain<string>>(doc->get_child_ptr("theme.no_input"_ts)));
+  setenv("linkt_bake_colors", "#ff0000", true);
+  EXPECT_EQ(doc->get_child("theme.live"_ts), "#FF0000");
+  unsetenv("linkt_bake_colors");
+  if (print_time)
+    cout << "Colors: evaluated in " << evaluate_time << "ms, baked in " << bake_time << "ms" << endl;
+}
+
+TEST(Language, dump_throughput) {
+  // Generate a tree of 100000 keys, some of them needing escapes or quotes
+  auto doc = std::make_shared<node::wrapper>();
+  for (int i = 0; i < 1000; i++) {
+    auto section = doc->add_wrapper("section" + std::to_string(i));
+    for (int j = 0; j < 100; j++) {
+      auto value = j % 10 ? "value " + std::to_string(j) : " ${escaped} ${value} ";
+      section->add(tstring("key" + std::to_string(j)), std::make_shared<node::plain<string>>(move(value)));
+    }
+  }
+
+  std::stringstream ss;
+  auto time = get_time_milli();
+  write_ini(ss, doc);
+  auto stream_time = get_time_milli() - time;
+  auto expected = ss.str();
+
+  // The file descriptor sink must produce the same output
+  auto dump_path = testing::TempDir() + "linkt_dump_test.txt";
+  auto fd = open(dump_path.data(), O_CREAT | O_TRUNC | O_WRONLY, 0644);
+  ASSERT_GE(fd, 0);
+  time = get_time_milli();
+  {
+    output_buffer out(fd);
+    write_ini(out, doc);
+    out.flush();
+  }
+  auto fd_time = get_time_milli() - time;
+  close(fd);
+  std::ifstream ifs{dump_path};
+  EXPECT_EQ(string(std::istreambuf_iterator<char>{ifs}, {}), expected);
+  std::remove(dump_path.data());
+
+  if (print_time) {
+    auto megabytes = expected.size() / 1000000.0;
+    cout << "Dump: " << megabytes << "MB, " << megabytes * 1000 / std::max(stream_time, 1.0) << "MB/s to a stream, "
+        << megabytes * 1000 / std::max(fd_time, 1.0) << "MB/s to a file descriptor" << endl;
+  }
+}
+
+TEST(Language, snapshot) {
+  // Generate a tree of 50000 keys, most of them with references and interpolations
+  std::stringstream text;
+  for (int i = 0; i < 10; i++) {
+    text << "[s" << i << "]\n";
+    for (int j = 0; j < 1000; j++) {
+      text << "k" << j << " = ${var v" << i << "}\n"
+           << "g" << j << ".k = ${s" << i << ".k" << j << "} x\n"
+           << "r" << j << " = ${s" << i << ".g" << j << ".k ? none}\n"
+           << "c" << j << " = ${cache 1000 ${s" << i << ".r" << j << "}}\n"
+           << "e" << j << " = [${s" << i << ".c" << j << "}] ${map 0:1 0:10 ${var 0.5}}\n";
+    }
+    text << "f = [${s" << i << ".k0 :%4}] ${map 0:1 0:10 ${var 0.5} :%05.1}\n";
+  }
+  auto time = get_time_milli();
+  node::errorlist err;
+  auto doc = std::make_shared<node::wrapper>();
+  parse_ini(text, err, doc);
+  auto parse_time = get_time_milli() - time;
+  EXPECT_TRUE(err.empty());
+
+  auto snapshot_path = testing::TempDir() + "linkt_snapshot_test.bin";
+  std::ofstream ofs{snapshot_path, std::ios::binary};
+  write_snapshot(ofs, doc);
+  ofs.close();
+  time = get_time_milli();
+  auto loaded = load_snapshot(snapshot_path);
+  auto load_time = get_time_milli() - time;
+  std::remove(snapshot_path.data());
+  EXPECT_EQ(loaded->get_child("s5.e500"_ts), "[v5 x] 5");
+  EXPECT_EQ(loaded->get_child("s0.g0.k"_ts), "v0 x");
+  EXPECT_EQ(loaded->get_child("s2.f"_ts), "[  v2] 005.0");
+
+  // Optimized trees hold direct references, which must point into the loaded tree
+  node::clone_context context;
+  doc->optimize(context);
+  EXPECT_TRUE(context.errors.empty());
+  loaded = reload_snapshot(doc);
+  EXPECT_EQ(loaded->get_child("s9.e999"_ts), "[v9 x] 5");
+  EXPECT_EQ(loaded->get_child("s9.f"_ts), "[  v9] 005.0");
+  EXPECT_TRUE(loaded->set<string>("s3.k7"_ts, "changed"));
+  EXPECT_EQ(loaded->get_child("s3.r7"_ts), "changed x");
+  EXPECT_EQ(doc->get_child("s3.r7"_ts), "v3 x");
+
+  // Deferred values are parsed before they're saved
+  std::stringstream lazy_text{"a = ${var v}\nb.c = ${a} x\nd = ${b.c ? none}\nbroken = ${map 1}\n"};
+  auto lazy_doc = std::make_shared<node::wrapper>();
+  parse_ini(lazy_text, err, lazy_doc, [](const string&, const string&) {});
+  EXPECT_TRUE(err.empty());
+  loaded = reload_snapshot(lazy_doc);
+  EXPECT_EQ(loaded->get_child("d"_ts), "v x");
+  EXPECT_TRUE(loaded->set<string>("a"_ts, "changed"));
+  EXPECT_EQ(loaded->get_child("d"_ts), "changed x");
+  EXPECT_FALSE(loaded->get_child_ptr("broken"_ts));
+
+  // Damaged snapshots must be rejected
+  std::stringstream ss;
+  write_snapshot(ss, doc);
+  auto data = ss.str();
+  EXPECT_THROW(read_snapshot(data.data(), data.size() / 2), snapshot_error);
+  EXPECT_THROW(read_snapshot(data.data() + 1, data.size() - 1), snapshot_error);
+
+  if (print_time)
+    cout << "Startup of 50000 keys: " << parse_time << "ms parsing text, " << load_time << "ms loading a snapshot" << endl;
+}
+
+TEST(Language, lazy) {
+  // Generate a text of 50000 keys, of which only a few are read
+  std::stringstream text;
+  for (int i = 0; i < 10000; i++)
+    text << "k" << i << " = ${var v" << i << "}\n"
+         << "g" << i << ".k = ${k" << i << "} x\n"
+         << "r" << i << " = ${g" << i << ".k ? none}\n"
+         << "c" << i << " = ${cache 1000 ${r" << i << "}}\n"
+         << "e" << i << " = [${c" << i << "}] ${map 0:1 0:10 ${var 0.5}}\n";
+  text << "broken = ${map 1}\n";
+  auto source = text.str();
+
+  auto time = get_time_milli();
+  node::errorlist err;
+  auto doc = std::make_shared<node::wrapper>();
+  parse_ini(text, err, doc);
+  auto parse_time = get_time_milli() - time;
+  EXPECT_EQ(err.size(), 1);
+
+  // Errors of values are only reported once the values are read
+  std::stringstream ss{source};
+  node::errorlist lazy_err, value_err;
+  auto lazy_doc = std::make_shared<node::wrapper>();
+  time = get_time_milli();
+  parse_ini(ss, lazy_err, lazy_doc, [&](const string& path, const string& msg) {
+    value_err.report_error(path, msg);
+  });
+  auto lazy_time = get_time_milli() - time;
+  EXPECT_TRUE(lazy_err.empty());
+  EXPECT_TRUE(value_err.empty());
+  time = get_time_milli();
+  EXPECT_EQ(lazy_doc->get_child("e500"_ts), "[v500 x] 5");
+  EXPECT_EQ(lazy_doc->get_child("g7.k"_ts), "v7 x");
+  EXPECT_TRUE(lazy_doc->set<string>("k7"_ts, "changed"));
+  EXPECT_EQ(lazy_doc->get_child("r7"_ts), "changed x");
+  auto read_time = get_time_milli() - time;
+  EXPECT_THROW(lazy_doc->get_child("broken"_ts), node::node_error);
+  EXPECT_THROW(lazy_doc->get_child("broken"_ts), std::logic_error);
+  EXPECT_EQ(value_err.size(), 1);
+
+  // Only the operators of expressions keep values from being deferred
+  EXPECT_TRUE(node::deferred::can_defer("autosave http://host/clone ${cmd echo save}"_ts));
+  EXPECT_FALSE(node::deferred::can_defer("a ${cache 10 ${ clone b}}"_ts));
+  EXPECT_FALSE(node::deferred::can_defer("${save file ${b}}"_ts));
+
+  // Evaluating concurrently parses the values first, keys that read the same nodes are grouped by them
+  std::stringstream eval_ss{source};
+  auto eval_doc = std::make_shared<node::wrapper>();
+  parse_ini(eval_ss, lazy_err, eval_doc, [](const string&, const string&) {});
+  node::thread_pool pool(4);
+  node::errorlist eval_err, expected_err;
+  EXPECT_EQ(node::evaluate_all(eval_doc, pool, eval_err), node::evaluate_all(doc, pool, expected_err));
+  EXPECT_EQ(eval_err.size(), 1);
+
+  // Cloning parses the rest
+  node::clone_context context;
+  lazy_doc->optimize(context);
+  EXPECT_TRUE(context.errors.empty());
+  EXPECT_EQ(lazy_doc->get_child("e9999"_ts), "[v9999 x] 5");
+  EXPECT_EQ(lazy_doc->get_child("r7"_ts), "changed x");
+  EXPECT_EQ(value_err.size(), 1);
+  if (print_time)
+    cout << "Parse of 50000 keys: " << parse_time << "ms, lazy parse: " << lazy_time
+         << "ms, reading 4 keys: " << read_time << "ms" << endl;
+}
+
+TEST(Language, reparse) {
+  string text = "base = hello\n"
+      "greeting = ${base} world\n"
+      "cache = ${cache 100000 ${greeting}}\n"
+      "num = ${var float 1}\n"
+      "smooth = ${smooth 0.5 0.2 ${num}}\n"
+      "appender = ${save last \"${appender.last} x\"}\n"
+      "chain = ${cache 100000 ${cache}}\n"
+      "later = ${cache 100000 ${added ? none}}\n"
+      "note = a clone of ${base}\n"
+      "[section]\n"
+      "key = value\n";
+  node::errorlist err;
+  auto doc = std::make_shared<node::wrapper>();
+  parse_record record;
+  std::stringstream ss{text};
+  EXPECT_EQ(reparse_ini(ss, err, doc, record), 10);
+  EXPECT_TRUE(err.empty());
+  EXPECT_EQ(doc->get_child("cache"_ts), "hello world");
+  EXPECT_EQ(doc->get_child("smooth"_ts), "0.2");
+  EXPECT_EQ(doc->get_child("appender"_ts), " x");
+  EXPECT_EQ(doc->get_child("chain"_ts), "hello world");
+  EXPECT_EQ(doc->get_child("later"_ts), "none");
+  auto smooth = doc->get_child_ptr("smooth"_ts);
+
+  // Changing one key keeps the others along with their state, but drops the caches that read it through other keys
+  // Words in the text of a value, like `clone`, don't count as operators
+  text.replace(text.find("hello"), 5, "bye");
+  ss = std::stringstream{text};
+  EXPECT_EQ(reparse_ini(ss, err, doc, record), 1);
+  EXPECT_TRUE(err.empty());
+  EXPECT_EQ(doc->get_child("greeting"_ts), "bye world");
+  EXPECT_EQ(doc->get_child("cache"_ts), "bye world");
+  EXPECT_EQ(doc->get_child("chain"_ts), "bye world");
+  EXPECT_EQ(doc->get_child("note"_ts), "a clone of bye");
+  EXPECT_EQ(doc->get_child_ptr("smooth"_ts), smooth);
+  EXPECT_GE(std::stof(doc->get_child("smooth"_ts)), 0.2f);
+
+  // A changed key loses the keys that its parse added
+  text.replace(text.find(" x\""), 2, " y");
+  ss = std::stringstream{text};
+  EXPECT_EQ(reparse_ini(ss, err, doc, record), 1);
+  EXPECT_TRUE(err.empty());
+  EXPECT_EQ(doc->get_child("appender"_ts), " y");
+
+  // Removed keys are erased, and keys that fail are parsed again next time
+  text.erase(text.find("[section]"));
+  text += "broken = ${map 1}\n";
+  ss = std::stringstream{text};
+  EXPECT_EQ(reparse_ini(ss, err, doc, record), 2);
+  EXPECT_EQ(err.size(), 1);
+  EXPECT_FALSE(doc->get_child_safe("section.key"_ts));
+  ss = std::stringstream{text};
+  EXPECT_EQ(reparse_ini(ss, err, doc, record), 1);
+  EXPECT_EQ(err.size(), 2);
+
+  // Keys that looked for a missing key find it once it's added
+  text += "added = here\n";
+  ss = std::stringstream{text};
+  EXPECT_EQ(reparse_ini(ss, err, doc, record), 2);
+  EXPECT_EQ(doc->get_child("later"_ts), "here");
+  EXPECT_EQ(err.size(), 3);
+
+  // The same for yml, where parents are wrapped when they get a child
+  string yml = "bar:\n  label: hi\n  value:$ bar.label\n";
+  auto yml_doc = std::make_shared<node::wrapper>();
+  parse_record yml_record;
+  ss = std::stringstream{yml};
+  EXPECT_EQ(reparse_yml(ss, err, yml_doc, yml_record), 3);
+  EXPECT_EQ(yml_doc->get_child("bar.value"_ts), "hi");
+  ss = std::stringstream{yml + "  extra: ${child label}\n    label: nested\n"};
+  EXPECT_EQ(reparse_yml(ss, err, yml_doc, yml_record), 2);
+  EXPECT_EQ(yml_doc->get_child("bar.extra"_ts), "nested");
+  EXPECT_EQ(yml_doc->get_child("bar.value"_ts), "hi");
+  EXPECT_EQ(err.size(), 3);
+}
+
+TEST(Language, reparse_time) {
+  // Edit a single key of a text with 50000 keys
+  std::stringstream text;
+  for (int i = 0; i < 10000; i++)
+    text << "k" << i << " = v" << i << "\n"
+         << "g" << i << ".k = ${k" << i << "} x\n"
+         << "c" << i << " = ${cache 1000 ${g" << i << ".k}}\n"
+         << "s" << i << " = ${smooth 0.5 0.2 1}\n"
+         << "e" << i << " = [${c" << i << "}]\n";
+  auto original = text.str();
+  auto edited = original;
+  edited.replace(edited.find("v500\n"), 4, "edit");
+
+  node::errorlist err;
+  auto doc = std::make_shared<node::wrapper>();
+  parse_record record;
+  auto time = get_time_milli();
+  EXPECT_EQ(reparse_ini(text, err, doc, record), 50000);
+  auto parse_time = get_time_milli() - time;
+  EXPECT_EQ(doc->get_child("e500"_ts), "[v500 x]");
+
+  std::stringstream ss{edited};
+  time = get_time_milli();
+  EXPECT_EQ(reparse_ini(ss, err, doc, record), 1);
+  auto reparse_time = get_time_milli() - time;
+  EXPECT_EQ(doc->get_child("e500"_ts), "[edit x]");
+  EXPECT_EQ(doc->get_child("e501"_ts), "[v501 x]");
+  EXPECT_TRUE(err.empty());
+  if (print_time)
+    cout << "Parse of 50000 keys: " << parse_time << "ms, reparse of one key: " << reparse_time << "ms" << endl;
+}
+
 TEST(Language, Yml) {
   test_language({"yml_test", "yml",
     {
@@ -165,7 +542,8 @@ node::wrapper_s load_optimized_doc(string path = "misc_test.txt") {
   return doc;
 }
 
-vector<node::wrapper_s> tests{load_doc(), load_optimized_doc()};
+vector<node::wrapper_s> tests{load_doc(), load_optimized_doc(),
+    reload_snapshot(load_doc()), reload_snapshot(load_optimized_doc())};
 struct Misc : TestWithParam<node::wrapper_s> {};
 INSTANTIATE_TEST_SUITE_P(wrapper, Misc, ValuesIn(tests));
 
@@ -346,11 +724,10 @@ TEST_P(Misc, replace_text) {
 
 TEST_P(Misc, other) {
   auto doc = GetParam();
+  // The first read takes a step, and it moves on with time rather than with reads
   EXPECT_EQ(doc->get_child("smooth"_ts, "fail"), "0.2");
-  EXPECT_EQ(doc->get_child("smooth"_ts, "fail"), "0.46");
-  EXPECT_EQ(doc->get_child("smooth"_ts, "fail"), "0.698");
-  EXPECT_EQ(doc->get_child("smooth"_ts, "fail"), "0.8774");
-  EXPECT_EQ(doc->get_child("smooth"_ts, "fail"), "0.99162");
+  std::this_thread::sleep_for(std::chrono::milliseconds(50));
+  EXPECT_NE(doc->get_child("smooth"_ts, "fail"), "0.2");
 }
 
 TEST(Strsub, time) {
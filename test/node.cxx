@@ -1,6 +1,16 @@
 #include "test.hxx"
+#include <linkt/node/node.hpp>
+#include <linkt/node/profile.hpp>
+#include <linkt/node/reference.hpp>
+#include <linkt/node/scan.hpp>
+#include <linkt/node/shm.hpp>
+#include <linkt/node/schedule.hpp>
+#include <linkt/node/animate.hpp>
 
 #include <fstream>
+#include <sstream>
+#include <random>
+#include <algorithm>
 
 struct parse_test_single {
   string path, value, parsed;
@@ -62,10 +72,33 @@ TEST(Node, Simple) {
     {"a.ref", "${key}", "foo"},
     {"a.ref-space", "${ key }", "foo"},
     {"newline", "hello\\nworld", "hello\nworld"},
+    {"escapes", "tab\\t\\tnew\\n\\nslash\\\\", "tab\t\tnew\n\nslash\\"},
+    {"escaped-ref", "\\${key} ${key}", "${key} foo"},
+    {"unclosed", "${key", "${key"},
+    {"bad-escape", "a\\q", "", true, true},
   });
   test_nodes({{"empty", "", ""}});
 }
 
+TEST(Node, many_escapes) {
+  auto doc = std::make_shared<node::wrapper>();
+  node::parse_context context;
+  context.root = context.parent = doc;
+  context.raw = "foo";
+  tstring key(context.raw);
+  doc->add("key", context, key);
+  context.raw.clear();
+  for (int i = 0; i < 50000; i++)
+    context.raw += "\\t";
+  context.raw += "${key}";
+  tstring value(context.raw);
+  auto time = get_time_milli();
+  doc->add("tabs", context, value);
+  if (print_time)
+    cout << "Parse time of 50000 escapes: " << get_time_milli() - time << "ms" << endl;
+  EXPECT_EQ(doc->get_child("tabs"_ts), string(50000, '\t') + "foo");
+}
+
 TEST(Node, Cmd) {
   test_nodes({
     {"msg", "1.000", "1.000"},
@@ -144,12 +177,84 @@ TEST(Node, strsub_nested) {
   }, base_repeat * 10);
 }
 
+TEST(Node, strsub_nested_optimize) {
+  // Optimize nested interpolations that haven't been evaluated yet
+  auto doc = std::make_shared<node::wrapper>();
+  node::parse_context context;
+  context.root = context.parent = doc;
+  for (auto& [path, value] : vector<std::pair<string, string>>{
+      {"var", "${var 0}"}, {"greeting", "hello ${var}"}, {"nested", "[${greeting}] [${greeting}]"}}) {
+    context.raw = value;
+    tstring ts(context.raw);
+    doc->add(path, context, ts);
+  }
+  node::clone_context clone_ctx;
+  doc->optimize(clone_ctx);
+  EXPECT_TRUE(clone_ctx.errors.empty());
+  EXPECT_EQ(doc->get_child("nested"_ts), "[hello 0] [hello 0]");
+  EXPECT_TRUE(doc->set<string>("var"_ts, "world"));
+  EXPECT_EQ(doc->get_child("nested"_ts), "[hello world] [hello world]");
+}
+
+TEST(Node, strsub_format) {
+  setenv("test_env", "12.345", true);
+  test_nodes({
+    {"num", "${var float 3.14159}", "3.14159", false},
+    {"count", "${var int 42}", "42", false},
+    {"text", "${var abc}", "abc", false},
+    {"mapped", "CPU ${map 0:1 0:100 0.25}%", "CPU 25%"},
+    {"plain", "${num} and ${count}", "3.14159 and 42", false},
+    {"precision", "${num :%.2}|${count :%.2}", "3.14|42.00", false},
+    {"width", "[${num :%8.1}] [${count :%-5}] [${text :%5}]", "[     3.1] [42   ] [  abc]", false},
+    {"zeros", "${var float -5 :%06.1}", "-005.0", false},
+    {"env", "${env test_env :%.1} C", "12.3 C", false},
+    {"alone", "${count :%04}", "0042", false},
+    {"fallback", "${nexist ? 7 :%03}", "007", false},
+    {"not-format", "${env nexist ? 5%}", "5%", false},
+    {"not-format-word", "${env nexist ? echo 50 %5}", "echo 50 %5", false},
+    {"large", "${var int 16777217 :%.0} ${var int -16777217 :%.2} ${env nexist ? 16777217 :%.1}",
+        "16777217 -16777217.00 16777217.0", false},
+  });
+  test_nodes({{"float-format", "${map 0:1 0:100 ${smooth 0.5 ${var float 0} :%.1}}", "", false, true}});
+
+  // Numbers are written the same as their strings
+  for (float value : {0.0f, -0.0f, 1.0f, 0.1f, 100.25f, -3.5e-7f, 1e20f, 123456.789f, INFINITY, -INFINITY}) {
+    char buffer[node::number_size];
+    node::plain<float> number{float(value)};
+    auto expected = std::to_string(value);
+    auto erase = expected.find_last_not_of('0');
+    expected.erase(expected[erase] == '.' ? erase : (erase + 1));
+    EXPECT_EQ(string(buffer, node::write_number(buffer, value)), expected);
+    EXPECT_EQ(number.get(), expected);
+  }
+}
+
 TEST(Node, gradient) {
   test_nodes({{"gradient", "${gradient '#000 1:#FFF' ${gradient_var}}", "", false, true}});
   test_nodes({{"gradient", "${gradient '#000 1:#FFF' ${gradient_var} 0}", "", false, true}});
   test_nodes({{"gradient", "${gradient '0:#000 1:#FFF' 0.5}", "#777777"}});
 }
 
+TEST(Node, gradient_batch) {
+  std::stringstream ss{"gradient = ${gradient '0:#000 1:#FFF' 0.5}\n"};
+  node::errorlist err;
+  auto doc = std::make_shared<node::wrapper>();
+  parse_ini(ss, err, doc);
+  auto gradient = std::dynamic_pointer_cast<node::gradient>(doc->get_child_ptr("gradient"_ts));
+  ASSERT_TRUE(gradient);
+  auto& baked = gradient->get_base();
+  EXPECT_EQ(baked.table.size(), node::baked_gradient::resolution + 1);
+
+  // Positions on the table match the gradient exactly, positions outside of it are interpolated as before
+  vector<float> positions{0, 0.25, 0.5, 0.75, 1, -0.5, 1.5};
+  vector<string> colors(positions.size());
+  baked.get_hex(positions.data(), positions.size(), colors.data());
+  for (size_t i = 0; i < positions.size(); i++) {
+    EXPECT_EQ(colors[i], baked.source.get_hex(positions[i]));
+    EXPECT_EQ(colors[i], baked.get_hex(positions[i]));
+  }
+}
+
 TEST(Node, File) {
   test_nodes({
     {"ext", "txt", "txt"},
@@ -177,6 +282,31 @@ TEST(Node, Color) {
   });
 }
 
+TEST(Node, color_memo) {
+  EXPECT_EQ(node::color::pack_hex("#12aBcD"), 0x12abcdu);
+  EXPECT_EQ(node::color::pack_hex("#123"), node::color::no_input);
+  EXPECT_EQ(node::color::pack_hex("#12345g"), node::color::no_input);
+
+  std::stringstream ss{"input = ${var #123456}\ncolor = ${color ${input}}\n"};
+  node::errorlist err;
+  auto doc = std::make_shared<node::wrapper>();
+  parse_ini(ss, err, doc);
+  auto color = std::dynamic_pointer_cast<node::color>(doc->get_child_ptr("color"_ts));
+  ASSERT_TRUE(color);
+  EXPECT_FALSE(color->memo);
+  // Inputs repeat, and some of them share a slot of the memo
+  for (int repeat = 0; repeat < 3; repeat++) {
+    for (int i = 0; i < 200; i++) {
+      char input[8];
+      snprintf(input, 8, "#%06x", i * 0x010305);
+      doc->set<string>("input"_ts, input);
+      EXPECT_EQ(doc->get_child("color"_ts), color->processor.operate(input));
+    }
+  }
+  doc->set<string>("input"_ts, "#abc");
+  EXPECT_EQ(doc->get_child("color"_ts), color->processor.operate("#abc"));
+}
+
 TEST(Node, Clone) {
   test_nodes({
     {"clone_source", "${color #123456 }", "#123456"},
@@ -226,12 +356,539 @@ TEST(Node, Other) {
   test_nodes({{"map", "${map 5:10 7.5}", "1", false, true}});
   test_nodes({
     {"source", "60", "60"},
-    {"cache", "${cache ${source} hello}", "hello", false},
+    {"cache", "${cache ${source} hello}", "hello"},
+  });
+  test_nodes({
+    {"source", "${var float 100.25}", "100.25", false},
+    {"cache", "${cache ${cache 1000 ${source}} 420}", "420"},
   });
   test_nodes({
     {"source", "${var float 100.25}", "100.25", false},
-    {"cache", "${cache ${cache 1000 ${source}} 420}", "420", false},
+    {"cache", "${cache 1000 ${source}}", "100.25", false},
   });
   test_nodes({{"cache", "${cache 123 hello 456}", "hello", false, true}});
   test_nodes({{"cache", "${cache abf hello}", "hello", false, true}});
 }
+
+TEST(Node, tree_handle) {
+  setenv("linkt_handle_test", "first", true);
+  auto load = [](node::errorlist& err) {
+    std::stringstream ss{"num = ${var float 1}\nsmooth = ${smooth 0.5 0.2 ${num}}\n"
+        "cache = ${cache 100000 ${env linkt_handle_test ? none}}\nref = ${smooth}\n"};
+    auto doc = std::make_shared<node::wrapper>();
+    parse_ini(ss, err, doc);
+    return doc;
+  };
+  node::errorlist err;
+  node::tree_handle handle(load(err));
+  auto reference = load(err);
+  auto old_root = handle.get();
+  for (int i = 0; i < 5; i++) {
+    old_root->get_child("smooth"_ts);
+    reference->get_child("smooth"_ts);
+  }
+  EXPECT_EQ(old_root->get_child("cache"_ts), "first");
+  setenv("linkt_handle_test", "second", true);
+
+  // State is carried over to the reloaded tree
+  EXPECT_TRUE(handle.reload(load).get().empty());
+  auto new_root = handle.get();
+  EXPECT_NE(new_root, old_root);
+  EXPECT_EQ(new_root->get_child("smooth"_ts), reference->get_child("smooth"_ts));
+  EXPECT_EQ(new_root->get_child("cache"_ts), "first");
+
+  // The old snapshot stays usable while it's held
+  EXPECT_NO_THROW(old_root->get_child("ref"_ts));
+
+  handle.reload(load, false).wait();
+  EXPECT_EQ(handle.get()->get_child("cache"_ts), "second");
+
+  // A failed reload keeps the current tree
+  auto current = handle.get();
+  EXPECT_THROW(handle.reload([](node::errorlist&) -> node::wrapper_s { throw std::runtime_error("fail"); }).get(), std::runtime_error);
+  EXPECT_EQ(handle.get(), current);
+}
+
+TEST(Node, optimize_time) {
+  // Generate a tree of 50000 keys, where most keys refer to keys of other sections
+  std::stringstream ss;
+  for (int i = 0; i < 10; i++) {
+    auto prev = "s" + std::to_string(i ? i - 1 : 0);
+    ss << "[s" << i << "]\n";
+    for (int j = 0; j < 1000; j++) {
+      auto group = "g" + std::to_string(j);
+      ss << "k" << j << " = v" << i << "\n"
+         << group << ".k = ${" << prev << ".k" << j << "} x\n"
+         << "r" << j << " = ${" << prev << "." << group << ".k}\n"
+         << "c" << j << " = ${cache 1000 ${s" << i << ".r" << j << "}}\n"
+         << "e" << j << " = [${s" << i << ".c" << j << "}]\n";
+    }
+  }
+  node::errorlist err;
+  auto doc = std::make_shared<node::wrapper>();
+  parse_ini(ss, err, doc);
+  EXPECT_TRUE(err.empty());
+
+  node::clone_context context;
+  auto time = get_time_milli();
+  doc->optimize(context);
+  auto optimize_time = get_time_milli() - time;
+  EXPECT_TRUE(context.errors.empty());
+  EXPECT_EQ(doc->get_child("s5.e500"_ts), "[v3 x]");
+  EXPECT_EQ(doc->get_child("s0.e0"_ts), "[v0 x]");
+  if (print_time)
+    cout << "Optimize time of 50000 keys: " << optimize_time << "ms" << endl;
+}
+
+TEST(Node, deduplicate) {
+  std::stringstream ss{"num = ${var float 0.5}\n"
+      "env0 = ${env linkt_dedup ? none}\nenv1 = ${env linkt_dedup ? none}\nenv2 = ${env linkt_dedup ? other}\n"
+      "map0 = ${map 0:1 0:10 ${num}}\nmap1 = ${map 0:1 0:10 ${num}}\nmap2 = ${map 0:1 0:20 ${num}}\n"
+      "cache0 = ${cache 1000 ${cmd 'echo hi'}}\ncache1 = ${cache 1000 ${cmd 'echo hi'}}\n"
+      "cache2 = ${cache 100 ${cmd 'echo hi'}}\ncmd0 = ${cmd 'echo hi'}\ncmd1 = ${cmd 'echo hi'}\n"
+      "str = ${map0} ${map1}\n"};
+  node::errorlist err;
+  auto doc = std::make_shared<node::wrapper>();
+  parse_ini(ss, err, doc);
+  EXPECT_TRUE(err.empty());
+  node::clone_context context;
+  doc->optimize(context);
+  EXPECT_TRUE(context.errors.empty());
+  auto get = [&](const char* path) { return doc->get_child_ptr(tstring(path)); };
+  EXPECT_EQ(get("env0"), get("env1"));
+  EXPECT_NE(get("env0"), get("env2"));
+  EXPECT_EQ(get("map0"), get("map1"));
+  EXPECT_NE(get("map0"), get("map2"));
+  EXPECT_EQ(get("cache0"), get("cache1"));
+  EXPECT_NE(get("cache0"), get("cache2"));
+  // Commands are only shared through the caches over them
+  EXPECT_NE(get("cmd0"), get("cmd1"));
+  // Nodes cloned outside of a tree aren't shared with those of other clones
+  auto env_clone = get("env0")->clone(context);
+  EXPECT_NE(env_clone, get("env0"));
+  EXPECT_NE(env_clone, get("env0")->clone(context));
+
+  // Shared nodes still follow their dependencies
+  EXPECT_EQ(doc->get_child("str"_ts), "5 5");
+  doc->set<float>("num"_ts, 0.2);
+  EXPECT_EQ(doc->get_child("str"_ts), "2 2");
+  EXPECT_EQ(doc->get_child("map2"_ts), "4");
+}
+
+TEST(Node, constant_folding) {
+  std::stringstream ss{"base = hello\nlive = ${var float 0.5}\n"
+      "str = ${base} world\nmap = ${map 0:1 0:10 ${live}}\n"
+      "cache = ${cache 1000 ${map 0:1 0:10 0.5}}\nnested = ${cache 1000 ${cache 100 7}}\n"
+      "fallback = ${env linkt_nexist ? ${str}}\n"};
+  node::errorlist err;
+  auto doc = std::make_shared<node::wrapper>();
+  parse_ini(ss, err, doc);
+  EXPECT_TRUE(err.empty());
+  node::clone_context context;
+  doc->optimize(context);
+  EXPECT_TRUE(context.errors.empty());
+  auto is_plain = [&](const char* path) {
+    auto node = doc->get_child_ptr(tstring(path));
+    return std::dynamic_pointer_cast<node::plain<string>>(node) || std::dynamic_pointer_cast<node::plain<float>>(node)
+        || std::dynamic_pointer_cast<node::plain<int>>(node);
+  };
+  EXPECT_TRUE(is_plain("str"));
+  EXPECT_TRUE(is_plain("cache"));
+  EXPECT_TRUE(is_plain("nested"));
+  EXPECT_FALSE(is_plain("map"));
+  EXPECT_FALSE(is_plain("fallback"));
+  EXPECT_EQ(context.folded_count, 5);
+  EXPECT_EQ(doc->get_child("cache"_ts), "5");
+  EXPECT_EQ(doc->get_child("nested"_ts), "7");
+  EXPECT_EQ(doc->get_child("fallback"_ts), "hello world");
+}
+
+TEST(Node, profile) {
+  std::stringstream ss{"base = ${var float 0.5}\nmid = ${map 0:1 0:10 ${base}}\ntop = ${mid} and ${mid}\n"
+      "fallback = ${env linkt_nexist ? ${mid}}\n"};
+  node::errorlist err;
+  auto doc = std::make_shared<node::wrapper>();
+  parse_ini(ss, err, doc);
+  EXPECT_TRUE(err.empty());
+  node::profiler profiler;
+  size_t bytes = 0;
+  profiler.allocated_bytes = [&] { return bytes += 10; };
+  node::clone_context context;
+  context.profile = &profiler;
+  doc->optimize(context);
+  EXPECT_TRUE(context.errors.empty());
+  EXPECT_EQ(doc->get_child("top"_ts), "5 and 5");
+  EXPECT_EQ(doc->get_child("fallback"_ts), "5");
+
+  // `mid` is cloned early by the reference of `fallback`, but still gets its name
+  auto top = profiler.find("top"), mid = profiler.find("mid"), base = profiler.find("base"),
+      fallback = profiler.find("fallback");
+  ASSERT_TRUE(top && mid && base && fallback);
+  EXPECT_EQ(top->calls, 1);
+  EXPECT_EQ(mid->calls, 3);
+  EXPECT_EQ(base->calls, 3);
+  EXPECT_EQ(fallback->fallbacks, 1);
+  EXPECT_EQ(top->fallbacks, 0);
+  EXPECT_GE(top->inclusive_ns, top->exclusive_ns);
+  // Every key saw the counter move once around its own evaluation
+  EXPECT_EQ(base->allocated_bytes, 30);
+
+  std::stringstream report, folded;
+  profiler.report(report);
+  profiler.write_folded(folded);
+  EXPECT_NE(report.str().find("  top\n"), string::npos);
+  EXPECT_NE(folded.str().find("top;mid;base "), string::npos);
+  EXPECT_NE(folded.str().find("fallback;mid;base "), string::npos);
+
+  // Profiled keys can still be set
+  doc->set<float>("base"_ts, 0.2);
+  EXPECT_EQ(doc->get_child("top"_ts), "2 and 2");
+  EXPECT_EQ(base->calls, 5);
+
+  // Snapshots keep the profiled nodes, without their profiler
+  std::stringstream snapshot;
+  write_snapshot(snapshot, doc);
+  auto data = snapshot.str();
+  auto loaded = read_snapshot(data.data(), data.size());
+  EXPECT_EQ(loaded->get_child("top"_ts), "2 and 2");
+  EXPECT_TRUE(loaded->set<float>("base"_ts, 0.3));
+  EXPECT_EQ(loaded->get_child("fallback"_ts), "3");
+  EXPECT_EQ(base->calls, 5);
+}
+
+TEST(Node, try_get) {
+  std::stringstream ss{"num = ${var float 0.5}\nmissing = ${nexist}\nref_fallback = ${nexist ? none}\n"
+      "cmd_fallback = ${cmd 'exit 3' ? N/A}\ncmd_fail = ${cmd 'exit 3'}\nfile_fallback = ${file /nexist/file ? nofile}\n"
+      "env_fallback = ${env linkt_nexist ? noenv}\nnot_number = abc\nsub_fail = [${num}] ${env linkt_try_get} ${num}\n"};
+  unsetenv("linkt_try_get");
+  node::errorlist err;
+  auto doc = std::make_shared<node::wrapper>();
+  parse_ini(ss, err, doc);
+  EXPECT_TRUE(err.empty());
+  auto check = [&](const node::wrapper_s& doc) {
+    EXPECT_EQ(doc->try_get_child("ref_fallback"_ts).value, "none");
+    EXPECT_EQ(doc->try_get_child("cmd_fallback"_ts).value, "N/A");
+    EXPECT_EQ(doc->try_get_child("file_fallback"_ts).value, "nofile");
+    EXPECT_EQ(doc->try_get_child("env_fallback"_ts).value, "noenv");
+    EXPECT_FALSE(doc->try_get_child("missing"_ts));
+    EXPECT_EQ(doc->try_get_child("cmd_fail"_ts).error, node::failure::unavailable);
+    EXPECT_EQ(doc->try_get_child("nexist"_ts).error, node::failure::missing_key);
+    EXPECT_EQ(doc->get_child("missing"_ts, "fallback"), "fallback");
+    EXPECT_THROW(doc->get_child("missing"_ts), std::exception);
+    // Interpolations fail with the first value that fails
+    EXPECT_EQ(doc->try_get_child("sub_fail"_ts).error, node::failure::unavailable);
+    EXPECT_THROW(doc->get_child("sub_fail"_ts), node::node_error);
+
+    auto num = std::dynamic_pointer_cast<node::base<float>>(doc->get_child_ptr("num"_ts));
+    ASSERT_TRUE(num);
+    EXPECT_EQ(node::try_get(*num).value, 0.5);
+  };
+  check(doc);
+  EXPECT_EQ(doc->try_get_child("missing"_ts).error, node::failure::missing_key);
+  try {
+    doc->get_child("sub_fail"_ts);
+  } catch (const node::node_error& e) {
+    EXPECT_NE(string(e.what()).find("Environment variable not found: linkt_try_get"), string::npos) << e.what();
+  }
+  // References to keys that aren't numbers fail without throwing
+  node::address_ref<float> ref(doc, "not_number"_ts);
+  EXPECT_EQ(node::try_get<float>(ref).error, node::failure::invalid_value);
+
+  node::clone_context context;
+  doc->optimize(context);
+  check(doc);
+  // The values read before the failure are kept in place
+  setenv("linkt_try_get", "a longer value", true);
+  EXPECT_EQ(doc->try_get_child("sub_fail"_ts).value, "[0.5] a longer value 0.5");
+  unsetenv("linkt_try_get");
+}
+
+TEST(Node, try_get_runs_once) {
+  // Failures are thrown with their message, without evaluating the failed node again
+  auto count_path = testing::TempDir() + "linkt_runs_once.txt";
+  std::remove(count_path.data());
+  std::stringstream ss{"count = ${cmd 'echo x >> " + count_path + " && exit 3'}\ncount_ref = ${count}\ncount_sub = [${count}]\n"};
+  node::errorlist err;
+  auto doc = std::make_shared<node::wrapper>();
+  parse_ini(ss, err, doc);
+  EXPECT_TRUE(err.empty());
+  for (auto key : {"count_ref", "count_sub"}) {
+    try {
+      doc->get_child(tstring(key));
+      ADD_FAILURE() << "No exception from " << key;
+    } catch (const node::node_error& e) {
+      EXPECT_NE(string(e.what()).find("exit code: 3"), string::npos) << e.what();
+    }
+  }
+  std::ifstream counted(count_path);
+  string content{std::istreambuf_iterator<char>{counted}, {}};
+  EXPECT_EQ(content, "x\nx\n");
+  std::remove(count_path.data());
+}
+
+TEST(Node, scan) {
+  const char alphabet[] = "ab $?{}()[]'\"\t\n\r\v\f\\x";
+  std::mt19937 random(23);
+  for (unsigned classes = 1; classes < 64; classes++) {
+    node::scan_set set(classes);
+    for (int length : {0, 5, 16, 31, 32, 33, 100}) {
+      string text;
+      for (int i = 0; i < length; i++)
+        text += random() % 4 ? 'a' : alphabet[random() % (sizeof(alphabet) - 1)];
+      auto begin = text.data(), end = begin + text.size();
+      auto expected = std::find_if(begin, end, [&](char c) {
+        return ((classes & node::scan_space) && std::isspace((unsigned char)c))
+            || ((classes & node::scan_quote) && (c == '"' || c == '\''))
+            || ((classes & node::scan_curly) && (c == '{' || c == '}'))
+            || ((classes & node::scan_bracket) && strchr("()[]", c))
+            || ((classes & node::scan_dollar) && c == '$')
+            || ((classes & node::scan_question) && c == '?');
+      });
+      EXPECT_EQ(node::scan(begin, end, set) - begin, expected - begin) << text << " with classes " << classes;
+    }
+  }
+
+  auto find = [](string raw) {
+    tstring value(raw);
+    size_t start, end;
+    if (!node::find_expression(value, raw, start, end))
+      return string("none ") + string(value);
+    return std::to_string(start) + " " + string(value.interval(start, end));
+  };
+  EXPECT_EQ(find("plain $ text {}"), "none plain $ text {}");
+  EXPECT_EQ(find("a ${b ${c}} ${d}"), "2 ${b ${c}}");
+  EXPECT_EQ(find("a \\${b} ${c}"), "7 ${c}");
+  EXPECT_EQ(find("${unclosed"), "none ${unclosed");
+  EXPECT_EQ(find(string(40, 'x') + "${long}"), "40 ${long}");
+}
+
+TEST(Node, get_many) {
+  std::stringstream ss{"[bar]\nleft = ${var left}\nright = ${env linkt_nexist}\ncopy = ${bar.left}\n"
+      "[bar.inner]\nkey = inner\ntext = ${bar.left}-${bar.inner.key}\n"};
+  node::errorlist err;
+  auto doc = std::make_shared<node::wrapper>();
+  parse_ini(ss, err, doc);
+  EXPECT_TRUE(err.empty());
+  auto check = [&](const node::wrapper_s& doc, size_t entries) {
+    auto query = doc->prepare({"bar.left", "bar.right", "bar.copy", "nexist.key", " bar.inner.text ", "bar.left"});
+    EXPECT_EQ(query.size(), 6);
+    EXPECT_EQ(query.entries.size(), entries);
+    vector<string> out(query.size(), "old");
+    node::failure errors[6];
+    EXPECT_EQ(node::wrapper::get_many(query, out.data(), errors), 2);
+    EXPECT_EQ(out, (vector<string>{"left", "", "left", "", "left-inner", "left"}));
+    EXPECT_EQ(errors[0], node::failure::none);
+    EXPECT_NE(errors[1], node::failure::none);
+    EXPECT_EQ(errors[3], node::failure::missing_key);
+
+    // The buffers are reused, and follow the changes of the tree
+    doc->set<string>("bar.left"_ts, "changed");
+    EXPECT_EQ(node::wrapper::get_many(query, out.data()), 2);
+    EXPECT_EQ(out, (vector<string>{"changed", "", "changed", "", "changed-inner", "changed"}));
+    doc->set<string>("bar.left"_ts, "left");
+  };
+  check(doc, 4);
+  // References become direct when optimized, so `bar.copy` is evaluated with `bar.left`
+  node::clone_context context;
+  doc->optimize(context);
+  check(doc, 3);
+}
+
+TEST(Node, view) {
+  std::stringstream ss{"[bar]\nfixed = text\nvar = ${var old}\nsub = ${bar.var}-${bar.fixed}\n"
+      "copy = ${bar.fixed}\ncached = ${cache 100000 ${bar.var}}\nnumber = ${map 1 2 1}\n"};
+  node::errorlist err;
+  auto doc = std::make_shared<node::wrapper>();
+  parse_ini(ss, err, doc);
+  EXPECT_TRUE(err.empty());
+  string scratch;
+  auto fixed = doc->view_child("bar.fixed"_ts, scratch);
+  EXPECT_EQ(fixed, "text");
+  EXPECT_TRUE(scratch.empty());
+  // References return the buffer of their source
+  EXPECT_EQ(doc->view_child("bar.copy"_ts, scratch).data(), fixed.data());
+  EXPECT_EQ(doc->view_child("bar.sub"_ts, scratch), "old-text");
+  EXPECT_EQ(doc->view_child("bar.cached"_ts, scratch), "old");
+#ifdef LINKT_THREAD_SAFE
+  // Buffers guarded by a lock are copied, other threads may rewrite them once unlocked
+  EXPECT_EQ(scratch, "old");
+  scratch.clear();
+#else
+  EXPECT_TRUE(scratch.empty());
+#endif
+  // Nodes without a buffer are written to the scratch string
+  EXPECT_EQ(doc->view_child("bar.number"_ts, scratch), "2");
+  EXPECT_EQ(scratch, "2");
+  EXPECT_THROW(doc->view_child("bar.nexist"_ts, scratch), std::logic_error);
+
+  auto var = doc->view_child("bar.var"_ts, scratch);
+  EXPECT_EQ(var, "old");
+  doc->set<string>("bar.var"_ts, "new");
+  EXPECT_EQ(doc->view_child("bar.var"_ts, scratch), "new");
+  EXPECT_EQ(doc->view_child("bar.sub"_ts, scratch), "new-text");
+#ifdef LINKT_CHECK_VIEWS
+  // Views taken before a change throw when read
+  EXPECT_THROW(var.size(), node::node_error);
+  EXPECT_NO_THROW(fixed.size());
+#endif
+}
+
+TEST(Node, shm) {
+  auto name = "/linkt_test_" + std::to_string(getpid());
+  std::stringstream ss{"[bar]\nvar = ${var old}\nlong = ${var 0123456789}\n"};
+  node::errorlist err;
+  auto source = std::make_shared<node::wrapper>();
+  parse_ini(ss, err, source);
+  std::stringstream readss{"[foo]\nvar = ${shm " + name + " bar.var}\nlong = ${shm " + name + " bar.long ? short}\n"
+      "nexist = ${shm " + name + " bar.nexist ? none}\nsegment = ${shm /linkt_nexist bar.var ? none}\n"};
+  auto reader = std::make_shared<node::wrapper>();
+  parse_ini(readss, err, reader);
+  EXPECT_TRUE(err.empty());
+  EXPECT_THROW(reader->get_child("foo.var"_ts), node::node_error);
+  {
+    node::shm_publisher publisher(name, source, {"bar.var", "bar.long", "bar.nexist"}, 8);
+    // Keys aren't readable until they are published
+    EXPECT_EQ(reader->try_get_child("foo.var"_ts).error, node::failure::unavailable);
+    EXPECT_EQ(publisher.publish(), 2);
+    EXPECT_EQ(reader->get_child("foo.var"_ts), "old");
+    EXPECT_EQ(reader->get_child("foo.long"_ts), "short");
+    EXPECT_EQ(reader->get_child("foo.nexist"_ts), "none");
+    EXPECT_EQ(reader->get_child("foo.segment"_ts), "none");
+
+    source->set<string>("bar.var"_ts, "new");
+    EXPECT_EQ(reader->get_child("foo.var"_ts), "old");
+    publisher.publish();
+    EXPECT_EQ(reader->get_child("foo.var"_ts), "new");
+
+    // The publishing thread picks up changes on its own. The tree may only be changed while it reads it in thread-safe builds
+    source->set<string>("bar.var"_ts, "thread");
+    publisher.start(std::chrono::milliseconds(1));
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+    while (reader->get_child("foo.var"_ts) != "thread" && std::chrono::steady_clock::now() < deadline)
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    EXPECT_EQ(reader->get_child("foo.var"_ts), "thread");
+  }
+  // The segment is removed with its publisher
+  EXPECT_EQ(reader->try_get_child("foo.var"_ts).error, node::failure::unavailable);
+  {
+    node::shm_publisher publisher(name, source, {"bar.var"});
+    publisher.publish();
+    EXPECT_EQ(reader->get_child("foo.var"_ts), "thread");
+  }
+}
+
+TEST(Node, scheduler) {
+  std::stringstream ss{"[bar]\nfixed = text\ntick = ${clock 40 1000 0}\n"
+      "cached = ${cache 100000 ${bar.fixed}}\nline = ${bar.fixed} ${bar.tick}\n"};
+  node::errorlist err;
+  auto doc = std::make_shared<node::wrapper>();
+  parse_ini(ss, err, doc);
+  EXPECT_TRUE(err.empty());
+  using namespace std::chrono;
+
+  // Plain values never change by themselves
+  node::scheduler idle(doc, {"bar.fixed"});
+  EXPECT_EQ(idle.next_deadline(), node::steady_time::max());
+  auto start = steady_clock::now();
+  EXPECT_EQ(idle.wait(start + milliseconds(20)), node::scheduler::wake::timeout);
+  EXPECT_GE(steady_clock::now() - start, milliseconds(20));
+  std::thread notifier([&] { idle.notify(); });
+  EXPECT_EQ(idle.wait(), node::scheduler::wake::notified);
+  notifier.join();
+
+  // The cache hasn't been read, so it needs to be evaluated right away
+  node::scheduler ticking(doc, {"bar.line", "bar.cached"});
+  EXPECT_LE(ticking.next_deadline(), steady_clock::now());
+  doc->get_child("bar.cached"_ts);
+  EXPECT_GT(ticking.next_deadline(), steady_clock::now());
+  // The clock is read through the interpolation, and wakes up on the boundaries of its ticks
+  auto tick = doc->get_child("bar.line"_ts);
+  EXPECT_EQ(ticking.wait(), node::scheduler::wake::deadline);
+  EXPECT_NE(doc->get_child("bar.line"_ts), tick);
+  EXPECT_EQ(ticking.wait(), node::scheduler::wake::deadline);
+  EXPECT_LE(steady_clock::now() - start, milliseconds(500));
+
+  // Once read, the cache expires a long time from now
+  node::scheduler caching(doc, {"bar.cached"});
+  EXPECT_GT(caching.next_deadline(), steady_clock::now() + seconds(50));
+}
+
+TEST(Node, scheduler_poll) {
+  std::stringstream ss{"cmd = ${poll \"sleep 0.05 && echo done\"}\n"};
+  node::errorlist err;
+  auto doc = std::make_shared<node::wrapper>();
+  parse_ini(ss, err, doc);
+  EXPECT_TRUE(err.empty());
+  using namespace std::chrono;
+
+  node::scheduler waiting(doc, {"cmd"});
+  auto cmd = doc->get_child_ptr("cmd"_ts);
+  for (int run = 0; run < 3; run++) {
+    // The command is restarted, usually on the number of the descriptor that it had before
+    cmd->invalidate();
+    doc->get_child("cmd"_ts);
+    auto start = steady_clock::now();
+    EXPECT_EQ(waiting.wait(start + seconds(5)), node::scheduler::wake::descriptor) << "Run: " << run;
+    EXPECT_LE(steady_clock::now() - start, seconds(2));
+    EXPECT_EQ(doc->get_child("cmd"_ts), "done");
+    // The end of the command may be reported after its output, but only once
+    auto next = waiting.wait(steady_clock::now() + milliseconds(20));
+    if (next == node::scheduler::wake::descriptor)
+      next = waiting.wait(steady_clock::now() + milliseconds(20));
+    EXPECT_EQ(next, node::scheduler::wake::timeout);
+  }
+}
+
+TEST(Node, smooth) {
+  auto target = std::make_shared<node::settable_plain<float>>(1);
+  auto make = [&] {
+    auto result = std::make_shared<node::smooth>();
+    result->value = target;
+    result->drag = 0.5;
+    result->spring = 0.2;
+    return result;
+  };
+  auto frame = [](int index) { return node::steady_time(index * node::smooth::substep); };
+  auto value = [](float v) { return std::round(v * 100000) / 100000; };
+
+  // Reads in the same frame don't step it again, and skipped frames are caught up
+  auto smooth = make();
+  EXPECT_EQ(smooth->next_change(), node::steady_time::max());
+  EXPECT_FLOAT_EQ(smooth->advance(1, frame(1000)), 0.2);
+  EXPECT_FLOAT_EQ(smooth->advance(1, frame(1000)), 0.2);
+  EXPECT_EQ(smooth->next_change(), frame(1001));
+  EXPECT_FLOAT_EQ(value(smooth->advance(1, frame(1001))), 0.46);
+  EXPECT_FLOAT_EQ(value(smooth->advance(1, frame(1003))), 0.8774);
+  EXPECT_FLOAT_EQ(smooth->advance(1, frame(1002)), smooth->advance(1, frame(1003)));
+
+  // Once it reaches its target, it rests until the target changes
+  EXPECT_EQ(smooth->advance(1, frame(2000)), 1);
+  EXPECT_TRUE(smooth->at_rest(1));
+  EXPECT_EQ(smooth->next_change(), node::steady_time::max());
+  EXPECT_EQ(smooth->operator float(), 1);
+  EXPECT_FLOAT_EQ(smooth->advance(2, frame(5000)), 1.2);
+
+  // The batch steps every node of a tree the same as reading them one by one
+  auto doc = std::make_shared<node::wrapper>();
+  vector<std::shared_ptr<node::smooth>> batched, separate;
+  for (int i = 0; i < 10; i++) {
+    batched.push_back(make());
+    separate.push_back(make());
+    doc->add("section" + std::to_string(i % 3) + ".smooth" + std::to_string(i), batched.back());
+  }
+  node::smooth_batch batch(doc);
+  EXPECT_EQ(batch.size(), 10);
+  EXPECT_EQ(batch.update(frame(1000)), 10);
+  for (auto& node : separate)
+    node->advance(1, frame(1000));
+  // A node read earlier in the frame isn't stepped again by the batch
+  separate[0]->advance(1, frame(1001));
+  batched[0]->advance(1, frame(1001));
+  EXPECT_EQ(batch.update(frame(1004)), 10);
+  for (auto& node : separate)
+    node->advance(1, frame(1004));
+  for (int i = 0; i < 10; i++)
+    EXPECT_EQ(batched[i]->current.load().current, separate[i]->current.load().current);
+  EXPECT_EQ(batch.update(frame(2000)), 0);
+  EXPECT_EQ(batched[3]->operator float(), 1);
+}
@@ -5,6 +5,9 @@
 #include <linkt/parse.hpp>
 #include <linkt/write.hpp>
 #include <linkt/replace.hpp>
+#include <linkt/snapshot.hpp>
+#include <linkt/node/evaluate.hpp>
+#include <linkt/node/handle.hpp>
 
 #include <iostream>
 #include <cmath>